@@ -0,0 +1 @@
+../../../../../ddekit_header/include/ddekit/trace.h
\ No newline at end of file
@@ -11,6 +11,9 @@ struct dma_mapping_ops *dma_ops;
 #ifdef CONFIG_DMAR
 	void *iommu; /* hook for IOMMU specific extension */
 #endif
+#ifdef DDE_LINUX
+	struct ddekit_dma_ctx *dma_ctx; /* set by soft-iommu on first use */
+#endif
 };
 
 #endif /* _ASM_X86_DEVICE_H */
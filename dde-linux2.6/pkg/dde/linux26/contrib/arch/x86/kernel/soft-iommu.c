@@ -6,12 +6,14 @@
 #include <linux/string.h>
 #include <linux/dma-mapping.h>
 #include <linux/scatterlist.h>
+#include <linux/slab.h>
 
 #include <asm/iommu.h>
 #include <asm/processor.h>
 #include <asm/dma.h>
 
 #include <ddekit/dma.h>
+#include <ddekit/pci.h>
 
 static int
 check_addr(char *name, struct device *hwdev, dma_addr_t bus, size_t size)
@@ -27,28 +29,56 @@ check_addr(char *name, struct device *hwdev, dma_addr_t bus, size_t size)
 	return 1;
 }
 
+/*
+ * Every PCI device maps through its own DDEKit DMA context, looked up once
+ * and kept in the archdata. Other devices use the primary context (NULL).
+ */
+static struct ddekit_dma_ctx *soft_iommu_ctx(struct device *dev)
+{
+	struct ddekit_dma_ctx *ctx;
+	struct pci_dev *pdev;
+
+	if (!dev || dev->bus != &pci_bus_type)
+		return NULL;
+
+	ctx = dev->archdata.dma_ctx;
+	if (unlikely(!ctx)) {
+		pdev = to_pci_dev(dev);
+		ctx = ddekit_pci_get_dma_ctx(pdev->bus->number, PCI_SLOT(pdev->devfn),
+		                             PCI_FUNC(pdev->devfn));
+		if (!ctx)
+			return NULL;
+		dev->archdata.dma_ctx = ctx;
+	}
+	/* follows pci_set_dma_mask() */
+	if (dev->dma_mask && unlikely(ctx->dma_mask != *dev->dma_mask))
+		ddekit_dma_ctx_set_mask(ctx, *dev->dma_mask);
+	return ctx;
+}
+
+static ddekit_dma_dir_t soft_iommu_dir(int direction)
+{
+	switch(direction) {
+		case DMA_TO_DEVICE: return DDEKIT_DMA_TODEVICE;
+		case DMA_FROM_DEVICE: return DDEKIT_DMA_FROMDEVICE;
+		case DMA_BIDIRECTIONAL: return DDEKIT_DMA_BIDIRECTIONAL;
+		default: return DDEKIT_DMA_NONE;
+	}
+}
+
 static dma_addr_t
 soft_iommu_map_single(struct device *hwdev, phys_addr_t paddr, size_t size,
 	       int direction)
 {
 	dma_addr_t bus = paddr;
-	ddekit_dma_dir_t dir;
 
 	WARN_ON(size == 0);
 	if (!check_addr("map_single", hwdev, bus, size))
 				return bad_dma_address;
 	flush_write_buffers();
 
-	switch(direction) {
-		case DMA_TO_DEVICE: dir = DDEKIT_DMA_TODEVICE; break;
-		case DMA_FROM_DEVICE: dir = DDEKIT_DMA_FROMDEVICE; break;
-		case DMA_BIDIRECTIONAL: dir = DDEKIT_DMA_BIDIRECTIONAL; break;
-		case DMA_NONE: dir = DDEKIT_DMA_NONE; break;
-		default: dir = DDEKIT_DMA_NONE;
-	}
-
-	bus = (dma_addr_t) ddekit_dma_map_single((ddekit_addr_t) paddr,
-		        (unsigned) size, dir);
+	bus = (dma_addr_t) ddekit_dma_map_single(soft_iommu_ctx(hwdev), (ddekit_addr_t) paddr,
+		        (unsigned) size, soft_iommu_dir(direction));
 
 	return bus;
 }
@@ -57,18 +87,8 @@ static void
 soft_iommu_unmap_single(struct device *dev, dma_addr_t addr,size_t size,
 	        int direction)
 {
-	ddekit_dma_dir_t dir;
-
-	switch(direction) {
-		case DMA_TO_DEVICE: dir = DDEKIT_DMA_TODEVICE; break;
-		case DMA_FROM_DEVICE: dir = DDEKIT_DMA_FROMDEVICE; break;
-		case DMA_BIDIRECTIONAL: dir = DDEKIT_DMA_BIDIRECTIONAL; break;
-		case DMA_NONE: dir = DDEKIT_DMA_NONE; break;
-		default: dir = DDEKIT_DMA_NONE;
-	}
-
-	return ddekit_dma_unmap_single((ddekit_addr_t) addr, (unsigned) size,
-		        dir);
+	return ddekit_dma_unmap_single(soft_iommu_ctx(dev), (ddekit_addr_t) addr, (unsigned) size,
+		        soft_iommu_dir(direction));
 }
 
 /* Map a set of buffers described by scatterlist in streaming
@@ -86,36 +106,186 @@ soft_iommu_unmap_single(struct device *dev, dma_addr_t addr,size_t size,
  * Device ownership issues as mentioned above for pci_map_single are
  * the same here.
  */
+/* scatterlists up to this length are converted on the stack */
+#define SOFT_IOMMU_SG_MAX 32
+
+static struct ddekit_dma_seg *
+soft_iommu_sg_alloc(struct ddekit_dma_seg *stack, int nents)
+{
+	if (nents <= SOFT_IOMMU_SG_MAX)
+		return stack;
+	return kmalloc(nents * sizeof(*stack), GFP_ATOMIC);
+}
+
+static void
+soft_iommu_sg_free(struct ddekit_dma_seg *segs, struct ddekit_dma_seg *stack)
+{
+	if (segs != stack)
+		kfree(segs);
+}
+
+/*
+ * The whole list goes to ddekit_dma_map_sg(), which maps entries adjacent
+ * in memory as one buffer and needs one system call for all of them. Every
+ * entry keeps its own dma_address, so nents is returned.
+ */
 static int soft_iommu_map_sg(struct device *hwdev, struct scatterlist *sg,
 	       int nents, int direction)
 {
+	struct ddekit_dma_seg stack[SOFT_IOMMU_SG_MAX], *segs;
 	struct scatterlist *s;
-	int i;
+	int i, ret = 0;
 
 	WARN_ON(nents == 0 || sg[0].length == 0);
 
+	segs = soft_iommu_sg_alloc(stack, nents);
+	if (!segs)
+		return 0;
+
 	for_each_sg(sg, s, nents, i) {
 		BUG_ON(!sg_page(s));
-		s->dma_address = sg_phys(s);
-		if (!check_addr("map_sg", hwdev, s->dma_address, s->length))
-			return 0;
-		s->dma_length = s->length;
+		if (!check_addr("map_sg", hwdev, sg_phys(s), s->length))
+			goto out;
+
+		segs[i].addr = sg_phys(s);
+		segs[i].size = s->length;
 	}
+
 	flush_write_buffers();
-	return nents;
+	if (ddekit_dma_map_sg(soft_iommu_ctx(hwdev), segs, nents, soft_iommu_dir(direction)))
+		goto out;
+
+	for_each_sg(sg, s, nents, i) {
+		s->dma_address = segs[i].dma;
+		s->dma_length = s->length;
+	}
+	ret = nents;
+
+out:
+	soft_iommu_sg_free(segs, stack);
+	return ret;
+}
+
+/* call fn for each run of entries ddekit_dma_map_sg() coalesced */
+static void soft_iommu_for_each_run(struct device *hwdev, struct scatterlist *sg,
+	       int nents, int direction,
+	       void (*fn)(struct device *, dma_addr_t, size_t, int))
+{
+	struct scatterlist *s;
+	phys_addr_t end = 0;
+	dma_addr_t dma = 0;
+	size_t size = 0;
+	int i;
+
+	for_each_sg(sg, s, nents, i) {
+		if (size && sg_phys(s) == end && s->dma_address == dma + size) {
+			size += s->dma_length;
+			end += s->dma_length;
+			continue;
+		}
+		if (size)
+			fn(hwdev, dma, size, direction);
+		dma = s->dma_address;
+		size = s->dma_length;
+		end = sg_phys(s) + size;
+	}
+	if (size)
+		fn(hwdev, dma, size, direction);
+}
+
+static void soft_iommu_unmap_sg(struct device *hwdev, struct scatterlist *sg,
+	       int nents, int direction)
+{
+	struct ddekit_dma_seg stack[SOFT_IOMMU_SG_MAX], *segs;
+	struct scatterlist *s;
+	int i;
+
+	segs = soft_iommu_sg_alloc(stack, nents);
+	if (!segs) {
+		/* unmap the runs one by one */
+		soft_iommu_for_each_run(hwdev, sg, nents, direction,
+		                        soft_iommu_unmap_single);
+		return;
+	}
+
+	for_each_sg(sg, s, nents, i) {
+		segs[i].addr = sg_phys(s);
+		segs[i].size = s->dma_length;
+		segs[i].dma = s->dma_address;
+	}
+
+	ddekit_dma_unmap_sg(soft_iommu_ctx(hwdev), segs, nents, soft_iommu_dir(direction));
+	soft_iommu_sg_free(segs, stack);
+}
+
+/*
+ * Bounce buffers are copied for the CPU unless the device only read them,
+ * and for the device unless it only writes them. With IOMMU ddekit returns
+ * without a system call.
+ */
+static void soft_iommu_sync(struct device *hwdev, dma_addr_t handle,
+	       unsigned long offset, size_t size, int direction, int for_cpu)
+{
+	if (for_cpu && direction == DMA_TO_DEVICE)
+		return;
+	if (!for_cpu && direction == DMA_FROM_DEVICE)
+		return;
+
+	ddekit_dma_sync_single(soft_iommu_ctx(hwdev), (ddekit_addr_t) handle, offset, (unsigned) size,
+	        for_cpu ? DDEKIT_DMA_FROMDEVICE : DDEKIT_DMA_TODEVICE);
+}
+
+static void soft_iommu_sync_single_for_cpu(struct device *hwdev,
+	       dma_addr_t handle, size_t size, int direction)
+{
+	soft_iommu_sync(hwdev, handle, 0, size, direction, 1);
+}
+
+static void soft_iommu_sync_single_for_device(struct device *hwdev,
+	       dma_addr_t handle, size_t size, int direction)
+{
+	soft_iommu_sync(hwdev, handle, 0, size, direction, 0);
+}
+
+static void soft_iommu_sync_single_range_for_cpu(struct device *hwdev,
+	       dma_addr_t handle, unsigned long offset, size_t size, int direction)
+{
+	soft_iommu_sync(hwdev, handle, offset, size, direction, 1);
+}
+
+static void soft_iommu_sync_single_range_for_device(struct device *hwdev,
+	       dma_addr_t handle, unsigned long offset, size_t size, int direction)
+{
+	soft_iommu_sync(hwdev, handle, offset, size, direction, 0);
+}
+
+static void soft_iommu_sync_sg_for_cpu(struct device *hwdev,
+	       struct scatterlist *sg, int nelems, int direction)
+{
+	soft_iommu_for_each_run(hwdev, sg, nelems, direction,
+	                        soft_iommu_sync_single_for_cpu);
+}
+
+static void soft_iommu_sync_sg_for_device(struct device *hwdev,
+	       struct scatterlist *sg, int nelems, int direction)
+{
+	soft_iommu_for_each_run(hwdev, sg, nelems, direction,
+	                        soft_iommu_sync_single_for_device);
 }
 
 static void *
 soft_iommu_alloc_coherent(struct device *dev, size_t size,
 	        dma_addr_t *dma_handle, gfp_t gfp)
 {
-	return ddekit_dma_alloc_coherent((int) size, (ddekit_addr_t *) dma_handle);
+	return ddekit_dma_alloc_coherent(soft_iommu_ctx(dev), (int) size,
+	        (ddekit_addr_t *) dma_handle);
 }
 
 static void soft_iommu_free_coherent(struct device *dev, size_t size, void *vaddr,
 				dma_addr_t dma_addr)
 {
-	return ddekit_dma_free_coherent(vaddr, size, (ddekit_addr_t)dma_addr);
+	return ddekit_dma_free_coherent(soft_iommu_ctx(dev), vaddr, size,
+	        (ddekit_addr_t)dma_addr);
 }
 
 struct dma_mapping_ops soft_iommu_dma_ops = {
@@ -124,6 +294,13 @@ struct dma_mapping_ops soft_iommu_dma_ops = {
 	.map_single = soft_iommu_map_single,
 	.unmap_single = soft_iommu_unmap_single,
 	.map_sg = soft_iommu_map_sg,
+	.unmap_sg = soft_iommu_unmap_sg,
+	.sync_single_for_cpu = soft_iommu_sync_single_for_cpu,
+	.sync_single_for_device = soft_iommu_sync_single_for_device,
+	.sync_single_range_for_cpu = soft_iommu_sync_single_range_for_cpu,
+	.sync_single_range_for_device = soft_iommu_sync_single_range_for_device,
+	.sync_sg_for_cpu = soft_iommu_sync_sg_for_cpu,
+	.sync_sg_for_device = soft_iommu_sync_sg_for_device,
 	.is_phys = 1,
 };
 
@@ -7,4 +7,6 @@ void dde_page_cache_add(struct page *p);
 void dde_page_cache_remove(struct page *p);
 struct page* dde_page_lookup(unsigned long va);
 
+int dde_slabinfo(char *buf, int size);
+
 #endif
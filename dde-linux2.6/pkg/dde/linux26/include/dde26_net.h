@@ -34,6 +34,20 @@ static inline int l4dde26_do_rx_callback(struct sk_buff *s)
 	return 0;
 }
 
+
+/** Allocate a streaming DMA buffer for skb data.
+ *
+ * Packet sized blocks come from the pre-mapped DDEKit DMA page pool while
+ * it has pages, everything else from kmalloc(). Free with kfree().
+ */
+void *l4dde26_kmalloc_dma(size_t size, gfp_t flags);
+
+/** Allocate a single page for streaming DMA, preferring the DMA page pool.
+ *
+ * Free with __free_page().
+ */
+struct page *l4dde26_alloc_page_dma(gfp_t gfp_mask);
+
 __END_DECLS
 
 #endif
@@ -29,6 +29,10 @@ extern struct cache_sizes malloc_sizes[];
 #endif
 void *kmem_cache_alloc(struct kmem_cache *, gfp_t);
 void *__kmalloc(size_t size, gfp_t flags);
+#ifdef DDE_LINUX
+void kmem_cache_free_bulk(struct kmem_cache *, size_t, void **);
+void kfree_bulk(size_t, void **);
+#endif
 
 static inline void *kmalloc(size_t size, gfp_t flags)
 {
@@ -0,0 +1,451 @@
+/*
+ * This file is part of DDE/Linux2.6.
+ *
+ * This file is part of TUD:OS and distributed under the terms of the
+ * GNU General Public License 2.
+ * Please see the COPYING-GPL-2 file for details.
+ */
+
+/*
+ * \brief   dma_pool implementation
+ *
+ * In Linux 2.6 this resides in mm/dmapool.c.
+ *
+ * Blocks are carved out of coherent chunks of DMA_POOL_CHUNK bytes, which
+ * come from the DDEKit coherent arena, so growing a pool rarely needs a
+ * system call. Free blocks form singly-linked lists threaded through the
+ * blocks themselves, each free block stores its own bus address.
+ *
+ * Every thread keeps a free list per pool, which only it touches, so
+ * dma_pool_alloc() and dma_pool_free() take no lock in the common case.
+ * Blocks move between the thread lists and the shared list of the pool in
+ * batches of DMA_POOL_BATCH. Blocks cached by a thread that exits stay
+ * unused until the pool is destroyed.
+ */
+
+/* Linux */
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
+#include <linux/dmapool.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+/* DDEKit */
+#include <ddekit/debug.h>
+
+
+/*******************
+ ** Configuration **
+ *******************/
+
+#define DEBUG_DMA_POOL 0
+
+/* bytes requested from dma_alloc_coherent() per chunk, at least */
+#define DMA_POOL_CHUNK      (16 * PAGE_SIZE)
+/* pools with per-thread free lists, further pools share one list */
+#define DMA_POOL_MAX        64
+/* blocks moved between thread and shared free lists at once */
+#define DMA_POOL_BATCH      16
+/* blocks a thread keeps per pool */
+#define DMA_POOL_THREAD_MAX (4 * DMA_POOL_BATCH)
+
+
+/********************
+ ** Implementation **
+ ********************/
+
+/* header of free blocks */
+struct dma_block
+{
+	struct dma_block *next;
+	dma_addr_t        dma;
+};
+
+struct dma_chunk
+{
+	struct list_head  list;
+	void             *vaddr;
+	dma_addr_t        dma;
+	size_t            size;
+};
+
+struct dma_pool
+{
+	char              name[32];
+	struct device    *dev;
+	size_t            size;        /**< block size, multiple of the alignment */
+	size_t            align;
+	size_t            boundary;    /**< blocks do not cross multiples of it */
+	size_t            allocation;  /**< chunk size */
+	int               slot;        /**< per-thread free list, -1 for none */
+	unsigned long     gen;         /**< tags per-thread lists of this pool */
+
+	spinlock_t        lock;        /**< protects chunks and shared free list */
+	struct list_head  chunks;
+	struct dma_block *free;
+	unsigned int      nr_free;
+};
+
+/* free list of a thread for the pool in a slot */
+struct dma_pool_cache
+{
+	unsigned long     gen;         /**< generation of the pool, 0 if unused */
+	struct dma_block *free;
+	unsigned int      nr_free;
+};
+
+static __thread struct dma_pool_cache thread_caches[DMA_POOL_MAX];
+
+static DEFINE_SPINLOCK(dma_pool_slots_lock);
+static DECLARE_BITMAP(dma_pool_slots, DMA_POOL_MAX);
+static unsigned long dma_pool_gen;
+
+
+/**
+ * Return free list of the current thread for pool or NULL
+ *
+ * A list left over from a destroyed pool in the same slot is dropped, its
+ * blocks went with the chunks of that pool.
+ */
+static inline struct dma_pool_cache *dma_pool_thread_cache(struct dma_pool *pool)
+{
+	struct dma_pool_cache *c;
+
+	if (pool->slot < 0)
+		return NULL;
+
+	c = &thread_caches[pool->slot];
+	if (unlikely(c->gen != pool->gen)) {
+		c->gen = pool->gen;
+		c->free = NULL;
+		c->nr_free = 0;
+	}
+	return c;
+}
+
+
+/**
+ * Carve a new chunk into free blocks and put them on the shared free list
+ *
+ * Blocks are aligned by bus address and do not cross the pool boundary.
+ * Called with the pool lock held, which is dropped for the allocation.
+ */
+static int dma_pool_grow(struct dma_pool *pool, gfp_t mem_flags, unsigned long *flags)
+{
+	struct dma_chunk *chunk;
+	struct dma_block *b;
+	dma_addr_t dma, end;
+
+	spin_unlock_irqrestore(&pool->lock, *flags);
+
+	chunk = kmalloc(sizeof(*chunk), mem_flags);
+	if (!chunk)
+		goto err;
+	chunk->size = pool->allocation;
+	chunk->vaddr = dma_alloc_coherent(pool->dev, chunk->size, &chunk->dma, mem_flags);
+	if (!chunk->vaddr) {
+		kfree(chunk);
+		goto err;
+	}
+
+	spin_lock_irqsave(&pool->lock, *flags);
+	list_add(&chunk->list, &pool->chunks);
+
+	end = chunk->dma + chunk->size;
+	for (dma = ALIGN(chunk->dma, pool->align); dma + pool->size <= end; dma += pool->size) {
+		/* skip to the boundary if the block would cross it */
+		if ((dma ^ (dma + pool->size - 1)) & ~(pool->boundary - 1)) {
+			dma = ALIGN(dma + 1, pool->boundary) - pool->size;
+			continue;
+		}
+		b = chunk->vaddr + (dma - chunk->dma);
+		b->dma = dma;
+		b->next = pool->free;
+		pool->free = b;
+		pool->nr_free++;
+	}
+
+	ddekit_log(DEBUG_DMA_POOL, "\"%s\": chunk %p (%zu bytes), %u free",
+	           pool->name, chunk->vaddr, chunk->size, pool->nr_free);
+	return 0;
+
+err:
+	spin_lock_irqsave(&pool->lock, *flags);
+	return -ENOMEM;
+}
+
+
+/**
+ * Take up to DMA_POOL_BATCH blocks from the shared free list
+ *
+ * \return number of blocks put on c
+ */
+static unsigned int dma_pool_refill(struct dma_pool *pool, struct dma_pool_cache *c,
+                                    gfp_t mem_flags)
+{
+	struct dma_block *b;
+	unsigned long flags;
+	unsigned int n = 0;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (!pool->free)
+		dma_pool_grow(pool, mem_flags, &flags);
+	while (pool->free && n < DMA_POOL_BATCH) {
+		b = pool->free;
+		pool->free = b->next;
+		b->next = c->free;
+		c->free = b;
+		n++;
+	}
+	pool->nr_free -= n;
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	c->nr_free += n;
+	return n;
+}
+
+
+/**
+ * Return DMA_POOL_BATCH blocks of c to the shared free list
+ */
+static void dma_pool_drain(struct dma_pool *pool, struct dma_pool_cache *c)
+{
+	struct dma_block *first = c->free, *last = c->free;
+	unsigned long flags;
+	unsigned int n;
+
+	for (n = 1; n < DMA_POOL_BATCH; n++)
+		last = last->next;
+	c->free = last->next;
+	c->nr_free -= DMA_POOL_BATCH;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	last->next = pool->free;
+	pool->free = first;
+	pool->nr_free += DMA_POOL_BATCH;
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+
+/**
+ * dma_pool_create - Creates a pool of consistent memory blocks, for dma.
+ * @name: name of pool, for diagnostics
+ * @dev: device that will be doing the DMA
+ * @size: size of the blocks in this pool.
+ * @align: alignment requirement for blocks; must be a power of two
+ * @boundary: returned blocks won't cross this power of two boundary
+ *
+ * Returns a dma allocation pool with the requested characteristics, or
+ * null if one can't be created.
+ */
+struct dma_pool *dma_pool_create(const char *name, struct device *dev,
+                                 size_t size, size_t align, size_t boundary)
+{
+	struct dma_pool *pool;
+
+	if (align == 0)
+		align = 1;
+	else if (align & (align - 1))
+		return NULL;
+
+	if (size == 0)
+		return NULL;
+	if (size < sizeof(struct dma_block))
+		size = sizeof(struct dma_block);
+	if (align < __alignof__(struct dma_block))
+		align = __alignof__(struct dma_block);
+	size = ALIGN(size, align);
+
+	if (boundary && (boundary < size || (boundary & (boundary - 1))))
+		return NULL;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	strlcpy(pool->name, name, sizeof(pool->name));
+	pool->dev = dev;
+	pool->size = size;
+	pool->align = align;
+	pool->allocation = max_t(size_t, DMA_POOL_CHUNK, PAGE_ALIGN(size + align));
+	/* a power of two beyond any chunk if there is no boundary */
+	pool->boundary = boundary ? boundary : roundup_pow_of_two(2 * pool->allocation);
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->chunks);
+
+	spin_lock(&dma_pool_slots_lock);
+	pool->slot = find_first_zero_bit(dma_pool_slots, DMA_POOL_MAX);
+	if (pool->slot < DMA_POOL_MAX)
+		__set_bit(pool->slot, dma_pool_slots);
+	else
+		pool->slot = -1;
+	pool->gen = ++dma_pool_gen;
+	spin_unlock(&dma_pool_slots_lock);
+
+	ddekit_log(DEBUG_DMA_POOL, "\"%s\": size %zu align %zu boundary %zu slot %d",
+	           pool->name, pool->size, pool->align, pool->boundary, pool->slot);
+
+	return pool;
+}
+EXPORT_SYMBOL(dma_pool_create);
+
+
+/**
+ * dma_pool_destroy - destroys a pool of dma memory blocks.
+ * @pool: dma pool that will be destroyed
+ *
+ * Caller guarantees that no more memory from the pool is in use,
+ * and that nothing will try to use the pool after this call.
+ */
+void dma_pool_destroy(struct dma_pool *pool)
+{
+	struct dma_chunk *chunk, *tmp;
+
+	list_for_each_entry_safe(chunk, tmp, &pool->chunks, list) {
+		dma_free_coherent(pool->dev, chunk->size, chunk->vaddr, chunk->dma);
+		kfree(chunk);
+	}
+
+	if (pool->slot >= 0) {
+		spin_lock(&dma_pool_slots_lock);
+		__clear_bit(pool->slot, dma_pool_slots);
+		spin_unlock(&dma_pool_slots_lock);
+	}
+
+	kfree(pool);
+}
+EXPORT_SYMBOL(dma_pool_destroy);
+
+
+/**
+ * dma_pool_alloc - get a block of consistent memory
+ * @pool: dma pool that will produce the block
+ * @mem_flags: GFP_* bitmask
+ * @handle: pointer to dma address of block
+ *
+ * This returns the kernel virtual address of a currently unused block,
+ * and reports its dma address through the handle.
+ * If such a memory block can't be allocated, %NULL is returned.
+ */
+void *dma_pool_alloc(struct dma_pool *pool, gfp_t mem_flags, dma_addr_t *handle)
+{
+	struct dma_pool_cache *c = dma_pool_thread_cache(pool);
+	struct dma_block *b;
+	unsigned long flags;
+
+	if (likely(c)) {
+		if (!c->free && !dma_pool_refill(pool, c, mem_flags))
+			return NULL;
+		b = c->free;
+		c->free = b->next;
+		c->nr_free--;
+	} else {
+		spin_lock_irqsave(&pool->lock, flags);
+		if (!pool->free)
+			dma_pool_grow(pool, mem_flags, &flags);
+		b = pool->free;
+		if (b) {
+			pool->free = b->next;
+			pool->nr_free--;
+		}
+		spin_unlock_irqrestore(&pool->lock, flags);
+		if (!b)
+			return NULL;
+	}
+
+	*handle = b->dma;
+	return b;
+}
+EXPORT_SYMBOL(dma_pool_alloc);
+
+
+/**
+ * dma_pool_free - put block back into dma pool
+ * @pool: the dma pool holding the block
+ * @vaddr: virtual address of block
+ * @dma: dma address of block
+ *
+ * Caller promises neither device nor driver will again touch this block
+ * unless it is first re-allocated.
+ */
+void dma_pool_free(struct dma_pool *pool, void *vaddr, dma_addr_t dma)
+{
+	struct dma_pool_cache *c = dma_pool_thread_cache(pool);
+	struct dma_block *b = vaddr;
+	unsigned long flags;
+
+	b->dma = dma;
+
+	if (likely(c)) {
+		b->next = c->free;
+		c->free = b;
+		if (++c->nr_free > DMA_POOL_THREAD_MAX)
+			dma_pool_drain(pool, c);
+	} else {
+		spin_lock_irqsave(&pool->lock, flags);
+		b->next = pool->free;
+		pool->free = b;
+		pool->nr_free++;
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+}
+EXPORT_SYMBOL(dma_pool_free);
+
+
+/*
+ * Managed DMA pool
+ */
+static void dmam_pool_release(struct device *dev, void *res)
+{
+	struct dma_pool *pool = *(struct dma_pool **)res;
+
+	dma_pool_destroy(pool);
+}
+
+static int dmam_pool_match(struct device *dev, void *res, void *match_data)
+{
+	return *(struct dma_pool **)res == match_data;
+}
+
+/**
+ * dmam_pool_create - Managed dma_pool_create()
+ *
+ * DMA pool created with this function is automatically destroyed on
+ * driver detach.
+ */
+struct dma_pool *dmam_pool_create(const char *name, struct device *dev,
+                                  size_t size, size_t align, size_t allocation)
+{
+	struct dma_pool **ptr, *pool;
+
+	ptr = devres_alloc(dmam_pool_release, sizeof(*ptr), GFP_KERNEL);
+	if (!ptr)
+		return NULL;
+
+	pool = *ptr = dma_pool_create(name, dev, size, align, allocation);
+	if (pool)
+		devres_add(dev, ptr);
+	else
+		devres_free(ptr);
+
+	return pool;
+}
+EXPORT_SYMBOL(dmam_pool_create);
+
+/**
+ * dmam_pool_destroy - Managed dma_pool_destroy()
+ */
+void dmam_pool_destroy(struct dma_pool *pool)
+{
+	struct device *dev = pool->dev;
+
+	dma_pool_destroy(pool);
+	WARN_ON(devres_destroy(dev, dmam_pool_release, dmam_pool_match, pool));
+}
+EXPORT_SYMBOL(dmam_pool_destroy);
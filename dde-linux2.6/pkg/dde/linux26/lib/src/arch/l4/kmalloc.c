@@ -19,6 +19,11 @@
  * some power of two bytes. For larger allocations ddedkit_large_malloc() is
  * used. This way, we optimize for speed and potentially waste memory
  * resources.
+ *
+ * l4dde26_kmalloc_dma() serves blocks of packet buffer size (DMA_POOL_MIN up
+ * to a page) from the DDEKit streaming DMA page pool while it has pages.
+ * These blocks are mapped for DMA once, so dma_map_single() on skb data costs
+ * a lookup. Plain kmalloc() never touches the pool.
  */
 
 /* Linux */
@@ -33,6 +38,7 @@
 /* DDEKit */
 #include <ddekit/debug.h>
 #include <ddekit/memory.h>
+#include <ddekit/trace.h>
 
 #include <l4/dde/linux26/dde26.h>
 
@@ -59,6 +65,12 @@ EXPORT_SYMBOL(remap_pfn_range);
 
 #define DEBUG_MALLOC 0
 
+/* smallest block (including back-pointer) served from the DMA page pool */
+#define DMA_POOL_MIN (PAGE_SIZE / 4)
+
+/* back-pointer of blocks from the DMA page pool */
+#define DMA_POOL_CACHE ((struct kmem_cache *)1)
+
 /********************
  ** Implementation **
  ********************/
@@ -111,13 +123,17 @@ void kfree(const void *objp)
 {
 	if (!objp) return;
 
+	ddekit_trace_free(DDEKIT_TRACE_KMALLOC, 0, 0, objp);
+
 	/* find cache back-pointer */
 	void **p = (void **)objp - 1;
 
 	ddekit_log(DEBUG_MALLOC, "objp=%p cache=%p (%d)",
 	           p, *p, *p ? kmem_cache_size(*p) : 0);
 
-	if (*p)
+	if (*p == DMA_POOL_CACHE)
+		ddekit_dma_page_free(p);
+	else if (*p)
 		/* free from cache */
 		kmem_cache_free(*p, p);
 	else
@@ -127,14 +143,58 @@ void kfree(const void *objp)
 
 
 /**
- * Allocate memory
- * @size: how many bytes of memory are required.
- * @flags: the type of memory to allocate.
+ * Free several blocks of previously allocated memory
+ * @nr: number of blocks
+ * @p: array of pointers returned by kmalloc, NULL entries are skipped
  *
- * kmalloc is the normal method of allocating memory
- * in the kernel.
+ * Runs of blocks from the same cache are freed with one
+ * kmem_cache_free_bulk() call. The array is used as scratch space.
  */
-void *__kmalloc(size_t size, gfp_t flags)
+void kfree_bulk(size_t nr, void **p)
+{
+	size_t i, run;
+	void **objp;
+	struct kmem_cache *cache;
+
+	if (ddekit_trace_enabled) {
+		for (i = 0; i < nr; i++)
+			if (p[i])
+				ddekit_trace_free(DDEKIT_TRACE_KMALLOC, 0, 0, p[i]);
+	}
+
+	for (i = 0; i < nr; i += run) {
+		if (!p[i]) {
+			run = 1;
+			continue;
+		}
+
+		objp = (void **)p[i] - 1;
+		cache = *objp;
+		if (cache == DMA_POOL_CACHE) {
+			ddekit_dma_page_free(objp);
+			run = 1;
+			continue;
+		}
+		if (!cache) {
+			ddekit_large_free(objp);
+			run = 1;
+			continue;
+		}
+
+		/* collect back-pointer addresses of the run in place */
+		for (run = 0; i + run < nr && p[i + run]; run++) {
+			objp = (void **)p[i + run] - 1;
+			if (*objp != cache)
+				break;
+			p[i + run] = objp;
+		}
+
+		kmem_cache_free_bulk(cache, run, p + i);
+	}
+}
+
+
+static void *kmalloc_internal(size_t size, gfp_t flags, int dma)
 {
 	/* add space for back-pointer */
 	size += sizeof(void *);
@@ -142,8 +202,11 @@ void *__kmalloc(size_t size, gfp_t flags)
 	/* find appropriate cache */
 	struct kmem_cache *cache = find_cache(size);
 
-	void **p;
-	if (cache)
+	void **p = 0;
+	if (dma && size >= DMA_POOL_MIN && size <= PAGE_SIZE &&
+	    (p = ddekit_dma_page_alloc(0)))
+		cache = DMA_POOL_CACHE;
+	else if (cache)
 		/* allocate from cache */
 		p = kmem_cache_alloc(cache, flags);
 	else
@@ -160,18 +223,50 @@ void *__kmalloc(size_t size, gfp_t flags)
 	}
 
 	/* Need to zero out mem? */
-	if (p && (flags & __GFP_ZERO)) {
-		size -= sizeof(void*);
-		memset(p, 0, size);
-	}
+	if (p && (flags & __GFP_ZERO))
+		memset(p, 0, size - sizeof(void *));
+
+	if (p)
+		ddekit_trace_alloc(DDEKIT_TRACE_KMALLOC, cache == DMA_POOL_CACHE ? 0 : cache,
+		                   size - sizeof(void *), p);
 
 	return p;
 }
 
 
+/**
+ * Allocate memory
+ * @size: how many bytes of memory are required.
+ * @flags: the type of memory to allocate.
+ *
+ * kmalloc is the normal method of allocating memory
+ * in the kernel.
+ */
+void *__kmalloc(size_t size, gfp_t flags)
+{
+	return kmalloc_internal(size, flags, 0);
+}
+
+
+/**
+ * Allocate a streaming DMA buffer
+ * @size: how many bytes of memory are required.
+ * @flags: the type of memory to allocate.
+ *
+ * Like kmalloc(), but prefers a pre-mapped page of the DDEKit DMA page pool
+ * for packet sized blocks. Used for skb data; free with kfree().
+ */
+void *l4dde26_kmalloc_dma(size_t size, gfp_t flags)
+{
+	return kmalloc_internal(size, flags, 1);
+}
+
+
 size_t ksize(const void *p)
 {
 	struct kmem_cache *cache = (struct kmem_cache *)*((void**)p - 1);
+	if (cache == DMA_POOL_CACHE)
+		return PAGE_SIZE - sizeof(void *);
 	if (cache)
 		return kmem_cache_size(cache);
 	return -1;
@@ -23,10 +23,14 @@
 
 /* Linux */
 #include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
 
 /* DDEKit */
 #include <ddekit/memory.h>
 #include <ddekit/lock.h>
+#include <ddekit/trace.h>
 
 
 /*******************
@@ -52,8 +56,17 @@ struct kmem_cache
 	struct ddekit_slab *ddekit_slab_cache;    /**< backing DDEKit cache */
 	ddekit_lock_t      cache_lock;            /**< lock */
 	void (*ctor)(void *);                     /**< object constructor */
+
+	struct list_head    list;                 /**< entry in cache_chain */
+	unsigned long       last_allocs;          /**< counters at last slabinfo */
+	unsigned long       last_frees;
+	unsigned long       last_jiffies;
 };
 
+/* all caches, for slabinfo */
+static LIST_HEAD(cache_chain);
+static DEFINE_SPINLOCK(cache_chain_lock);
+
 
 /**
  * Return size of objects in cache
@@ -98,6 +111,7 @@ int kmem_cache_shrink(struct kmem_cache *cache)
 void kmem_cache_free(struct kmem_cache *cache, void *objp)
 {
 	ddekit_log(DEBUG_SLAB_ALLOC, "\"%s\" (%p)", cache->name, objp);
+	ddekit_trace_free(DDEKIT_TRACE_KMEM_CACHE, cache, cache->size, objp);
 
 	ddekit_lock_lock(&cache->cache_lock);
 	ddekit_slab_free(cache->ddekit_slab_cache, objp);
@@ -105,6 +119,30 @@ void kmem_cache_free(struct kmem_cache *cache, void *objp)
 }
 
 
+/**
+ * kmem_cache_free_bulk - Deallocate several objects
+ * @cachep: The cache the allocation was from.
+ * @nr: Number of objects.
+ * @p: Array of previously allocated objects.
+ *
+ * Free several objects, taking the cache lock only once.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *cache, size_t nr, void **p)
+{
+	size_t i;
+
+	ddekit_log(DEBUG_SLAB_ALLOC, "\"%s\" (%d objects)", cache->name, nr);
+	if (ddekit_trace_enabled) {
+		for (i = 0; i < nr; i++)
+			ddekit_trace_free(DDEKIT_TRACE_KMEM_CACHE, cache, cache->size, p[i]);
+	}
+
+	ddekit_lock_lock(&cache->cache_lock);
+	ddekit_slab_free_bulk(cache->ddekit_slab_cache, nr, p);
+	ddekit_lock_unlock(&cache->cache_lock);
+}
+
+
 /**
  * kmem_cache_alloc - Allocate an object
  * @cachep: The cache to allocate from.
@@ -129,6 +167,7 @@ void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
 		cache->ctor(ret);
 
 	ddekit_log(DEBUG_SLAB_ALLOC, "\"%s\" flags=%x (%p, %d)", cache->name, flags, ret, cache->size);
+	ddekit_trace_alloc(DDEKIT_TRACE_KMEM_CACHE, cache, cache->size, ret);
 
 	return ret;
 }
@@ -155,6 +194,10 @@ void kmem_cache_destroy(struct kmem_cache *cache)
 {
 	ddekit_log(DEBUG_SLAB, "\"%s\"", cache->name);
 
+	spin_lock(&cache_chain_lock);
+	list_del(&cache->list);
+	spin_unlock(&cache_chain_lock);
+
 	ddekit_slab_destroy(cache->ddekit_slab_cache);
 	ddekit_simple_free(cache);
 }
@@ -217,10 +260,64 @@ struct kmem_cache * kmem_cache_create(const char *name, size_t size, size_t alig
 	cache->name = name;
 	cache->size = size;
 	cache->ctor = ctor;
+	cache->last_allocs  = 0;
+	cache->last_frees   = 0;
+	cache->last_jiffies = jiffies;
 
 	ddekit_lock_init_unlocked(&cache->cache_lock);
 
-	ddekit_printf("Created cache %p with lock %p\n", cache, &cache->cache_lock);
+	spin_lock(&cache_chain_lock);
+	list_add_tail(&cache->list, &cache_chain);
+	spin_unlock(&cache_chain_lock);
+
+	ddekit_log(DEBUG_SLAB, "created cache %p", cache);
 	
 	return cache;
 }
+
+
+/**
+ * dde_slabinfo - Print cache and DMA memory statistics
+ * @buf: destination buffer
+ * @size: size of @buf
+ *
+ * Writes one line per cache in the style of /proc/slabinfo, followed by
+ * the DDEKit large block and DMA memory statistics. Allocation and free
+ * rates are per second since the previous call. Returns the number of
+ * characters written.
+ */
+int dde_slabinfo(char *buf, int size)
+{
+	struct kmem_cache *cache;
+	struct ddekit_slab_stats s;
+	unsigned long now = jiffies, elapsed;
+	int len;
+
+	len = scnprintf(buf, size, "# name               <active_objs> <num_objs> <objsize> "
+	                "<bytes> <high_water> <allocs/s> <frees/s>\n");
+
+	spin_lock(&cache_chain_lock);
+	list_for_each_entry(cache, &cache_chain, list) {
+		ddekit_slab_get_stats(cache->ddekit_slab_cache, &s);
+
+		elapsed = now - cache->last_jiffies;
+		if (!elapsed)
+			elapsed = 1;
+
+		len += scnprintf(buf + len, size - len, "%-20s %13lu %10lu %9lu %7lu %12lu %10lu %9lu\n",
+		                 cache->name, s.active, s.total, s.obj_size,
+		                 s.total * s.obj_size, s.high_water,
+		                 (s.allocs - cache->last_allocs) * HZ / elapsed,
+		                 (s.frees - cache->last_frees) * HZ / elapsed);
+
+		cache->last_allocs  = s.allocs;
+		cache->last_frees   = s.frees;
+		cache->last_jiffies = now;
+	}
+	spin_unlock(&cache_chain_lock);
+
+	if (len < size - 1)
+		len += ddekit_mem_dump_stats(buf + len, size - len);
+
+	return len;
+}
@@ -36,6 +36,7 @@
 
 /* DDEKit */
 #include <ddekit/memory.h>
+#include <ddekit/trace.h>
 #include <ddekit/assert.h>
 #include <ddekit/panic.h>
 
@@ -150,6 +151,32 @@ struct page * __alloc_pages_internal(gfp_t gfp_mask, unsigned int order,
 }
 
 
+/**
+ * Allocate a single page for streaming DMA
+ *
+ * Prefers a pre-mapped page of the DDEKit DMA page pool and falls back to
+ * alloc_pages(). Used for RX fragment pages; free with __free_page().
+ * Returns NULL if no page is available.
+ */
+struct page *l4dde26_alloc_page_dma(gfp_t gfp_mask)
+{
+	struct page *ret = kmalloc(sizeof(*ret), GFP_KERNEL);
+	if (!ret)
+		return NULL;
+
+	ret->virtual = ddekit_dma_page_alloc(0);
+	if (!ret->virtual)
+		ret->virtual = (void *)__get_free_pages(gfp_mask, 0);
+	if (!ret->virtual) {
+		kfree(ret);
+		return NULL;
+	}
+	dde_page_cache_add(ret);
+
+	return ret;
+}
+
+
 unsigned long __get_free_pages(gfp_t gfp_mask, unsigned int order)
 {
 	ddekit_log(DEBUG_PAGE_ALLOC, "gfp_mask=%x order=%d (%d bytes)",
@@ -157,6 +184,7 @@ unsigned long __get_free_pages(gfp_t gfp_mask, unsigned int order)
 
 	Assert(gfp_mask != GFP_DMA);
 	void *p = ddekit_large_malloc(PAGE_SIZE << order);
+	ddekit_trace_alloc(DDEKIT_TRACE_PAGE, 0, PAGE_SIZE << order, p);
 
 	return (unsigned long)p;
 }
@@ -214,8 +242,11 @@ int get_user_pages(struct task_struct *tsk, struct mm_struct *mm,
 void free_pages(unsigned long addr, unsigned int order)
 {
 	ddekit_log(DEBUG_PAGE_ALLOC, "addr=%p order=%d", (void *)addr, order);
+	ddekit_trace_free(DDEKIT_TRACE_PAGE, 0, PAGE_SIZE << order, addr);
 
-	ddekit_large_free((void *)addr);
+	/* pages from l4dde26_alloc_page_dma() go back to the pool */
+	if (order || ddekit_dma_page_free((void *)addr))
+		ddekit_large_free((void *)addr);
 }
 
 
@@ -75,6 +75,8 @@
 #ifdef DDE_LINUX
 //#include "local.h"
 #include <l4/dde/linux26/dde26_net.h>
+
+extern void __kfree_skb_list(struct sk_buff *skb);
 #endif
 
 #include <asm/uaccess.h>
@@ -1409,7 +1411,14 @@ void dev_kfree_skb_irq(struct sk_buff *skb)
 		sd = &__get_cpu_var(softnet_data);
 		skb->next = sd->completion_queue;
 		sd->completion_queue = skb;
+#ifndef DDE_LINUX
 		raise_softirq_irqoff(NET_TX_SOFTIRQ);
+#else
+		/* NET_TX_SOFTIRQ is still pending while the queue is not
+		 * empty, wake the softirq thread once per batch only */
+		if (!skb->next)
+			raise_softirq_irqoff(NET_TX_SOFTIRQ);
+#endif
 		local_irq_restore(flags);
 	}
 }
@@ -1417,10 +1426,15 @@ EXPORT_SYMBOL(dev_kfree_skb_irq);
 
 void dev_kfree_skb_any(struct sk_buff *skb)
 {
+#ifndef DDE_LINUX
 	if (in_irq() || irqs_disabled())
 		dev_kfree_skb_irq(skb);
 	else
 		dev_kfree_skb(skb);
+#else
+	/* TX cleanup frees skbs here, let net_tx_action free them in batches */
+	dev_kfree_skb_irq(skb);
+#endif
 }
 EXPORT_SYMBOL(dev_kfree_skb_any);
 
@@ -2020,6 +2034,7 @@ static void net_tx_action(struct softirq_action *h)
 		sd->completion_queue = NULL;
 		local_irq_enable();
 
+#ifndef DDE_LINUX
 		while (clist) {
 			struct sk_buff *skb = clist;
 			clist = clist->next;
@@ -2027,6 +2042,11 @@ static void net_tx_action(struct softirq_action *h)
 			WARN_ON(atomic_read(&skb->users));
 			__kfree_skb(skb);
 		}
+#else
+		/* dev_kfree_skb_irq() and dev_kfree_skb_any() batch
+		 * completed skbs here */
+		__kfree_skb_list(clist);
+#endif
 	}
 
 	if (sd->output_queue) {
@@ -62,6 +62,8 @@
 #include <net/checksum.h>
 #ifndef DDE_LINUX
 #include <net/xfrm.h>
+#else /* DDE_LINUX */
+#include <l4/dde/linux26/dde26_net.h>
 #endif /* DDE_LINUX */
 
 //#include "local.h"
@@ -188,8 +190,13 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t gfp_mask,
 		goto out;
 
 	size = SKB_DATA_ALIGN(size);
+#ifndef DDE_LINUX
 	data = kmalloc_node_track_caller(size + sizeof(struct skb_shared_info),
 			gfp_mask, node);
+#else /* DDE_LINUX */
+	data = l4dde26_kmalloc_dma(size + sizeof(struct skb_shared_info),
+			gfp_mask);
+#endif /* DDE_LINUX */
 	if (!data)
 		goto nodata;
 
@@ -264,7 +271,11 @@ struct page *__netdev_alloc_page(struct net_device *dev, gfp_t gfp_mask)
 	int node = dev->dev.parent ? dev_to_node(dev->dev.parent) : -1;
 	struct page *page;
 
+#ifndef DDE_LINUX
 	page = alloc_pages_node(node, gfp_mask, 0);
+#else /* DDE_LINUX */
+	page = l4dde26_alloc_page_dma(gfp_mask);
+#endif /* DDE_LINUX */
 	return page;
 }
 EXPORT_SYMBOL(__netdev_alloc_page);
@@ -327,7 +338,8 @@ static void skb_clone_fraglist(struct sk_buff *skb)
 		skb_get(list);
 }
 
-static void skb_release_data(struct sk_buff *skb)
+/* drop the data reference, return the head if it is to be freed */
+static void *__skb_release_data(struct sk_buff *skb)
 {
 	if (!skb->cloned ||
 	    !atomic_sub_return(skb->nohdr ? (1 << SKB_DATAREF_SHIFT) + 1 : 1,
@@ -341,8 +353,14 @@ static void skb_release_data(struct sk_buff *skb)
 		if (skb_shinfo(skb)->frag_list)
 			skb_drop_fraglist(skb);
 
-		kfree(skb->head);
+		return skb->head;
 	}
+	return NULL;
+}
+
+static void skb_release_data(struct sk_buff *skb)
+{
+	kfree(__skb_release_data(skb));
 }
 
 /*
@@ -429,6 +447,55 @@ void __kfree_skb(struct sk_buff *skb)
 	kfree_skbmem(skb);
 }
 
+#ifdef DDE_LINUX
+#define SKB_FREE_BULK 16
+
+/**
+ *	__kfree_skb_list - free a list of sk_buffs
+ *	@skb: first buffer, further buffers are linked through skb->next
+ *
+ *	Like __kfree_skb() on each buffer, but data heads are kfree_bulk()ed
+ *	and plain sk_buff shells returned to skbuff_head_cache in batches.
+ *	The buffers must not have users left, as on the softnet completion
+ *	queue.
+ */
+void __kfree_skb_list(struct sk_buff *skb)
+{
+	void *shells[SKB_FREE_BULK];
+	void *heads[SKB_FREE_BULK];
+	struct sk_buff *next;
+	unsigned nr = 0, nr_heads = 0;
+
+	for (; skb; skb = next) {
+		next = skb->next;
+
+		WARN_ON(atomic_read(&skb->users));
+		skb_release_head_state(skb);
+		if ((heads[nr_heads] = __skb_release_data(skb)) &&
+		    ++nr_heads == SKB_FREE_BULK) {
+			kfree_bulk(nr_heads, heads);
+			nr_heads = 0;
+		}
+
+		if (skb->fclone != SKB_FCLONE_UNAVAILABLE) {
+			kfree_skbmem(skb);
+			continue;
+		}
+
+		shells[nr++] = skb;
+		if (nr == SKB_FREE_BULK) {
+			kmem_cache_free_bulk(skbuff_head_cache, nr, shells);
+			nr = 0;
+		}
+	}
+
+	if (nr_heads)
+		kfree_bulk(nr_heads, heads);
+	if (nr)
+		kmem_cache_free_bulk(skbuff_head_cache, nr, shells);
+}
+#endif /* DDE_LINUX */
+
 /**
  *	kfree_skb - free an sk_buff
  *	@skb: buffer to free
@@ -22,9 +22,6 @@
 #include "ddekit/dma.h"
 #include "uio_dma.h"
 
-#define DMA_MODE_BOUNCE 0
-#define DMA_MODE_MAP    1
-
 struct class *dma_class;
 int dma_major;
 
@@ -114,7 +111,7 @@ virtualize_store(struct device *dev, struct device_attribute *attr, const char *
 
 	sscanf(buf, "%d", &val);
 	if(val) {
-		switch_dma_mode(ddev, DMA_MODE_MAP);
+		switch_dma_mode(ddev, DMA_MODE_IOMMU);
 	} else {
 		switch_dma_mode(ddev, DMA_MODE_BOUNCE);
 	}
@@ -143,17 +140,21 @@ static ssize_t debug_show(struct device * dev, struct device_attribute *attr, ch
 static ssize_t ring_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len)
 {
 	struct uio_dma_device *ddev;
-	iova_page_t *page;
-	void *addr;
+	struct dma_op_list *entry;
+	struct hlist_node *node;
+	int i;
 
 	ddev = dev_get_drvdata(dev);
 
-	list_for_each_entry(page, &ddev->cont_head, next) {
-		addr = kmap(page->page);
-		printk("Dumping page 0x%08x from %p with offset 0x%08x and size %d\n", page->pfn, (void*) addr, page->offset, page->size);
-		print_hex_dump(KERN_DEBUG, "", DUMP_PREFIX_ADDRESS, 16, 1, addr+page->offset, page->size , false);
-		kunmap(page->page);
+	/* dump the coherent memory, i.e., the descriptor rings */
+	spin_lock(&ddev->cont_lock);
+	for(i = 0; i < DMA_HASH_SIZE; i++) {
+		hlist_for_each_entry(entry, node, &ddev->cont_hash[i], next) {
+			printk("Dumping 0x%lx from %p with size %lu\n", entry->op.iova, entry->kva, entry->op.size);
+			print_hex_dump(KERN_DEBUG, "", DUMP_PREFIX_ADDRESS, 16, 1, entry->kva, entry->op.size, false);
+		}
 	}
+	spin_unlock(&ddev->cont_lock);
 
 	return len;
 }
@@ -181,46 +182,111 @@ out:
 	return len;
 }
 
-extern volatile unsigned int map_min, map_avg, map_max;
-extern volatile unsigned int unmap_min, unmap_avg, unmap_max;
-extern volatile u64 memcpy_duration[1024];
-extern volatile int memcpy_index;
+static const char *const dma_stat_names[DMA_STAT_OPS] = {
+	"map", "unmap", "translate", "sync", "copy"
+};
 
+/**
+ * Print current mapping counts, then per operation the number of calls, the
+ * average latency and the log2 latency histogram as "bucket:count" pairs,
+ * where bucket b counts calls of less than 2^b ns
+ */
 static ssize_t stats_show(struct device * dev, struct device_attribute *attr, char *buf)
 {
-	u32 min = UINT_MAX, max = 0, avg = 0, duration, size;
-	int i;
-	int n = 0;
-	n += snprintf(buf+n, PAGE_SIZE - n, "Stat  min avg max\n");
-	n += snprintf(buf+n, PAGE_SIZE - n, "-----------------\n");
-	//n += snprintf(buf+n, PAGE_SIZE - n, "Map   %3d %3d %3d\n", map_min, map_avg, map_max);
-	n += snprintf(buf+n, PAGE_SIZE - n, "Unmap %3d %3d %3d\n", unmap_min, unmap_avg, unmap_max);
-	unmap_min = UINT_MAX;
-	unmap_max = 0;
-	for(i = 0; i < memcpy_index; i++) {
-		duration = memcpy_duration[i] & 0xffff;
-		size = memcpy_duration[i] >> 32;
-		printk("%d %d\n", duration, size);
-		if(duration < min)
-			min = duration;
-		if(duration > max)
-			max = duration;
-		avg += duration;
+	struct uio_dma_device *ddev = dev_get_drvdata(dev);
+	struct dma_stats *stats = &ddev->stats;
+	unsigned long count, calls;
+	int op, i;
+	ssize_t n = 0;
+
+	n += scnprintf(buf+n, PAGE_SIZE - n, "inflight %ld\npinned %ld\niommu %ld\nbounced %lld\n",
+	               atomic_long_read(&stats->inflight), atomic_long_read(&stats->pinned),
+	               atomic_long_read(&stats->iommu_mapped), (long long)atomic64_read(&stats->bounced));
+	n += scnprintf(buf+n, PAGE_SIZE - n, "reg %u hits %lld misses %lld\n", ddev->reg_nr,
+	               (long long)atomic64_read(&stats->reg_hits), (long long)atomic64_read(&stats->reg_misses));
+
+	for(op = 0; op < DMA_STAT_OPS; op++) {
+		calls = 0;
+		for(i = 0; i < DDEKIT_DMA_HIST_BUCKETS; i++)
+			calls += atomic_long_read(&stats->hist[op][i]);
+		n += scnprintf(buf+n, PAGE_SIZE - n, "%s %lu %lld", dma_stat_names[op], calls,
+		               calls ? (long long)div64_u64(atomic64_read(&stats->ns[op]), calls) : 0LL);
+		for(i = 0; i < DDEKIT_DMA_HIST_BUCKETS; i++) {
+			count = atomic_long_read(&stats->hist[op][i]);
+			if(count)
+				n += scnprintf(buf+n, PAGE_SIZE - n, " %d:%lu", i, count);
+		}
+		n += scnprintf(buf+n, PAGE_SIZE - n, "\n");
 	}
-	printk("\n");
-	if(!avg)
-		avg = 1;
-	printk("min: %d, max: %d: avg: %d, entries: %d\n", min, max, avg/memcpy_index, memcpy_index);
 	return n;
 }
 
+/* any write resets the histograms, the bounce byte count and the cache hits */
+static ssize_t stats_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct uio_dma_device *ddev = dev_get_drvdata(dev);
+	int op, i;
+
+	for(op = 0; op < DMA_STAT_OPS; op++) {
+		for(i = 0; i < DDEKIT_DMA_HIST_BUCKETS; i++)
+			atomic_long_set(&ddev->stats.hist[op][i], 0);
+		atomic64_set(&ddev->stats.ns[op], 0);
+	}
+	atomic64_set(&ddev->stats.bounced, 0);
+	atomic64_set(&ddev->stats.reg_hits, 0);
+	atomic64_set(&ddev->stats.reg_misses, 0);
+	return len;
+}
+
+static DEFINE_MUTEX(selftest_lock);
+
+/**
+ * Run the map/unmap latency selftest with up to the written number of live
+ * mappings, the result is read from the same attribute. The write fails
+ * with ERANGE if the test failed.
+ */
+static ssize_t selftest_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct uio_dma_device *ddev = dev_get_drvdata(dev);
+	unsigned int max = 0;
+	ssize_t ret;
+
+	sscanf(buf, "%u", &max);
+
+	mutex_lock(&selftest_lock);
+	if(!ddev->selftest)
+		ddev->selftest = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	if(!ddev->selftest) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = dma_selftest(ddev, max, ddev->selftest, PAGE_SIZE);
+	if(ret >= 0)
+		ret = len;
+out:
+	mutex_unlock(&selftest_lock);
+	return ret;
+}
+
+static ssize_t selftest_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct uio_dma_device *ddev = dev_get_drvdata(dev);
+	ssize_t n = 0;
+
+	mutex_lock(&selftest_lock);
+	if(ddev->selftest)
+		n = scnprintf(buf, PAGE_SIZE, "%s", ddev->selftest);
+	mutex_unlock(&selftest_lock);
+	return n;
+}
 
 static DEVICE_ATTR(debug, S_IRUGO | S_IWUGO, debug_show, debug_store);
 static DEVICE_ATTR(iommu, S_IRUGO, iommu_show, NULL);
 static DEVICE_ATTR(virtualize, S_IRUGO | S_IWUGO, virtualize_show, virtualize_store);
 static DEVICE_ATTR(ring, S_IWUGO, NULL, ring_store);
 static DEVICE_ATTR(desc, S_IWUGO, NULL, desc_store);
-static DEVICE_ATTR(stats, S_IRUGO, stats_show, NULL);
+static DEVICE_ATTR(stats, S_IRUGO | S_IWUSR, stats_show, stats_store);
+static DEVICE_ATTR(selftest, S_IRUGO | S_IWUSR, selftest_show, selftest_store);
 
 static struct attribute *attrs[] = {
 	&dev_attr_iommu.attr,
@@ -229,6 +295,7 @@ static struct attribute *attrs[] = {
 	&dev_attr_ring.attr,
 	&dev_attr_desc.attr,
 	&dev_attr_stats.attr,
+	&dev_attr_selftest.attr,
 	NULL,
 };
  
@@ -240,12 +307,20 @@ static int
 dma_open(struct inode *inode, struct file *fp)
 {
 	struct uio_dma_device *ddev;
+	int ref;
 
 	spin_lock(&minor_lock);
 	ddev = idr_find(&dma_idr, iminor(inode));
 	spin_unlock(&minor_lock);
 
-	atomic_inc(&ddev->ref_cnt);
+	do {
+		ref = atomic_read(&ddev->ref_cnt);
+		if(ref == DMA_REF_SELFTEST)
+			return -EBUSY;
+	} while(atomic_cmpxchg(&ddev->ref_cnt, ref, ref + 1) != ref);
+
+	if(!ref && ddev->dma_ops == &uio_bounce_ops)
+		dma_bounce_pool_fill(ddev);
 
 	fp->private_data = ddev;
 
@@ -256,45 +331,33 @@ static int
 dma_release(struct inode *inode, struct file *fp)
 {
 	struct uio_dma_device *ddev = fp->private_data;
-	iova_page_t *page, *n;
-	struct dma_op_list *entry, *next_entry;
+	struct dma_op_list *entry;
+	struct hlist_node *node, *tmp;
+	int i;
 	/**
 	 * decrement reference count and free all resources, if this was
 	 * the last open file descriptor to this device
 	 */
 	if(atomic_dec_and_test(&ddev->ref_cnt)) {
+		dma_ring_destroy(ddev);
+
 		spin_lock(&ddev->cont_lock);
-		list_for_each_entry_safe(entry, next_entry, &ddev->cont_head, next) {
-			list_del(&entry->next);
-			dma_free_coherent(ddev->pdev, entry->op.size, entry->kva, (dma_addr_t)entry->op.iova);
-			kfree(entry);
+		for(i = 0; i < DMA_HASH_SIZE; i++) {
+			hlist_for_each_entry_safe(entry, node, tmp, &ddev->cont_hash[i], next) {
+				hlist_del(&entry->next);
+				dma_free_coherent(ddev->pdev, entry->op.size, entry->kva, (dma_addr_t)entry->op.iova);
+				kfree(entry);
+			}
 		}
 		spin_unlock(&ddev->cont_lock);
 
-		spin_lock(&ddev->bounce_lock);
-		list_for_each_entry_safe(entry, next_entry, &ddev->bounce_head, next) {
-			list_del(&entry->next);
-			
-			if(entry->op.direction == DDEKIT_DMA_FROMDEVICE) {
-				copy_to_user((void*)entry->op.va, (const void*)entry->kva, entry->op.size);
-			}
-			dma_free_coherent(ddev->pdev, entry->op.size, entry->kva, (dma_addr_t)entry->op.iova);
-			entry->op.iova = 0;
-			kfree(entry);
-		
-		}
-		spin_unlock(&ddev->bounce_lock);
+		dma_bounce_release_all(ddev);
+
+		dma_region_release_all(ddev);
 	
-		list_for_each_entry_safe(page, n, &ddev->iova_page_list, next) {
-			list_del(&page->next);
-			printk("Removing page mapping 0x%x\n", page->pfn);
-			if(iommu_iova_to_phys(ddev->domain, page->pfn << PAGE_SHIFT))
-				iommu_unmap(ddev->domain, page->pfn << PAGE_SHIFT, get_order(PAGE_SIZE));
-			else
-				printk("Page 0x%x already unmapped\n", page->pfn);
-			kfree(page);
-		}
+		dma_iommu_release_all(ddev);
 
+		atomic_long_set(&ddev->stats.inflight, 0);
 	}
 	printk("%s: closing fd, ref_cnt now: %d\n", __func__, atomic_read(&ddev->ref_cnt));
 	wake_up_interruptible(&ddev->close);
@@ -313,15 +376,12 @@ dma_mmap_coherent(struct vm_area_struct *vma, struct dma_mapping *mapping/*void
 {
 	unsigned long size;
 	unsigned long offset = vma->vm_pgoff, usize;
-	printk("%s\n", __func__);	
-
 	size = mapping->op.size;
 
 	mapping->nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
-	printk("%s: size: %lu\n", __func__, size);
 	usize = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
-	printk("%s: pages: %lu\n", __func__, usize);
-	printk("%s: offset: %lu\n", __func__, offset);
+	if(debug)
+		printk("%s: size: %lu, pages: %lu, offset: %lu\n", __func__, size, usize, offset);
 
 	if (offset >= size || usize > (size - offset)) {
 		return -ENXIO;
@@ -340,7 +400,9 @@ iommu_mmap(struct file *fp, struct vm_area_struct *vma)
 
 	struct uio_dma_device *ddev = fp->private_data;
 
-	printk("%s\n", __func__);	
+	if (vma->vm_pgoff == DMA_RING_PGOFF)
+		return dma_ring_mmap(ddev, vma);
+
 	if (vma->vm_end < vma->vm_start)
 		return -EINVAL;
 
@@ -362,11 +424,11 @@ iommu_mmap(struct file *fp, struct vm_area_struct *vma)
 		goto err_remap;
 	}
 
-	if(mapping->op.size >= 4096)
+	if(debug)
 		printk("%s: 0x%lx %p 0x%lx 0x%0lx\n", __func__, mapping->op.iova, mapping->kva, mapping->op.va, __pa(mapping->kva));
 	vma->vm_flags |= VM_RESERVED;
 	spin_lock(&ddev->cont_lock);
-	list_add(&mapping->next, &ddev->cont_head);
+	hlist_add_head(&mapping->next, dma_hash(ddev->cont_hash, mapping->op.va));
 	spin_unlock(&ddev->cont_lock);
 	
 	return 0;
@@ -379,6 +441,76 @@ err:
 	return ret;
 }
 
+/**
+ * Map or unmap a batch of buffers with one system call
+ *
+ * A failing map operation unmaps the ones mapped before it, so either all
+ * or none of the buffers are mapped.
+ */
+static long
+dma_ioctl_batch(struct uio_dma_device *ddev, unsigned int cmd, unsigned long arg)
+{
+	long ret = 0;
+	unsigned int i;
+	struct dma_batch batch;
+	struct dma_op_list *ops;
+	struct dma_op __user *uops;
+
+	if(copy_from_user(&batch, (const void __user *)arg, sizeof(batch)))
+		return -EFAULT;
+
+	if(!batch.nr || batch.nr > DMA_BATCH_MAX)
+		return -EINVAL;
+
+	uops = (struct dma_op __user *)batch.ops;
+	if(!access_ok(VERIFY_WRITE, uops, batch.nr * sizeof(struct dma_op)))
+		return -EFAULT;
+
+	ops = kcalloc(batch.nr, sizeof(*ops), GFP_KERNEL);
+	if(!ops)
+		return -ENOMEM;
+
+	for(i = 0; i < batch.nr; i++) {
+		if(__copy_from_user(&ops[i].op, &uops[i], sizeof(struct dma_op))) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+
+	if(cmd == DMA_MAP_BATCH) {
+		for(i = 0; i < batch.nr; i++) {
+			if((ret = dma_op_map(&ops[i], ddev)))
+				break;
+		}
+		if(ret) {
+			while(i--)
+				dma_op_unmap(&ops[i], ddev);
+			goto out;
+		}
+		for(i = 0; i < batch.nr; i++) {
+			if(__put_user(ops[i].op.iova, &uops[i].iova)) {
+				ret = -EFAULT;
+				goto out;
+			}
+		}
+	} else {
+		/* unmap as much as possible, report the first error */
+		long err;
+		for(i = 0; i < batch.nr; i++) {
+			if((err = dma_op_unmap(&ops[i], ddev)) && !ret)
+				ret = err;
+		}
+	}
+
+	batch.done = i;
+	if(put_user(batch.done, &((struct dma_batch __user *)arg)->done))
+		ret = -EFAULT;
+
+out:
+	kfree(ops);
+	return ret;
+}
+
 static long 
 dma_ioctl(struct file * fp, unsigned int cmd, unsigned long arg)
 {
@@ -398,6 +530,19 @@ dma_ioctl(struct file * fp, unsigned int cmd, unsigned long arg)
 	if(ret)
 		return -EFAULT;
 
+	/* without a polling thread, queued submissions run first */
+	dma_ring_enter(ddev);
+
+	if(cmd == DMA_RING_ENTER)
+		return 0;
+	if(cmd == DMA_GET_MODE)
+		return put_user(ddev->dma_ops == &uio_iommu_ops ? DMA_MODE_IOMMU : DMA_MODE_BOUNCE,
+		                (unsigned int __user *)arg);
+	if(cmd == DMA_RING_SETUP)
+		return dma_ring_setup(ddev, arg);
+	if(cmd == DMA_MAP_BATCH || cmd == DMA_UNMAP_BATCH)
+		return dma_ioctl_batch(ddev, cmd, arg);
+
 	op = (struct dma_op_list *) kzalloc(sizeof(*op), GFP_KERNEL);
 	if(!op)
 		return -ENOMEM;
@@ -406,21 +551,45 @@ dma_ioctl(struct file * fp, unsigned int cmd, unsigned long arg)
 	
 	switch(cmd) {
 		case (DMA_MAP): {
-			ret = ddev->dma_ops->map(op, ddev);
+			ret = dma_op_map(op, ddev);
 			break;
 		}
 		case (DMA_UNMAP): {
-			ret = ddev->dma_ops->unmap(op, ddev);
+			ret = dma_op_unmap(op, ddev);
 			break;
 		}
 		case (DMA_TRANSLATE): {
-			ret = ddev->dma_ops->translate(op, ddev);
+			ret = dma_op_translate(op, ddev);
 			break;
 		}
 		case (DMA_FREE): {
 			ret = ddev->dma_ops->free(op, ddev);
 			break;
 		}
+		case (DMA_REGISTER): {
+			ret = dma_region_register(op, ddev);
+			break;
+		}
+		case (DMA_UNREGISTER): {
+			ret = dma_region_unregister(op, ddev);
+			break;
+		}
+		case (DMA_IOMMU_MAP): {
+			ret = dma_region_map_iommu(op, ddev);
+			break;
+		}
+		case (DMA_IOMMU_UNMAP): {
+			ret = dma_region_unmap_iommu(op, ddev);
+			break;
+		}
+		case (DMA_LOOKUP): {
+			ret = dma_iova_lookup(op, ddev);
+			break;
+		}
+		case (DMA_SYNC): {
+			ret = dma_op_sync(op, ddev);
+			break;
+		}
 		default: ret = -ENOTTY;
 	}
 	
@@ -436,11 +605,18 @@ dma_ioctl(struct file * fp, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+static unsigned int
+dma_poll(struct file *fp, poll_table *wait)
+{
+	return dma_ring_poll(fp->private_data, fp, wait);
+}
+
 static const struct file_operations dma_fops = {
 	.owner		= THIS_MODULE,
 	.open		= dma_open,
 	.release	= dma_release,
 	.mmap		= iommu_mmap,
+	.poll		= dma_poll,
 	.unlocked_ioctl = dma_ioctl,
 };
 
@@ -576,7 +752,7 @@ __uio_dma_register(struct module *owner, struct device *parent, struct uio_devic
 	// to really init, ddev->virtualize has to be different, so the requested mode
 	// really gets set
 	ddev->virtualize = DMA_MODE_BOUNCE;
-	switch_dma_mode(ddev, DMA_MODE_MAP);
+	switch_dma_mode(ddev, DMA_MODE_IOMMU);
 
 	ret = sysfs_create_group(&ddev->dev->kobj, &attr_grp);
 	if(ret)
@@ -587,11 +763,15 @@ __uio_dma_register(struct module *owner, struct device *parent, struct uio_devic
 	atomic_set(&ddev->ref_cnt, 0);
 	
 	spin_lock_init(&ddev->bounce_lock);
+	dma_bounce_pool_init(ddev);
 	spin_lock_init(&ddev->cont_lock);
+	spin_lock_init(&ddev->region_lock);
+	mutex_init(&ddev->iova_lock);
+	dma_iommu_flush_init(ddev);
+	mutex_init(&ddev->ring_lock);
 	
-	INIT_LIST_HEAD(&ddev->bounce_head);
-	INIT_LIST_HEAD(&ddev->cont_head);
-	INIT_LIST_HEAD(&ddev->iova_page_list);
+	/* the hash tables are empty as ddev is zeroed */
+	INIT_LIST_HEAD(&ddev->region_head);
 	
 	*ddev_ptr = ddev;
 
@@ -643,6 +823,7 @@ uio_dma_unregister(struct uio_dma_device *ddev)
 	printk("%s: minor_put\n", __func__);
 	dma_minor_put(ddev);
 	printk("%s: kfree\n", __func__);
+	kfree(ddev->selftest);
 	kfree(ddev);
 	printk("%s: return\n", __func__);
 
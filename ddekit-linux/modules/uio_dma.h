@@ -1,8 +1,16 @@
 #pragma once
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/hash.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/mmu_notifier.h>
 #include "ddekit/dma.h"
 
 struct uio_device;
 struct uio_dma_device;
+struct dma_ring_ctx;
 
 /*
 struct kmem_page_mem {
@@ -14,35 +22,110 @@ struct kmem_page_mem {
 };
 */
 
+/* buckets of the per-device lookup tables */
+#define DMA_HASH_BITS 10
+#define DMA_HASH_SIZE (1 << DMA_HASH_BITS)
+
+/* bounce buffer size classes, 256 bytes to 16 KB */
+#define DMA_BOUNCE_MIN_SHIFT 8
+#define DMA_BOUNCE_CLASSES   7
+/* buffers per size class allocated at open and kept free at most */
+#define DMA_BOUNCE_PREALLOC  32
+#define DMA_BOUNCE_MAX_FREE  256
+/* ref_cnt of a device claimed by the selftest */
+#define DMA_REF_SELFTEST (-1)
+
+/* pinned user ranges kept in the registration cache */
+#define DMA_REG_MAX 1024
+
 struct dma_op_list {
-	struct dma_op    op;
-	void             *kva;
-	struct list_head next;
+	struct dma_op     op;
+	void              *kva;
+	struct hlist_node next;
 };
 
 struct dma_mapping {
-	struct dma_op    op;
-	void             *kva;
-	struct list_head next;
+	struct dma_op     op;
+	void              *kva;
+	struct hlist_node next;
 	int              offset;
 	int              nr_pages;
 	struct page      **page_list;
 };
 
-typedef struct iova_page {
-	unsigned int pfn;
-	unsigned int offset;
-	unsigned int size;
-	atomic_t ref_count;
-	struct page *page;
+/*
+ * a pinned user buffer, physically contiguous (e.g. a huge page) unless it
+ * is mapped in the IOMMU domain
+ */
+struct dma_region {
+	struct dma_op    op;
+	int              nr_pages;
+	int              mapped;     /* region is mapped in the IOMMU domain */
+	unsigned char    *orders;    /* IOMMU page order, per first page of a mapping */
+	struct page      **page_list;
 	struct list_head next;
+};
+
+/* IOMMU mapping of 1 << order pinned, physically contiguous pages */
+typedef struct iova_page {
+	unsigned long pfn;       /* iova >> PAGE_SHIFT, aligned to the order */
+	unsigned int order;
+	atomic_t ref_count;      /* 0 while queued for unmapping */
+	struct page *page;       /* first page */
+	struct hlist_node next;
+	struct list_head lazy;   /* flush queue */
 } iova_page_t;
 
+/*
+ * a cached registration of nr pages of mm from pfn on, it holds a reference
+ * to each of their IOVA mappings, which keeps the pages pinned and mapped
+ */
+struct dma_reg {
+	struct mm_struct  *mm;
+	unsigned long     pfn;       /* va >> PAGE_SHIFT */
+	unsigned long     nr;
+	struct hlist_node next;      /* by pfn */
+	struct list_head  lru;       /* least recently used first, or on the dead list */
+};
+
+#ifdef CONFIG_MMU_NOTIFIER
+/* drops the registrations of an address space that is unmapped or changed */
+struct dma_reg_notifier {
+	struct mmu_notifier   mn;
+	struct mm_struct      *mm;
+	struct uio_dma_device *ddev;
+	struct list_head      next;
+};
+#endif
+
+/* operations with a latency histogram */
+enum {
+	DMA_STAT_MAP,
+	DMA_STAT_UNMAP,
+	DMA_STAT_TRANSLATE,
+	DMA_STAT_SYNC,
+	DMA_STAT_COPY,       /* bounce buffer copies */
+	DMA_STAT_OPS
+};
+
+/* per-device accounting, byte counts of pinned and IOMMU-mapped memory are current */
+struct dma_stats {
+	atomic_long_t hist[DMA_STAT_OPS][DDEKIT_DMA_HIST_BUCKETS];
+	atomic64_t    ns[DMA_STAT_OPS];   /* total time spent */
+	atomic_long_t inflight;           /* streaming mappings */
+	atomic_long_t pinned;             /* bytes of pinned user pages */
+	atomic_long_t iommu_mapped;       /* bytes mapped in the IOMMU domain */
+	atomic64_t    bounced;            /* bytes copied through bounce buffers */
+	atomic64_t    reg_hits;           /* maps served by the registration cache */
+	atomic64_t    reg_misses;
+};
+
 struct uio_dma_ops {
 	long (*map)(struct dma_op_list *request, struct uio_dma_device *);
 	long (*unmap)(struct dma_op_list *request, struct uio_dma_device *);
 	long (*translate)(struct dma_op_list *request, struct uio_dma_device *);
 	long (*free)(struct dma_op_list *request, struct uio_dma_device *);
+	long (*sync)(struct dma_op_list *request, struct uio_dma_device *);  /* NULL if coherent */
 };
 
 struct uio_dma_device {
@@ -56,14 +139,36 @@ struct uio_dma_device {
 	int                     minor;
 	int                     virtualize;
 	int                     attached;
-	atomic_t                ref_cnt;
+	atomic_t                ref_cnt;     /* open fds, DMA_REF_SELFTEST during the selftest */
 	wait_queue_head_t       close;
 
-	struct list_head        iova_page_list;
-	struct list_head        bounce_head;
+	/* lookup tables, zeroed buckets are empty */
+	struct hlist_head       iova_hash[DMA_HASH_SIZE];   /* iova_page_t by pfn */
+	struct mutex            iova_lock;
+	struct list_head        flush_list;  /* unused IOVA mappings to unmap */
+	unsigned int            flush_nr;
+	struct delayed_work     flush_work;
+	struct hlist_head       reg_hash[DMA_HASH_SIZE];    /* struct dma_reg by first pfn */
+	struct list_head        reg_lru;
+	struct list_head        reg_dead;    /* invalidated, references not dropped yet */
+	unsigned int            reg_nr;
+	unsigned long           reg_seq;     /* bumped by every invalidation */
+	int                     reg_active;  /* range invalidations in progress */
+	spinlock_t              reg_lock;    /* the above, taken by the mmu notifiers */
+	struct list_head        reg_notifiers;
+	struct work_struct      reg_work;
+	struct hlist_head       bounce_hash[DMA_HASH_SIZE]; /* bounce buffers by iova */
+	struct list_head        bounce_free[DMA_BOUNCE_CLASSES];
+	unsigned int            bounce_nr_free[DMA_BOUNCE_CLASSES];
 	spinlock_t              bounce_lock;
-	struct list_head        cont_head;
+	struct hlist_head       cont_hash[DMA_HASH_SIZE];   /* coherent mmap() by user va */
 	spinlock_t              cont_lock;
+	struct list_head        region_head;
+	spinlock_t              region_lock;
+	struct dma_ring_ctx     *ring;
+	struct mutex            ring_lock;
+	char                    *selftest;  /* result of the last selftest */
+	struct dma_stats        stats;
 };
 
 extern int __must_check
@@ -80,9 +185,107 @@ uio_dma_register(struct device *dev, struct uio_device *idev, struct uio_dma_dev
 
 extern void uio_dma_unregister(struct uio_dma_device *);
 
+static inline struct hlist_head *
+dma_hash(struct hlist_head *table, unsigned long key)
+{
+	return &table[hash_long(key, DMA_HASH_BITS)];
+}
+
+/* account an operation of the given type started at start */
+static inline void
+dma_stat_add(struct uio_dma_device *ddev, int op, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if(ns < 0)
+		ns = 0;
+	atomic_long_inc(&ddev->stats.hist[op][min_t(int, fls64(ns), DDEKIT_DMA_HIST_BUCKETS - 1)]);
+	atomic64_add(ns, &ddev->stats.ns[op]);
+}
+
+static inline void
+dma_stat_copy(struct uio_dma_device *ddev, ktime_t start, unsigned long len)
+{
+	dma_stat_add(ddev, DMA_STAT_COPY, start);
+	atomic64_add(len, &ddev->stats.bounced);
+}
+
+/** Timed calls of the uio_dma_ops **/
+
+static inline long
+dma_op_map(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	ktime_t start = ktime_get();
+	long ret = ddev->dma_ops->map(request, ddev);
+
+	dma_stat_add(ddev, DMA_STAT_MAP, start);
+	if(!ret)
+		atomic_long_inc(&ddev->stats.inflight);
+	return ret;
+}
+
+static inline long
+dma_op_unmap(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	ktime_t start = ktime_get();
+	long ret = ddev->dma_ops->unmap(request, ddev);
+
+	dma_stat_add(ddev, DMA_STAT_UNMAP, start);
+	if(!ret)
+		atomic_long_dec(&ddev->stats.inflight);
+	return ret;
+}
+
+static inline long
+dma_op_translate(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	ktime_t start = ktime_get();
+	long ret = ddev->dma_ops->translate(request, ddev);
+
+	dma_stat_add(ddev, DMA_STAT_TRANSLATE, start);
+	return ret;
+}
+
+static inline long
+dma_op_sync(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	ktime_t start;
+	long ret;
+
+	if(!ddev->dma_ops->sync)
+		return 0;
+	start = ktime_get();
+	ret = ddev->dma_ops->sync(request, ddev);
+	dma_stat_add(ddev, DMA_STAT_SYNC, start);
+	return ret;
+}
+
 extern struct uio_dma_ops uio_iommu_ops;
 extern struct uio_dma_ops uio_bounce_ops;
 
+extern void dma_iommu_flush_init(struct uio_dma_device *);
+extern void dma_iommu_release_all(struct uio_dma_device *);
+extern void dma_iommu_drain(struct uio_dma_device *);
+
+extern void dma_bounce_pool_init(struct uio_dma_device *);
+extern void dma_bounce_pool_fill(struct uio_dma_device *);
+extern void dma_bounce_release_all(struct uio_dma_device *);
+extern long dma_iova_lookup(struct dma_op_list *, struct uio_dma_device *);
+
+extern long dma_region_register(struct dma_op_list *, struct uio_dma_device *);
+extern long dma_region_unregister(struct dma_op_list *, struct uio_dma_device *);
+extern long dma_region_map_iommu(struct dma_op_list *, struct uio_dma_device *);
+extern long dma_region_unmap_iommu(struct dma_op_list *, struct uio_dma_device *);
+extern void dma_region_release_all(struct uio_dma_device *);
+
+extern long dma_ring_setup(struct uio_dma_device *, unsigned long);
+extern void dma_ring_enter(struct uio_dma_device *);
+extern unsigned int dma_ring_poll(struct uio_dma_device *, struct file *, poll_table *);
+extern int dma_ring_mmap(struct uio_dma_device *, struct vm_area_struct *);
+extern void dma_ring_destroy(struct uio_dma_device *);
+
+extern ssize_t dma_selftest(struct uio_dma_device *, unsigned int, char *, size_t);
+
 extern int debug;
 
 
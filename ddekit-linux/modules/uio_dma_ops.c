@@ -1,22 +1,26 @@
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/module.h>
 #include <linux/pagemap.h>
 #include <linux/iommu.h>
 #include <linux/dma-mapping.h>
 #include <linux/kernel.h>
 #include <linux/pci.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/mmu_notifier.h>
+#include <linux/sched.h>
 
 #include "uio_dma.h"
 
 #define DEBUG_MAP (1 << 1)
 #define DEBUG_ERR (1 << 2)
-#define MAX_MAP_PAGES 3
-
-volatile unsigned int map_min = UINT_MAX, map_avg = 0, map_max = 0;
-volatile unsigned int unmap_min = UINT_MAX, unmap_avg = 0, unmap_max = 0;
-
-volatile u64 memcpy_duration[1024];
-volatile unsigned int memcpy_index = 0;
+/* largest IOMMU mapping of streaming buffers, 2 MB */
+#define DMA_MAP_MAX_ORDER (21 - PAGE_SHIFT)
+/* queued unmappings before the queue is flushed */
+#define DMA_FLUSH_BATCH 256
+/* delay before a partial queue is flushed */
+#define DMA_FLUSH_DELAY (HZ / 100)
 
 /**
  * Basic sanity checks of paramters of the
@@ -38,14 +42,37 @@ dma_map_check(struct dma_mapping *mapping)
 		printk(KERN_ERR "size of mapping is 0\n");
 		return -EINVAL;
 	}
-	if(mapping->nr_pages > MAX_MAP_PAGES) {
-		printk(KERN_ERR "number of pages too large %d\n", mapping->nr_pages);
-		return -ENOMEM;
+	if(mapping->op.size >= ((unsigned long)INT_MAX << PAGE_SHIFT)) {
+		printk(KERN_ERR "buffer too large\n");
+		return -EINVAL;
 	}
 
 	return 0;
 }
 
+/*
+ * Page lists of buffers up to a page of pointers are kmalloc'ed, larger ones
+ * are vmalloc'ed
+ */
+static struct page **
+dma_page_list_alloc(int nr_pages)
+{
+	size_t size = sizeof(struct page *) * nr_pages;
+
+	if(size <= PAGE_SIZE)
+		return kmalloc(size, GFP_KERNEL);
+	return vmalloc(size);
+}
+
+static void
+dma_page_list_free(struct page **page_list)
+{
+	if(is_vmalloc_addr(page_list))
+		vfree(page_list);
+	else
+		kfree(page_list);
+}
+
 /**
  * Actual mapping of the buffer:
  * - find pages
@@ -64,15 +91,13 @@ dma_map_buf(struct dma_mapping *mapping)
 						1,
 						mapping->page_list);
 
-	if(nr_pages_mapped > MAX_MAP_PAGES) {
-		printk(KERN_ERR "Error mapping pages.\n");
-		for(i = 0; i < nr_pages_mapped; i++) {
-			printk("page address 0x%08x\n", page_to_phys(mapping->page_list[i]));
-			printk("page v_address %p\n", phys_to_virt(page_to_phys(mapping->page_list[i])));
-			print_hex_dump(KERN_DEBUG, "page ", DUMP_PREFIX_ADDRESS, 32, 4, kmap(mapping->page_list[i]), PAGE_SIZE, false);
+	if(nr_pages_mapped != mapping->nr_pages) {
+		if(debug & DEBUG_ERR)
+			printk(KERN_ERR "%s: pinned %d of %d pages at 0x%lx\n", __func__,
+			       nr_pages_mapped, mapping->nr_pages, mapping->op.va);
+		for(i = 0; i < nr_pages_mapped; i++)
 			page_cache_release(mapping->page_list[i]);
-		}
-		return -EIO;
+		return -EFAULT;
 	}
 	
 	return nr_pages_mapped;
@@ -106,8 +131,7 @@ dma_map_pages(struct dma_mapping *mapping)
 		goto err_check;
 	}
 	
-	//TODO allocate nr_pages pages
-	mapping->page_list = kzalloc(sizeof(*mapping->page_list) * MAX_MAP_PAGES, GFP_KERNEL);
+	mapping->page_list = dma_page_list_alloc(mapping->nr_pages);
 	if(!mapping->page_list) {
 		ret = -ENOMEM;
 		goto err_alloc;
@@ -122,44 +146,554 @@ dma_map_pages(struct dma_mapping *mapping)
 	return ret;
 
 err_map:
-	kfree(mapping->page_list);
+	dma_page_list_free(mapping->page_list);
 err_alloc:
 err_check:
 	return ret;
 }
 
+/**
+ * Find the IOVA mapping covering the page pfn
+ *
+ * Mappings of 1 << order pages are keyed by their first pfn, which is
+ * aligned to the order.
+ */
 static iova_page_t*
-find_page(struct list_head *head, unsigned int pfn)
+find_page(struct uio_dma_device *ddev, unsigned long pfn)
 {
 	iova_page_t *page;
-	list_for_each_entry(page, head, next) {
-		if(page->pfn == pfn) {
-			return page;
+	struct hlist_node *node;
+	unsigned long head;
+	unsigned int order;
+
+	for(order = 0; order <= DMA_MAP_MAX_ORDER; order++) {
+		head = pfn & ~((1UL << order) - 1);
+		hlist_for_each_entry(page, node, dma_hash(ddev->iova_hash, head), next) {
+			if(page->pfn == head && page->order == order)
+				return page;
 		}
 	}
 	return NULL;
 }
 
+/**
+ * Unmap and unpin an IOVA mapping. Called with ddev->iova_lock held.
+ */
+static void
+release_page_mapping(struct uio_dma_device *ddev, iova_page_t *pte)
+{
+	unsigned long i;
+
+	iommu_unmap(ddev->domain, pte->pfn << PAGE_SHIFT, pte->order);
+	for(i = 0; i < (1UL << pte->order); i++)
+		page_cache_release(nth_page(pte->page, i));
+	atomic_long_sub(PAGE_SIZE << pte->order, &ddev->stats.iommu_mapped);
+	atomic_long_sub(PAGE_SIZE << pte->order, &ddev->stats.pinned);
+	hlist_del(&pte->next);
+	kfree(pte);
+}
+
+/**
+ * Unmap all mappings of the flush queue. Called with ddev->iova_lock held.
+ */
+static void
+dma_iommu_flush(struct uio_dma_device *ddev)
+{
+	iova_page_t *pte, *n;
+
+	list_for_each_entry_safe(pte, n, &ddev->flush_list, lazy) {
+		list_del(&pte->lazy);
+		release_page_mapping(ddev, pte);
+	}
+	ddev->flush_nr = 0;
+}
+
+static void
+dma_iommu_flush_work(struct work_struct *work)
+{
+	struct uio_dma_device *ddev = container_of(work, struct uio_dma_device, flush_work.work);
+
+	mutex_lock(&ddev->iova_lock);
+	dma_iommu_flush(ddev);
+	mutex_unlock(&ddev->iova_lock);
+}
+
+/**
+ * Drop a reference to an IOVA mapping. Called with ddev->iova_lock held.
+ *
+ * Unused mappings are queued and unmapped in batches of DMA_FLUSH_BATCH or
+ * after DMA_FLUSH_DELAY, each iommu_unmap() invalidates the IOTLB. Until
+ * then the pages stay pinned, and mapping them again just takes them off
+ * the queue.
+ */
+static void
+put_page_mapping(struct uio_dma_device *ddev, iova_page_t *pte)
+{
+	if(!atomic_dec_and_test(&pte->ref_count))
+		return;
+
+	list_add_tail(&pte->lazy, &ddev->flush_list);
+	if(++ddev->flush_nr >= DMA_FLUSH_BATCH)
+		dma_iommu_flush(ddev);
+	else if(ddev->flush_nr == 1)
+		schedule_delayed_work(&ddev->flush_work, DMA_FLUSH_DELAY);
+}
+
+/**
+ * Drop the references to the mappings covering nr pages from pfn on.
+ * Called with ddev->iova_lock held.
+ */
+static void
+put_page_range(struct uio_dma_device *ddev, unsigned long pfn, unsigned long nr)
+{
+	unsigned long end = pfn + nr;
+	iova_page_t *pte;
+
+	while(pfn < end) {
+		pte = find_page(ddev, pfn);
+		if(!pte || !atomic_read(&pte->ref_count)) {
+			if(debug & DEBUG_ERR)
+				printk("%s pte with pfn 0x%lx not found.\n", __func__, pfn);
+			pfn++;
+			continue;
+		}
+		pfn = pte->pfn + (1UL << pte->order);
+		put_page_mapping(ddev, pte);
+	}
+}
+
+/** Registration cache **/
+
+/*
+ * Buffers cycling through a ring are mapped over and over again. The last
+ * DMA_REG_MAX buffers mapped are kept as registrations of their address
+ * space and page range. A registration holds a reference to the IOVA
+ * mappings of its pages, so they stay pinned and mapped after the unmap and
+ * mapping the buffer again only takes references to them.
+ *
+ * An mmu notifier per address space drops the registrations of ranges that
+ * are unmapped or remapped. The notifiers may run in atomic context, they
+ * just move the registrations to the dead list under ddev->reg_lock. The
+ * references are dropped later with ddev->iova_lock held.
+ */
+
+/**
+ * Take a reference to the mappings covering nr pages from pfn on, which
+ * are all in use. Called with ddev->iova_lock held.
+ */
+static void
+get_page_range(struct uio_dma_device *ddev, unsigned long pfn, unsigned long nr)
+{
+	unsigned long end = pfn + nr;
+	iova_page_t *pte;
+
+	while(pfn < end) {
+		pte = find_page(ddev, pfn);
+		atomic_inc(&pte->ref_count);
+		pfn = pte->pfn + (1UL << pte->order);
+	}
+}
+
+/* Called with ddev->reg_lock held */
+static void
+dma_reg_kill(struct uio_dma_device *ddev, struct dma_reg *reg)
+{
+	hlist_del(&reg->next);
+	list_move_tail(&reg->lru, &ddev->reg_dead);
+	ddev->reg_nr--;
+}
+
+/**
+ * Find the registration of mm starting at pfn and covering nr pages and
+ * make it the most recently used. Called with ddev->reg_lock held.
+ */
+static struct dma_reg *
+dma_reg_lookup(struct uio_dma_device *ddev, struct mm_struct *mm, unsigned long pfn, unsigned long nr)
+{
+	struct dma_reg *reg;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(reg, node, dma_hash(ddev->reg_hash, pfn), next) {
+		if(reg->mm == mm && reg->pfn == pfn && nr <= reg->nr) {
+			list_move_tail(&reg->lru, &ddev->reg_lru);
+			return reg;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Drop the references of the invalidated registrations. Called with
+ * ddev->iova_lock held.
+ */
+static void
+dma_reg_reap(struct uio_dma_device *ddev)
+{
+	struct dma_reg *reg;
+	LIST_HEAD(dead);
+
+	spin_lock(&ddev->reg_lock);
+	list_splice_init(&ddev->reg_dead, &dead);
+	spin_unlock(&ddev->reg_lock);
+
+	while(!list_empty(&dead)) {
+		reg = list_first_entry(&dead, struct dma_reg, lru);
+		list_del(&reg->lru);
+		put_page_range(ddev, reg->pfn, reg->nr);
+		kfree(reg);
+	}
+}
+
+static void
+dma_reg_work(struct work_struct *work)
+{
+	struct uio_dma_device *ddev = container_of(work, struct uio_dma_device, reg_work);
+
+	mutex_lock(&ddev->iova_lock);
+	dma_reg_reap(ddev);
+	mutex_unlock(&ddev->iova_lock);
+}
+
+/**
+ * Register the nr pages of mm from pfn on, which were just mapped. Called
+ * with ddev->iova_lock held.
+ *
+ * \param seq  ddev->reg_seq before the pages were pinned, if the address
+ *             space was invalidated since, the pages may be stale
+ */
+static void
+dma_reg_insert(struct uio_dma_device *ddev, struct mm_struct *mm, unsigned long pfn,
+               unsigned long nr, unsigned long seq)
+{
+	struct dma_reg *reg;
+
+	reg = kmalloc(sizeof(*reg), GFP_KERNEL);
+	if(!reg)
+		return;
+	reg->mm = mm;
+	reg->pfn = pfn;
+	reg->nr = nr;
+
+	spin_lock(&ddev->reg_lock);
+	if(ddev->reg_seq != seq || ddev->reg_active) {
+		spin_unlock(&ddev->reg_lock);
+		kfree(reg);
+		return;
+	}
+	if(ddev->reg_nr >= DMA_REG_MAX)
+		dma_reg_kill(ddev, list_first_entry(&ddev->reg_lru, struct dma_reg, lru));
+	hlist_add_head(&reg->next, dma_hash(ddev->reg_hash, pfn));
+	list_add_tail(&reg->lru, &ddev->reg_lru);
+	ddev->reg_nr++;
+	spin_unlock(&ddev->reg_lock);
+
+	/* an invalidation racing with us is reaped after this, as we hold iova_lock */
+	get_page_range(ddev, pfn, nr);
+	dma_reg_reap(ddev);
+}
+
+#ifdef CONFIG_MMU_NOTIFIER
+/**
+ * Drop the registrations of mm overlapping the addresses from start to end
+ */
+static void
+dma_reg_invalidate(struct uio_dma_device *ddev, struct mm_struct *mm,
+                   unsigned long start, unsigned long end)
+{
+	struct dma_reg *reg, *n;
+	unsigned long first = start >> PAGE_SHIFT;
+	unsigned long last = (end - 1) >> PAGE_SHIFT;
+	int dead = 0;
+
+	spin_lock(&ddev->reg_lock);
+	ddev->reg_seq++;
+	list_for_each_entry_safe(reg, n, &ddev->reg_lru, lru) {
+		if(reg->mm != mm || reg->pfn > last || reg->pfn + reg->nr <= first)
+			continue;
+		if(debug & DEBUG_MAP)
+			printk("%s: dropping registration of va 0x%lx, %lu pages\n", __func__,
+			       reg->pfn << PAGE_SHIFT, reg->nr);
+		dma_reg_kill(ddev, reg);
+		dead = 1;
+	}
+	spin_unlock(&ddev->reg_lock);
+
+	if(dead)
+		schedule_work(&ddev->reg_work);
+}
+
+static inline struct uio_dma_device *
+notifier_ddev(struct mmu_notifier *mn)
+{
+	return container_of(mn, struct dma_reg_notifier, mn)->ddev;
+}
+
+static void
+dma_reg_release(struct mmu_notifier *mn, struct mm_struct *mm)
+{
+	dma_reg_invalidate(notifier_ddev(mn), mm, 0, ~0UL);
+}
+
+static void
+dma_reg_invalidate_page(struct mmu_notifier *mn, struct mm_struct *mm, unsigned long address)
+{
+	dma_reg_invalidate(notifier_ddev(mn), mm, address, address + PAGE_SIZE);
+}
+
+/* pages pinned until the range end is called may still be the old ones */
+static void
+dma_reg_invalidate_range_start(struct mmu_notifier *mn, struct mm_struct *mm,
+                               unsigned long start, unsigned long end)
+{
+	struct uio_dma_device *ddev = notifier_ddev(mn);
+
+	spin_lock(&ddev->reg_lock);
+	ddev->reg_active++;
+	spin_unlock(&ddev->reg_lock);
+
+	dma_reg_invalidate(ddev, mm, start, end);
+}
+
+static void
+dma_reg_invalidate_range_end(struct mmu_notifier *mn, struct mm_struct *mm,
+                             unsigned long start, unsigned long end)
+{
+	struct uio_dma_device *ddev = notifier_ddev(mn);
+
+	spin_lock(&ddev->reg_lock);
+	ddev->reg_active--;
+	ddev->reg_seq++;
+	spin_unlock(&ddev->reg_lock);
+}
+
+static const struct mmu_notifier_ops dma_reg_notifier_ops = {
+	.release = dma_reg_release,
+	.invalidate_page = dma_reg_invalidate_page,
+	.invalidate_range_start = dma_reg_invalidate_range_start,
+	.invalidate_range_end = dma_reg_invalidate_range_end,
+};
+
+/**
+ * Watch mm for changes, once per address space. Called with
+ * ddev->iova_lock held.
+ *
+ * \return 0 if ranges of mm may be registered
+ */
+static int
+dma_reg_watch(struct uio_dma_device *ddev, struct mm_struct *mm)
+{
+	struct dma_reg_notifier *rn;
+	int ret;
+
+	list_for_each_entry(rn, &ddev->reg_notifiers, next) {
+		if(rn->mm == mm)
+			return 0;
+	}
+
+	rn = kzalloc(sizeof(*rn), GFP_KERNEL);
+	if(!rn)
+		return -ENOMEM;
+	rn->mn.ops = &dma_reg_notifier_ops;
+	rn->mm = mm;
+	rn->ddev = ddev;
+
+	if((ret = mmu_notifier_register(&rn->mn, mm))) {
+		if(debug & DEBUG_ERR)
+			printk(KERN_ERR "%s: mmu_notifier_register failed with %d\n", __func__, ret);
+		kfree(rn);
+		return ret;
+	}
+	/* mmu_notifier_unregister() needs the mm_struct, even after the exit */
+	atomic_inc(&mm->mm_count);
+	list_add(&rn->next, &ddev->reg_notifiers);
+
+	return 0;
+}
+
+static void
+dma_reg_unwatch_all(struct uio_dma_device *ddev)
+{
+	struct dma_reg_notifier *rn, *n;
+
+	list_for_each_entry_safe(rn, n, &ddev->reg_notifiers, next) {
+		mmu_notifier_unregister(&rn->mn, rn->mm);
+		mmdrop(rn->mm);
+		list_del(&rn->next);
+		kfree(rn);
+	}
+}
+#else
+/* without notifiers the registrations could not be dropped on munmap() */
+static int
+dma_reg_watch(struct uio_dma_device *ddev, struct mm_struct *mm)
+{
+	return -ENOSYS;
+}
+
+static void
+dma_reg_unwatch_all(struct uio_dma_device *ddev)
+{
+}
+#endif
+
+/**
+ * Drop all registrations and notifiers. The device has to be closed.
+ */
+static void
+dma_reg_release_all(struct uio_dma_device *ddev)
+{
+	dma_reg_unwatch_all(ddev);
+	cancel_work_sync(&ddev->reg_work);
+	dma_iommu_drain(ddev);
+}
+
+void
+dma_iommu_flush_init(struct uio_dma_device *ddev)
+{
+	INIT_LIST_HEAD(&ddev->flush_list);
+	INIT_DELAYED_WORK(&ddev->flush_work, dma_iommu_flush_work);
+	INIT_LIST_HEAD(&ddev->reg_lru);
+	INIT_LIST_HEAD(&ddev->reg_dead);
+	INIT_LIST_HEAD(&ddev->reg_notifiers);
+	spin_lock_init(&ddev->reg_lock);
+	INIT_WORK(&ddev->reg_work, dma_reg_work);
+}
+
+/**
+ * Drop all registrations and unmap the queued mappings, the mappings in
+ * use stay
+ */
+void
+dma_iommu_drain(struct uio_dma_device *ddev)
+{
+	struct dma_reg *reg, *n;
+
+	mutex_lock(&ddev->iova_lock);
+	spin_lock(&ddev->reg_lock);
+	list_for_each_entry_safe(reg, n, &ddev->reg_lru, lru)
+		dma_reg_kill(ddev, reg);
+	spin_unlock(&ddev->reg_lock);
+	dma_reg_reap(ddev);
+	dma_iommu_flush(ddev);
+	mutex_unlock(&ddev->iova_lock);
+}
+
+/**
+ * Unmap and unpin all IOVA mappings of the device, queued, registered or not
+ */
+void
+dma_iommu_release_all(struct uio_dma_device *ddev)
+{
+	iova_page_t *pte;
+	struct hlist_node *node, *tmp;
+	int i;
+
+	dma_reg_release_all(ddev);
+	cancel_delayed_work_sync(&ddev->flush_work);
+
+	mutex_lock(&ddev->iova_lock);
+	INIT_LIST_HEAD(&ddev->flush_list);
+	ddev->flush_nr = 0;
+	for(i = 0; i < DMA_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(pte, node, tmp, &ddev->iova_hash[i], next)
+			release_page_mapping(ddev, pte);
+	}
+	mutex_unlock(&ddev->iova_lock);
+}
+
 /** IOMMU mappings **/
 
+/**
+ * Check whether the IOVAs from iova to iova + size belong to a region
+ * mapped with DMA_IOMMU_MAP, streaming mappings must not replace or unmap
+ * its entries
+ */
+static int
+dma_region_overlaps(struct uio_dma_device *ddev, unsigned long iova, unsigned long size)
+{
+	struct dma_region *region;
+	int ret = 0;
+
+	spin_lock(&ddev->region_lock);
+	list_for_each_entry(region, &ddev->region_head, next) {
+		if(region->mapped && iova < region->op.iova + region->op.size &&
+		   region->op.iova < iova + size) {
+			ret = 1;
+			break;
+		}
+	}
+	spin_unlock(&ddev->region_lock);
+
+	return ret;
+}
+
+/**
+ * Look up the buffer in the registration cache and take references to its
+ * mappings on a hit. Otherwise make sure the address space is watched.
+ *
+ * \param seq  receives ddev->reg_seq to register the buffer after mapping
+ * \return 1 on a hit, 0 if the buffer may be registered, < 0 if not
+ */
+static int
+dma_reg_map(struct uio_dma_device *ddev, struct mm_struct *mm, unsigned long pfn,
+            unsigned long nr, unsigned long *seq)
+{
+	int ret;
+
+	if(!mm)
+		return -EINVAL;
+
+	mutex_lock(&ddev->iova_lock);
+	dma_reg_reap(ddev);
+	spin_lock(&ddev->reg_lock);
+	ret = dma_reg_lookup(ddev, mm, pfn, nr) != NULL;
+	*seq = ddev->reg_seq;
+	spin_unlock(&ddev->reg_lock);
+	/* the registration is only dropped with iova_lock held */
+	if(ret)
+		get_page_range(ddev, pfn, nr);
+	else
+		ret = dma_reg_watch(ddev, mm);
+	mutex_unlock(&ddev->iova_lock);
+
+	return ret;
+}
+
 /**
  * Maps a userspace buffer to IOVA
+ *
+ * Pages are mapped at iova == va and reference counted, a page shared by
+ * several buffers is pinned and mapped once. Runs of physically contiguous
+ * pages are mapped by one iommu_map() of the largest aligned order, up to
+ * DMA_MAP_MAX_ORDER. Buffers found in the registration cache are neither
+ * pinned nor mapped again.
  */
 static long
 dma_iommu_map(struct dma_op_list *request, struct uio_dma_device *ddev)
 {
 	int nr_of_pages;
-	int page = 0;
-	int pfn;
+	int page = 0, run, i;
+	unsigned int order;
+	unsigned long pfn, phys_pfn, step, nr, seq = 0;
+	int reg = -EINVAL;
 	
 	long ret = 0;
 
-	unsigned long virt_page_addr;
-
 	struct dma_mapping *mapping;
-	struct list_head *list;
 	iova_page_t *pte;
 
+	pfn = request->op.va >> PAGE_SHIFT;
+	nr = ((request->op.va & ~PAGE_MASK) + request->op.size - 1 + ~PAGE_MASK) >> PAGE_SHIFT;
+	if(request->op.size && request->op.va + request->op.size > request->op.va) {
+		reg = dma_reg_map(ddev, current->mm, pfn, nr, &seq);
+		if(reg > 0) {
+			atomic64_inc(&ddev->stats.reg_hits);
+			request->op.iova = request->op.va;
+			return 0;
+		}
+		atomic64_inc(&ddev->stats.reg_misses);
+	}
+
 	mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
 	if(!mapping) {
 		ret = -ENOMEM;
@@ -175,98 +709,107 @@ dma_iommu_map(struct dma_op_list *request, struct uio_dma_device *ddev)
 		/* map->page_list is already freed here */
 		goto err_map_free;
 	}
-	
-	for(page = 0; page < nr_of_pages; page++) {
-		virt_page_addr = (unsigned long)((mapping->op.va & PAGE_MASK) + (page * PAGE_SIZE));
-		pfn = (mapping->op.va >> PAGE_SHIFT) + page;
-		
+
+	mutex_lock(&ddev->iova_lock);
+	/* regions are mapped with iova_lock held, so none can appear after this */
+	if(dma_region_overlaps(ddev, request->op.va, request->op.size)) {
+		if(debug & DEBUG_ERR)
+			printk("%s: va 0x%lx overlaps an IOMMU region\n", __func__, request->op.va);
+		ret = -EBUSY;
+		goto err_map;
+	}
+	/* registrations of a remapped buffer must not keep its old pages busy */
+	dma_reg_reap(ddev);
+	while(page < nr_of_pages) {
 		if(debug & DEBUG_MAP)
-			printk("%s: mapping page %d va 0x%lx (0x%lx) of size %ld from page 0x%lx\n", 
+			printk("%s: mapping page %d va 0x%lx of size %ld from page 0x%lx\n", 
 				__func__,
 				page,
-				virt_page_addr,
-				mapping->op.va & PAGE_MASK,
+				(pfn + page) << PAGE_SHIFT,
 				mapping->op.size,
 				(unsigned long) page_to_phys(mapping->page_list[page]));
 	
-		if (iommu_iova_to_phys(ddev->domain, virt_page_addr)) {
-			if(debug & DEBUG_MAP)
-				printk("%s: 0x%lx already mapped to 0x%lx\n", __func__, virt_page_addr,
-					(unsigned long) iommu_iova_to_phys(ddev->domain, virt_page_addr));
-
-			/* increment ref count */
-			pte = find_page(&ddev->iova_page_list, pfn);
-			if(pte) {
-				atomic_inc(&pte->ref_count);
-			} else {
-				if(debug & DEBUG_MAP)
-					printk("Oops. page 0x%x already mapped, but pte not found.\n", pfn);
+		pte = find_page(ddev, pfn + page);
+		if(pte && nth_page(pte->page, pfn + page - pte->pfn) != mapping->page_list[page]) {
+			/* the buffer is backed by other memory than when it was mapped */
+			if(atomic_read(&pte->ref_count)) {
+				if(debug & DEBUG_ERR)
+					printk("%s: va 0x%lx is mapped to another page\n", __func__, (pfn + page) << PAGE_SHIFT);
+				ret = -EBUSY;
+				goto err_map;
 			}
+			list_del(&pte->lazy);
+			ddev->flush_nr--;
+			release_page_mapping(ddev, pte);
+			pte = NULL;
+		}
+		if(pte) {
+			/* already mapped, the mapping keeps the first pin */
+			if(!atomic_read(&pte->ref_count)) {
+				list_del(&pte->lazy);
+				ddev->flush_nr--;
+			}
+			atomic_inc(&pte->ref_count);
+			step = min_t(unsigned long, pte->pfn + (1UL << pte->order) - (pfn + page),
+			             nr_of_pages - page);
+			for(i = 0; i < step; i++)
+				page_cache_release(mapping->page_list[page + i]);
+			page += step;
 			continue;
 		}
+
+		/* largest aligned run of contiguous pages not mapped yet */
+		phys_pfn = page_to_pfn(mapping->page_list[page]);
+		for(run = 1; page + run < nr_of_pages && run < (1 << DMA_MAP_MAX_ORDER); run++) {
+			if(page_to_pfn(mapping->page_list[page + run]) != phys_pfn + run ||
+			   find_page(ddev, pfn + page + run))
+				break;
+		}
+		order = min_t(unsigned int, ilog2(run),
+		              __ffs((pfn + page) | phys_pfn | (1UL << DMA_MAP_MAX_ORDER)));
 		
 		pte = kmalloc(sizeof(iova_page_t), GFP_KERNEL);
 		if(!pte) {
 			ret = -ENOMEM;
-			goto err_alloc_pte;
+			goto err_map;
 		}
 
-		ret = iommu_map(ddev->domain, virt_page_addr,
-				(phys_addr_t) page_to_phys(mapping->page_list[page]), 
-				get_order(PAGE_SIZE),
+		ret = iommu_map(ddev->domain, (pfn + page) << PAGE_SHIFT,
+				(phys_addr_t) PFN_PHYS(phys_pfn), order,
 				IOMMU_READ | IOMMU_WRITE | ddev->iommu_flags);
 		if(ret) {
 			if(debug & DEBUG_ERR)
 				printk("%s: return code %ld by mapping page %d\n", __func__, ret, page);
+			kfree(pte);
 			ret = -ENXIO;
 			goto err_map;
 		}
 
-		pte->pfn = pfn;
+		pte->pfn = pfn + page;
+		pte->order = order;
 		atomic_set(&pte->ref_count, 1);
 		pte->page = mapping->page_list[page];
-		list_add_tail(&pte->next, &ddev->iova_page_list);
-	
-		if(request->op.size > 4095) {
-			printk("Mapping pfn 0x%x\n", pfn);
-		}
-/*	
-		if(request->op.size > 4095) {
-			iova_page_t *p;
-			printk("Adding 0x%08x to cont_head\n", pfn);
-			p = kmalloc(sizeof(iova_page_t), GFP_KERNEL);
-			if(!p)
-				break;
-			memcpy(p, pte, sizeof(iova_page_t));
-			p->offset = (page) ? 0: mapping->offset;
-			p->size = (page == nr_of_pages-1) ? (mapping->offset) : (PAGE_SIZE - p->offset);
-			list_add_tail(&p->next, &ddev->cont_head);
-		}
-*/
+		hlist_add_head(&pte->next, dma_hash(ddev->iova_hash, pte->pfn));
+		atomic_long_add(PAGE_SIZE << order, &ddev->stats.iommu_mapped);
+		atomic_long_add(PAGE_SIZE << order, &ddev->stats.pinned);
+		page += 1 << order;
 	}
+	if(!reg)
+		dma_reg_insert(ddev, current->mm, pfn, nr_of_pages, seq);
+	mutex_unlock(&ddev->iova_lock);
 
 	request->op.iova = request->op.va;
 
 	goto out;
 
 err_map:
-	/* unmap last page and free pte, fall through to unmap already mapped pages */
-	iommu_unmap(ddev->domain, (mapping->op.va & PAGE_MASK) + (page * PAGE_SIZE), get_order(PAGE_SIZE));
-	kfree(pte);
-err_alloc_pte:
-	/* unmap all other pages */
-	while(page--) {
-		list = ddev->iova_page_list.prev;
-		printk("Error: unmapping 0x%x\n", pte->pfn);
-		iommu_unmap(ddev->domain, pte->pfn << PAGE_SHIFT, get_order(PAGE_SIZE));
-		list_del(list);
-		kfree(pte);
-	}
-	/* release all pinned pages */
-	for(page = 0; page < nr_of_pages; page++)
-		page_cache_release(mapping->page_list[page]);
+	/* release the pins from page on, then drop the mappings taken before it */
+	for(i = page; i < nr_of_pages; i++)
+		page_cache_release(mapping->page_list[i]);
+	put_page_range(ddev, pfn, page);
+	mutex_unlock(&ddev->iova_lock);
 out:
-	kfree(mapping->page_list);
+	dma_page_list_free(mapping->page_list);
 err_map_free:
 	kfree(mapping);
 err:
@@ -281,37 +824,15 @@ err:
 static long
 dma_iommu_unmap(struct dma_op_list *request, struct uio_dma_device *ddev)
 {
-	int page;
 	int nr_of_pages;
-
-	iova_page_t *pte;
+	unsigned long pfn = request->op.iova >> PAGE_SHIFT;
 
 	nr_of_pages = ((request->op.iova & ~PAGE_MASK) + request->op.size - 1 + ~PAGE_MASK) >> PAGE_SHIFT;
-	//for each page in the request buffer
-	for(page = 0; page < nr_of_pages; page++) {
-		pte = find_page(&ddev->iova_page_list, (request->op.iova >> PAGE_SHIFT) + page);
-		//if there is a page entry in the list
-		if(pte) {
-			//printk("%s found page with pfn 0x%lx\n", __func__, (dma_req->dma_addr >> PAGE_SHIFT) + page);
-			//and if the ref count is zero
-			if(atomic_dec_and_test(&pte->ref_count)) {
-				//printk("Unmap page 0x%x\n", pte->pfn);
-				//unmap
-				iommu_unmap(ddev->domain, pte->pfn << PAGE_SHIFT, get_order(PAGE_SIZE));
-				//printk("%s: unmapping page 0x%x with address %p (0x%lx)\n", __func__, page_to_phys(pte->page), page_address(pte->page), dma_req->dma_addr);
-				//and unpin the page
-				page_cache_release(pte->page);
-				//also free buffers
-				list_del(&pte->next);
-				kfree(pte);
-				// we can't clear this here, because there might be more pages to this request.
-				//request->op.iova = 0;
-			}
-		} else {
-			//if(debug & DEBUG_ERR)
-				printk("%s pte with pfn 0x%lx not found.\n", __func__, (request->op.iova >> PAGE_SHIFT) + page);
-		}
-	}
+
+	mutex_lock(&ddev->iova_lock);
+	put_page_range(ddev, pfn, nr_of_pages);
+	mutex_unlock(&ddev->iova_lock);
+
 	return 0;
 }
 
@@ -322,145 +843,371 @@ struct uio_dma_ops uio_iommu_ops = {
 	.free = dma_iommu_unmap,
 };
 
+/**
+ * Look up the physical address the device reaches at request->op.iova and
+ * return it in request->op.va, for testing the mappings
+ */
+long
+dma_iova_lookup(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	phys_addr_t phys;
+
+	if(ddev->dma_ops != &uio_iommu_ops) {
+		/* bounce buffers are mapped 1:1 */
+		request->op.va = request->op.iova;
+		return 0;
+	}
+
+	phys = iommu_iova_to_phys(ddev->domain, request->op.iova);
+	if(!phys)
+		return -ENOENT;
+
+	request->op.va = (unsigned long)phys;
+	return 0;
+}
+
 /** DMA with bounce buffers **/
 
+/*
+ * Bounce buffers stay mapped for DMA from allocation on and are recycled
+ * through per-device free lists, one per power-of-two size class.
+ */
+struct dma_bounce {
+	struct dma_op_list entry;   /* kva and op.iova are the bounce buffer */
+	dma_addr_t         dma;
+	size_t             size;
+	int                class;   /* -1 if larger than the size classes */
+	struct list_head   free;
+	struct mutex       lock;    /* held while data is copied */
+	int                users;   /* mapping and DMA_SYNCs in progress, under bounce_lock */
+	int                unmapped;
+};
+
+static int
+dma_bounce_class(unsigned long size)
+{
+	int class;
+
+	for(class = 0; class < DMA_BOUNCE_CLASSES; class++) {
+		if(size <= (1UL << (DMA_BOUNCE_MIN_SHIFT + class)))
+			return class;
+	}
+	return -1;
+}
+
+static struct dma_bounce *
+dma_bounce_alloc(struct uio_dma_device *ddev, unsigned long size, int class)
+{
+	struct dma_bounce *b;
+
+	if(!(b = kzalloc(sizeof(*b), GFP_KERNEL)))
+		return NULL;
+
+	b->class = class;
+	b->size = class < 0 ? size : 1UL << (DMA_BOUNCE_MIN_SHIFT + class);
+	mutex_init(&b->lock);
+	if(!(b->entry.kva = kmalloc(b->size, GFP_KERNEL)))
+		goto err_kva;
+
+	b->dma = pci_map_single(ddev->pci_dev, b->entry.kva, b->size, PCI_DMA_BIDIRECTIONAL);
+	if(pci_dma_mapping_error(ddev->pci_dev, b->dma))
+		goto err_map;
+
+	return b;
+
+err_map:
+	kfree(b->entry.kva);
+err_kva:
+	kfree(b);
+	return NULL;
+}
+
+static void
+dma_bounce_free(struct uio_dma_device *ddev, struct dma_bounce *b)
+{
+	pci_unmap_single(ddev->pci_dev, b->dma, b->size, PCI_DMA_BIDIRECTIONAL);
+	kfree(b->entry.kva);
+	kfree(b);
+}
+
 /**
- * Assigns a DMA address to userspace buffer
- * using a bounce buffer. A DMAable buffer
- * is allocated and data is copied, depending
- * on the DMA direction.
+ * Take a bounce buffer of at least size bytes from the pool
  */
-static long 
-dma_mem_map(struct dma_op_list *request, struct uio_dma_device *ddev)
+static struct dma_bounce *
+dma_bounce_get(struct uio_dma_device *ddev, unsigned long size)
 {
-	int direction;
-	long ret;
-	u64 start;
-	u64 duration;
+	struct dma_bounce *b = NULL;
+	int class = dma_bounce_class(size);
 
-	struct dma_op_list *entry;
+	if(class >= 0) {
+		spin_lock(&ddev->bounce_lock);
+		if(!list_empty(&ddev->bounce_free[class])) {
+			b = list_first_entry(&ddev->bounce_free[class], struct dma_bounce, free);
+			list_del(&b->free);
+			ddev->bounce_nr_free[class]--;
+		}
+		spin_unlock(&ddev->bounce_lock);
+		if(b)
+			return b;
+	}
 
-	#if 1
-	/* alloc memory for resource tracking */
-	if(!(entry = kzalloc(sizeof(struct dma_op_list), GFP_KERNEL))) {
-		ret = -ENOMEM;
-		goto err;
+	return dma_bounce_alloc(ddev, size, class);
+}
+
+/**
+ * Return a bounce buffer to the pool, the pool keeps up to
+ * DMA_BOUNCE_MAX_FREE buffers per size class
+ */
+static void
+dma_bounce_put(struct uio_dma_device *ddev, struct dma_bounce *b)
+{
+	if(b->class >= 0) {
+		spin_lock(&ddev->bounce_lock);
+		if(ddev->bounce_nr_free[b->class] < DMA_BOUNCE_MAX_FREE) {
+			list_add(&b->free, &ddev->bounce_free[b->class]);
+			ddev->bounce_nr_free[b->class]++;
+			b = NULL;
+		}
+		spin_unlock(&ddev->bounce_lock);
+		if(!b)
+			return;
 	}
 
-	memcpy(entry, request, sizeof(struct dma_op_list));
-	#endif
+	dma_bounce_free(ddev, b);
+}
 
-#if 0
-	/* allocate dma-able memory */
-	if(!(entry->kva = dma_alloc_coherent(ddev->pdev, entry->op.size, (dma_addr_t*)&entry->op.iova, GFP_KERNEL))) {
-		ret = -ENOMEM;
-		goto err_dma_alloc;
+/**
+ * Drop a reference to a mapped bounce buffer, the last one returns it
+ * to the pool
+ */
+static void
+dma_bounce_unpin(struct uio_dma_device *ddev, struct dma_bounce *b)
+{
+	int last;
+
+	spin_lock(&ddev->bounce_lock);
+	last = !--b->users;
+	spin_unlock(&ddev->bounce_lock);
+
+	if(last)
+		dma_bounce_put(ddev, b);
+}
+
+void
+dma_bounce_pool_init(struct uio_dma_device *ddev)
+{
+	int class;
+
+	for(class = 0; class < DMA_BOUNCE_CLASSES; class++)
+		INIT_LIST_HEAD(&ddev->bounce_free[class]);
+}
+
+/**
+ * Preallocate DMA_BOUNCE_PREALLOC buffers of each size class
+ */
+void
+dma_bounce_pool_fill(struct uio_dma_device *ddev)
+{
+	struct dma_bounce *b;
+	int class, i;
+
+	for(class = 0; class < DMA_BOUNCE_CLASSES; class++) {
+		for(i = 0; i < DMA_BOUNCE_PREALLOC; i++) {
+			if(!(b = dma_bounce_alloc(ddev, 0, class)))
+				return;
+			dma_bounce_put(ddev, b);
+		}
 	}
+}
+
+/**
+ * Free all bounce buffers of the device, mapped or in the pool
+ */
+void
+dma_bounce_release_all(struct uio_dma_device *ddev)
+{
+	struct dma_op_list *entry;
+	struct dma_bounce *b, *n;
+	struct hlist_node *node, *tmp;
+	LIST_HEAD(list);
+	int i;
 
-	/* and copy the user space data to it */
-	if(entry->op.direction == DDEKIT_DMA_TODEVICE) {
-		start = native_read_tsc();
-		copy_from_user(entry->kva, (const void*)entry->op.va, entry->op.size);
-		//printk("Overwriting memory from %p to %p\n", entry->kva, entry->kva + entry->op.size);
-		duration = native_read_tsc() - start;
-		if(memcpy_index < 1024)
-			memcpy_duration[memcpy_index++] = (duration & 0xffff) | ((u64)entry->op.size << 32);
-		else
-			memcpy_index = 0;
-		//print_hex_dump(KERN_ERR, "sbuf ", DUMP_PREFIX_OFFSET, 16, 2, (void*)addr, dma_req->size, 0);
+	spin_lock(&ddev->bounce_lock);
+	for(i = 0; i < DMA_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(entry, node, tmp, &ddev->bounce_hash[i], next) {
+			hlist_del(&entry->next);
+			list_add(&container_of(entry, struct dma_bounce, entry)->free, &list);
+		}
 	}
-#else
-	/* this is faster.
-	 * for the lulz of it, test if it is really faster or measurement bias
-	 */
+	for(i = 0; i < DMA_BOUNCE_CLASSES; i++) {
+		list_splice_init(&ddev->bounce_free[i], &list);
+		ddev->bounce_nr_free[i] = 0;
+	}
+	spin_unlock(&ddev->bounce_lock);
 
-	/* allocate memory */
-	if(!(entry->kva = kmalloc(entry->op.size, GFP_KERNEL))) {
-		ret = -ENOMEM;
-		// TODO: rename.
-		goto err_dma_alloc;
+	list_for_each_entry_safe(b, n, &list, free) {
+		list_del(&b->free);
+		dma_bounce_free(ddev, b);
 	}
+}
 
-	/* set up Linux direction variable */
-	if(entry->op.direction == DDEKIT_DMA_TODEVICE) {
-		/* conditionally copy data to buffer */
-		copy_from_user(entry->kva, (const void*)entry->op.va, entry->op.size);
-		direction = PCI_DMA_TODEVICE;
-	} else if(entry->op.direction == DDEKIT_DMA_FROMDEVICE) {
-		direction = PCI_DMA_FROMDEVICE;
-	} else {
-		//TODO error handling
-		direction = 0;
+/**
+ * Assigns a DMA address to userspace buffer
+ * using a bounce buffer. A DMAable buffer
+ * is taken from the pool and data is copied
+ * to it, unless the device only writes it.
+ */
+static long 
+dma_mem_map(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	struct dma_bounce *b;
+	ktime_t start;
+
+	if(!request->op.size)
+		return -EINVAL;
+
+	if(!(b = dma_bounce_get(ddev, request->op.size)))
+		return -ENOMEM;
+
+	b->entry.op = request->op;
+	b->entry.op.iova = b->dma;
+
+	if(request->op.direction != DDEKIT_DMA_FROMDEVICE) {
+		start = ktime_get();
+		if(copy_from_user(b->entry.kva, (const void __user *)request->op.va, request->op.size)) {
+			dma_bounce_put(ddev, b);
+			return -EFAULT;
+		}
+		dma_stat_copy(ddev, start, request->op.size);
 	}
+	pci_dma_sync_single_for_device(ddev->pci_dev, b->dma, request->op.size, PCI_DMA_BIDIRECTIONAL);
 
-	/* map it to IOVA space */
-	entry->op.iova = pci_map_single(ddev->pci_dev, entry->kva, entry->op.size, direction);
-#endif
 	/* return the DMA-address to user space */
-	request->op.iova = entry->op.iova;
+	request->op.iova = b->dma;
+	b->users = 1;
+	b->unmapped = 0;
 
 	spin_lock(&ddev->bounce_lock);
-	list_add(&entry->next, &ddev->bounce_head);
+	hlist_add_head(&b->entry.next, dma_hash(ddev->bounce_hash, b->dma));
 	spin_unlock(&ddev->bounce_lock);
 
 	if(debug & DEBUG_MAP)
 		printk("%s: mapping at 0x%lx (%lu)\n", __func__, request->op.iova, request->op.size);
 	return 0;
-
-err_dma_alloc:
-	kfree(entry);
-err:
-	return ret;
 }
 
 /**
- * Frees DMA-able buffer and copies data to the
- * associated userspace buffer, depending on the
- * direction of the DMA transfer
+ * Returns the DMA-able buffer to the pool and copies data
+ * to the associated userspace buffer, unless the device
+ * only read it.
+ *
+ * The whole mapping is copied back; use DMA_SYNC beforehand
+ * to copy only part of it. A DMA_SYNC in progress is waited for.
  */
 static long
 dma_mem_unmap(struct dma_op_list *request, struct uio_dma_device *ddev)
 {
-	int loop_cnt = 0;
-	struct dma_op_list *entry, *next_entry;
+	unsigned long len;
+	struct dma_op_list *entry;
+	struct dma_bounce *b;
+	struct hlist_node *node;
+	ktime_t start;
 	
-	/* are values valid */
 	spin_lock(&ddev->bounce_lock);
-	list_for_each_entry_safe_reverse(entry, next_entry, &ddev->bounce_head, next) {
-		loop_cnt++;
-		if((entry->op.iova == request->op.iova) && (entry->op.size == request->op.size)) {
-			list_del(&entry->next);
+	hlist_for_each_entry(entry, node, dma_hash(ddev->bounce_hash, request->op.iova), next) {
+		if(entry->op.iova == request->op.iova) {
+			hlist_del(&entry->next);
 			spin_unlock(&ddev->bounce_lock);
-			if(entry->op.direction == DDEKIT_DMA_FROMDEVICE) {
-				pci_unmap_single(ddev->pci_dev, (dma_addr_t)entry->op.iova, entry->op.size, PCI_DMA_FROMDEVICE);
-				copy_to_user((void*)entry->op.va, (const void *)entry->kva, entry->op.size);
-				//printk("Overwriting memory from 0x%08x to 0x%08x\n", entry->op.va, entry->op.va + entry->op.size);
-			} else if (entry->op.direction == DDEKIT_DMA_TODEVICE) {
-				pci_unmap_single(ddev->pci_dev, (dma_addr_t)entry->op.iova, entry->op.size, PCI_DMA_TODEVICE);
-			} else {
-				//TODO error handling; but this should never happen, i think ;)
+
+			b = container_of(entry, struct dma_bounce, entry);
+			len = entry->op.size;
+			mutex_lock(&b->lock);
+			if(entry->op.direction != DDEKIT_DMA_TODEVICE) {
+				pci_dma_sync_single_for_cpu(ddev->pci_dev, b->dma, len, PCI_DMA_BIDIRECTIONAL);
+				start = ktime_get();
+				if(copy_to_user((void __user *)entry->op.va, entry->kva, len) && (debug & DEBUG_ERR))
+					printk("%s: copy to 0x%lx failed\n", __func__, entry->op.va);
+				dma_stat_copy(ddev, start, len);
 			}
-			kfree(entry->kva);
-			//dma_free_coherent(ddev->pdev, entry->op.size, entry->kva, (dma_addr_t)entry->op.iova);
+			b->unmapped = 1;
+			mutex_unlock(&b->lock);
+			dma_bounce_unpin(ddev, b);
 			request->op.iova = 0;
-			kfree(entry);
-			/* stats, maybe use systemtap? */
-			if(loop_cnt < unmap_min)
-				unmap_min = loop_cnt;
-			if(loop_cnt > unmap_max)
-				unmap_max = loop_cnt;
-					return 0;
-		} else if((entry->op.iova == request->op.iova) && (entry->op.size != request->op.size)) {
-			printk("%s Different size: 0x%08lx %ld %ld\n", __func__, entry->op.iova, entry->op.size, request->op.size);
+			return 0;
 		}
 	}
 
 	spin_unlock(&ddev->bounce_lock);
 
-	printk("%s: entry not found: 0x%lx (%ld)\n", __func__, request->op.iova, request->op.size);
+	if(debug & DEBUG_ERR)
+		printk("%s: entry not found: 0x%lx (%ld)\n", __func__, request->op.iova, request->op.size);
 	return -EINVAL;
 }
 
+/**
+ * Copies part of a bounce buffer between the device and userspace while
+ * it stays mapped
+ *
+ * request->op.iova is the DMA-address returned by map, request->op.va the
+ * offset and request->op.size the length of the range. FROMDEVICE copies
+ * what the device wrote to userspace, TODEVICE copies userspace data to the
+ * bounce buffer.
+ */
+static long
+dma_mem_sync(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	struct dma_op_list *entry;
+	struct dma_bounce *b = NULL;
+	struct hlist_node *node;
+	unsigned long off = request->op.va, len = request->op.size;
+	ktime_t start;
+	long ret = 0;
+
+	/* the reference keeps the buffer, an unmap waits for the copy on b->lock */
+	spin_lock(&ddev->bounce_lock);
+	hlist_for_each_entry(entry, node, dma_hash(ddev->bounce_hash, request->op.iova), next) {
+		if(entry->op.iova == request->op.iova) {
+			b = container_of(entry, struct dma_bounce, entry);
+			b->users++;
+			break;
+		}
+	}
+	spin_unlock(&ddev->bounce_lock);
+
+	if(!b) {
+		if(debug & DEBUG_ERR)
+			printk("%s: entry not found: 0x%lx\n", __func__, request->op.iova);
+		return -EINVAL;
+	}
+
+	mutex_lock(&b->lock);
+	/* unmapped while waiting for the lock */
+	if(b->unmapped || off > entry->op.size || len > entry->op.size - off) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	start = ktime_get();
+	if(request->op.direction == DDEKIT_DMA_FROMDEVICE) {
+		pci_dma_sync_single_for_cpu(ddev->pci_dev, b->dma + off, len, PCI_DMA_BIDIRECTIONAL);
+		if(copy_to_user((void __user *)(entry->op.va + off), entry->kva + off, len))
+			ret = -EFAULT;
+	} else if(request->op.direction == DDEKIT_DMA_TODEVICE) {
+		if(copy_from_user(entry->kva + off, (const void __user *)(entry->op.va + off), len))
+			ret = -EFAULT;
+		pci_dma_sync_single_for_device(ddev->pci_dev, b->dma + off, len, PCI_DMA_BIDIRECTIONAL);
+	} else
+		ret = -EINVAL;
+	if(!ret)
+		dma_stat_copy(ddev, start, len);
+
+out:
+	mutex_unlock(&b->lock);
+	dma_bounce_unpin(ddev, b);
+
+	return ret;
+}
+
 /**
  * Returns for a contiguous memory region acquired
  * with mmap() a DMA-address.
@@ -469,18 +1216,14 @@ static long
 dma_translate_contiguous(struct dma_op_list *request, struct uio_dma_device *ddev)
 {
 	struct dma_op_list *entry;
+	struct hlist_node *node;
 	unsigned long uva;
 
 	uva = request->op.va;
 
 	spin_lock(&ddev->cont_lock);
-	list_for_each_entry(entry, &ddev->cont_head, next) {
+	hlist_for_each_entry(entry, node, dma_hash(ddev->cont_hash, uva), next) {
 		if(entry->op.va == uva) {
-#if 1
-			if(entry->op.size >= 4096) {
-				printk(" iova: 0x%lx\n", entry->op.iova);
-			}
-#endif	
 			request->op.iova = entry->op.iova;
 			spin_unlock(&ddev->cont_lock);
 			return 0;
@@ -497,13 +1240,14 @@ static long
 dma_free_contiguous(struct dma_op_list *request, struct uio_dma_device *ddev)
 {
 	unsigned long uva;
-	struct dma_op_list *entry, *next_entry;
+	struct dma_op_list *entry;
+	struct hlist_node *node;
 	uva = request->op.va;
 
 	spin_lock(&ddev->cont_lock);
-	list_for_each_entry_safe(entry, next_entry, &ddev->cont_head, next) {
+	hlist_for_each_entry(entry, node, dma_hash(ddev->cont_hash, uva), next) {
 		if(entry->op.va == uva) {
-			list_del(&entry->next);
+			hlist_del(&entry->next);
 			spin_unlock(&ddev->cont_lock);
 			/*
 			printk("%s: unmapping 0x%lx size 0x%lx from kva 0x%lx and uva 0x%lx\n", __func__,
@@ -517,8 +1261,8 @@ dma_free_contiguous(struct dma_op_list *request, struct uio_dma_device *ddev)
 			return 0;
 		}
 	}
-	printk("%s: could not free memory at 0x%lx\n", __func__, request->op.iova);
 	spin_unlock(&ddev->cont_lock);
+	printk("%s: could not free memory at 0x%lx\n", __func__, request->op.va);
 	return -1;
 
 }
@@ -528,5 +1272,334 @@ struct uio_dma_ops uio_bounce_ops = {
 	.unmap = dma_mem_unmap,
 	.translate = dma_translate_contiguous,
 	.free = dma_free_contiguous,
+	.sync = dma_mem_sync,
 };
 
+
+/** Pinned regions **/
+
+/* largest IOMMU page order used for regions, 1 GB */
+#define DMA_REGION_MAX_ORDER (30 - PAGE_SHIFT)
+
+static int
+dma_iommu_prot(unsigned int direction)
+{
+	switch(direction) {
+		case DDEKIT_DMA_TODEVICE: return IOMMU_READ;
+		case DDEKIT_DMA_FROMDEVICE: return IOMMU_WRITE;
+		default: return IOMMU_READ | IOMMU_WRITE;
+	}
+}
+
+/**
+ * Unmap the first nr_pages pages of region from the IOMMU domain
+ */
+static void
+dma_region_unmap_pages(struct dma_region *region, struct uio_dma_device *ddev, int nr_pages)
+{
+	int page;
+
+	for(page = 0; page < nr_pages; page += 1 << region->orders[page])
+		iommu_unmap(ddev->domain, region->op.iova + page * PAGE_SIZE, region->orders[page]);
+	atomic_long_sub((long)nr_pages << PAGE_SHIFT, &ddev->stats.iommu_mapped);
+}
+
+/**
+ * Map the pinned pages of region at region->op.iova
+ *
+ * Each physically contiguous run is mapped with the largest page order
+ * that the alignment of its iova and physical address allows, so a huge
+ * page takes a single IOMMU entry.
+ */
+static long
+dma_region_map_pages(struct dma_region *region, struct uio_dma_device *ddev)
+{
+	int page, run, order;
+	long ret;
+	unsigned long iova, pfn;
+	phys_addr_t phys;
+
+	region->orders = vmalloc(region->nr_pages);
+	if(!region->orders)
+		return -ENOMEM;
+
+	for(page = 0; page < region->nr_pages; page += 1 << order) {
+		iova = region->op.iova + page * PAGE_SIZE;
+		pfn = page_to_pfn(region->page_list[page]);
+		phys = PFN_PHYS(pfn);
+
+		for(run = 1; page + run < region->nr_pages && run < (1 << DMA_REGION_MAX_ORDER); run++) {
+			if(page_to_pfn(region->page_list[page + run]) != pfn + run)
+				break;
+		}
+		for(order = ilog2(run); order; order--) {
+			if(!((iova | phys) & ((PAGE_SIZE << order) - 1)))
+				break;
+		}
+
+		ret = iommu_map(ddev->domain, iova, phys, order,
+		                dma_iommu_prot(region->op.direction) | ddev->iommu_flags);
+		if(ret) {
+			printk(KERN_ERR "%s: iommu_map failed with %ld\n", __func__, ret);
+			dma_region_unmap_pages(region, ddev, page);
+			vfree(region->orders);
+			region->orders = NULL;
+			return -ENXIO;
+		}
+		region->orders[page] = order;
+		atomic_long_add(PAGE_SIZE << order, &ddev->stats.iommu_mapped);
+	}
+
+	region->mapped = 1;
+	return 0;
+}
+
+static void
+dma_region_destroy(struct dma_region *region, struct uio_dma_device *ddev)
+{
+	int page;
+
+	if(region->mapped) {
+		dma_region_unmap_pages(region, ddev, region->nr_pages);
+		vfree(region->orders);
+	}
+
+	for(page = 0; page < region->nr_pages; page++)
+		put_page(region->page_list[page]);
+	atomic_long_sub((long)region->nr_pages << PAGE_SHIFT, &ddev->stats.pinned);
+
+	vfree(region->page_list);
+	kfree(region);
+}
+
+/**
+ * Pin the page-aligned user buffer described by request
+ */
+static struct dma_region *
+dma_region_pin(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	int nr_pages_pinned;
+	long ret;
+	struct dma_region *region;
+
+	if(!request->op.size || ((request->op.va | request->op.size) & ~PAGE_MASK))
+		return ERR_PTR(-EINVAL);
+
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if(!region)
+		return ERR_PTR(-ENOMEM);
+
+	memcpy(&region->op, &request->op, sizeof(struct dma_op));
+	region->nr_pages = region->op.size >> PAGE_SHIFT;
+
+	region->page_list = vmalloc(sizeof(*region->page_list) * region->nr_pages);
+	if(!region->page_list) {
+		ret = -ENOMEM;
+		goto err_alloc;
+	}
+
+	nr_pages_pinned = get_user_pages_fast(region->op.va, region->nr_pages, 1, region->page_list);
+	if(nr_pages_pinned != region->nr_pages) {
+		printk(KERN_ERR "%s: pinned %d of %d pages\n", __func__, nr_pages_pinned, region->nr_pages);
+		ret = -EFAULT;
+		goto err_pin;
+	}
+	atomic_long_add((long)region->nr_pages << PAGE_SHIFT, &ddev->stats.pinned);
+
+	return region;
+
+err_pin:
+	while(nr_pages_pinned-- > 0)
+		put_page(region->page_list[nr_pages_pinned]);
+	vfree(region->page_list);
+err_alloc:
+	kfree(region);
+	return ERR_PTR(ret);
+}
+
+static void
+dma_region_add(struct dma_region *region, struct uio_dma_device *ddev)
+{
+	spin_lock(&ddev->region_lock);
+	list_add(&region->next, &ddev->region_head);
+	spin_unlock(&ddev->region_lock);
+
+	if(debug & DEBUG_MAP)
+		printk("%s: registered 0x%lx (%lu) at 0x%lx\n", __func__, region->op.va, region->op.size, region->op.iova);
+}
+
+/**
+ * Map the pinned pages of region into the IOMMU domain and add it to the
+ * regions of ddev
+ *
+ * Both happen with ddev->iova_lock held, so no streaming mapping can take
+ * the IOVA range between the check for existing mappings and the mapping.
+ */
+static long
+dma_region_map_add(struct dma_region *region, struct uio_dma_device *ddev)
+{
+	int page;
+	long ret = 0;
+
+	mutex_lock(&ddev->iova_lock);
+	/* lazily unmapped streaming mappings still occupy their range */
+	dma_iommu_flush(ddev);
+	/* do not silently replace mappings of other users of the domain */
+	for(page = 0; page < region->nr_pages; page++) {
+		if(iommu_iova_to_phys(ddev->domain, region->op.iova + page * PAGE_SIZE)) {
+			ret = -EBUSY;
+			goto out;
+		}
+	}
+	if(!(ret = dma_region_map_pages(region, ddev)))
+		dma_region_add(region, ddev);
+out:
+	mutex_unlock(&ddev->iova_lock);
+	return ret;
+}
+
+/**
+ * Pins a user buffer for the lifetime of the file descriptor, so that
+ * user space can sub-allocate DMA memory from it without further calls
+ * into the kernel. This is meant for huge pages.
+ *
+ * With an IOMMU, the buffer is mapped at iova == va, as a single large
+ * page if it is physically contiguous and aligned. Without an IOMMU, the
+ * buffer has to be physically contiguous and its bus address is returned.
+ */
+long
+dma_region_register(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	int page;
+	long ret;
+	unsigned long pfn;
+	struct dma_region *region;
+
+	region = dma_region_pin(request, ddev);
+	if(IS_ERR(region))
+		return PTR_ERR(region);
+
+	if(ddev->dma_ops == &uio_iommu_ops) {
+		region->op.iova = region->op.va;
+		region->op.direction = DDEKIT_DMA_BIDIRECTIONAL;
+		if((ret = dma_region_map_add(region, ddev)))
+			goto err;
+	} else {
+		pfn = page_to_pfn(region->page_list[0]);
+		for(page = 1; page < region->nr_pages; page++) {
+			if(page_to_pfn(region->page_list[page]) != pfn + page) {
+				printk(KERN_ERR "%s: region at 0x%lx is not physically contiguous\n", __func__, region->op.va);
+				ret = -EINVAL;
+				goto err;
+			}
+		}
+		region->op.iova = PFN_PHYS(pfn);
+		dma_region_add(region, ddev);
+	}
+
+	request->op.iova = region->op.iova;
+	return 0;
+
+err:
+	dma_region_destroy(region, ddev);
+	return ret;
+}
+
+/**
+ * Maps a user buffer into the IOMMU domain once, DMA_IOMMU_MAP
+ *
+ * The buffer is pinned and mapped at request->op.iova, or at iova == va
+ * if no iova is given, until DMA_IOMMU_UNMAP or the last close. Unlike
+ * DMA_REGISTER the buffer need not be physically contiguous; it only has
+ * to be page aligned. Streaming mappings of memory inside the buffer are
+ * computed by user space as iova + offset.
+ */
+long
+dma_region_map_iommu(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	long ret;
+	struct dma_region *region;
+
+	if(ddev->dma_ops != &uio_iommu_ops)
+		return -ENODEV;
+
+	if(!request->op.iova)
+		request->op.iova = request->op.va;
+	if((request->op.iova & ~PAGE_MASK) || request->op.iova + request->op.size < request->op.iova)
+		return -EINVAL;
+
+	region = dma_region_pin(request, ddev);
+	if(IS_ERR(region))
+		return PTR_ERR(region);
+
+	if((ret = dma_region_map_add(region, ddev))) {
+		dma_region_destroy(region, ddev);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Remove the region starting at va, or at iova if iova is not 0
+ */
+static long
+dma_region_remove(struct dma_op_list *request, struct uio_dma_device *ddev, int by_iova)
+{
+	struct dma_region *region;
+
+	spin_lock(&ddev->region_lock);
+	list_for_each_entry(region, &ddev->region_head, next) {
+		if(by_iova ? region->mapped && region->op.iova == request->op.iova
+		           : region->op.va == request->op.va) {
+			list_del(&region->next);
+			spin_unlock(&ddev->region_lock);
+			dma_region_destroy(region, ddev);
+			request->op.iova = 0;
+			return 0;
+		}
+	}
+	spin_unlock(&ddev->region_lock);
+
+	printk("%s: region 0x%lx not found\n", __func__, by_iova ? request->op.iova : request->op.va);
+	return -EINVAL;
+}
+
+/**
+ * Releases a buffer pinned with dma_region_register()
+ */
+long
+dma_region_unregister(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	return dma_region_remove(request, ddev, 0);
+}
+
+/**
+ * Unmaps a buffer mapped with dma_region_map_iommu(), DMA_IOMMU_UNMAP
+ *
+ * The buffer is identified by its iova, or by its va if iova is 0.
+ */
+long
+dma_region_unmap_iommu(struct dma_op_list *request, struct uio_dma_device *ddev)
+{
+	return dma_region_remove(request, ddev, request->op.iova != 0);
+}
+
+/**
+ * Releases all pinned regions, called when the last fd is closed
+ */
+void
+dma_region_release_all(struct uio_dma_device *ddev)
+{
+	struct dma_region *region, *next_region;
+	LIST_HEAD(regions);
+
+	spin_lock(&ddev->region_lock);
+	list_splice_init(&ddev->region_head, &regions);
+	spin_unlock(&ddev->region_lock);
+
+	list_for_each_entry_safe(region, next_region, &regions, next) {
+		list_del(&region->next);
+		dma_region_destroy(region, ddev);
+	}
+}
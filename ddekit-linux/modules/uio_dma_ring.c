@@ -0,0 +1,352 @@
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/mmu_context.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+
+#include "uio_dma.h"
+
+/* submissions consumed per pass before the polling thread reschedules */
+#define DMA_RING_BUDGET   64
+/* empty passes the polling thread spins before it naps */
+#define DMA_RING_SPIN     128
+
+/** Submission/completion ring **/
+
+struct dma_ring_ctx {
+	struct uio_dma_device *ddev;
+	struct dma_ring       *ring;
+	struct dma_ring_sqe   *sq;
+	struct dma_ring_cqe   *cq;
+	unsigned int          mask;
+	unsigned long         size;
+	struct mutex          lock;      /* serializes consumers */
+	struct mm_struct      *mm;       /* owner's mm, pinned via mm_count */
+	struct task_struct    *thread;
+	wait_queue_head_t     wait;      /* polling thread sleeps here */
+	wait_queue_head_t     poll_wait; /* poll() on completions */
+	unsigned long         idle;      /* jiffies of polling before sleeping */
+};
+
+static inline int
+dma_ring_cq_full(struct dma_ring_ctx *ctx)
+{
+	return ctx->ring->cq_tail - ACCESS_ONCE(ctx->ring->cq_head) > ctx->mask;
+}
+
+/**
+ * Consume up to budget submissions, called with ctx->lock held in a
+ * context that has the owner's mm
+ *
+ * \return number of submissions consumed
+ */
+static int
+dma_ring_process(struct uio_dma_device *ddev, struct dma_ring_ctx *ctx, int budget)
+{
+	struct dma_ring *ring = ctx->ring;
+	struct dma_ring_sqe *sqe;
+	struct dma_ring_cqe *cqe;
+	struct dma_op_list request;
+	unsigned int head = ring->sq_head, tail, opcode;
+	unsigned long tag;
+	long ret;
+	int done = 0;
+
+	tail = ACCESS_ONCE(ring->sq_tail);
+	smp_rmb();
+
+	while(head != tail && done < budget) {
+		/* the completion of this entry must not be lost */
+		if(dma_ring_cq_full(ctx))
+			break;
+
+		/* user space may rewrite the entry, work on a copy */
+		sqe = &ctx->sq[head & ctx->mask];
+		memset(&request, 0, sizeof(request));
+		request.op = sqe->op;
+		tag = ACCESS_ONCE(sqe->tag);
+		opcode = ACCESS_ONCE(sqe->opcode);
+
+		if(opcode == DMA_RING_OP_MAP)
+			ret = dma_op_map(&request, ddev);
+		else if(opcode == DMA_RING_OP_UNMAP)
+			ret = dma_op_unmap(&request, ddev);
+		else
+			ret = -EINVAL;
+
+		if(tag || ret) {
+			cqe = &ctx->cq[ring->cq_tail & ctx->mask];
+			cqe->tag = tag;
+			cqe->iova = ret ? 0 : request.op.iova;
+			cqe->result = ret;
+			smp_wmb();
+			ring->cq_tail++;
+		}
+
+		head++;
+		done++;
+	}
+
+	if(done) {
+		smp_mb();
+		ring->sq_head = head;
+		wake_up_interruptible(&ctx->poll_wait);
+	}
+
+	return done;
+}
+
+/**
+ * Consume all pending submissions in the caller's context
+ */
+static void
+dma_ring_drain(struct uio_dma_device *ddev, struct dma_ring_ctx *ctx)
+{
+	mutex_lock(&ctx->lock);
+	while(dma_ring_process(ddev, ctx, DMA_RING_BUDGET) == DMA_RING_BUDGET)
+		cond_resched();
+	mutex_unlock(&ctx->lock);
+}
+
+static inline int
+dma_ring_pending(struct dma_ring_ctx *ctx)
+{
+	return ctx->ring->sq_head != ACCESS_ONCE(ctx->ring->sq_tail);
+}
+
+/**
+ * Sleep until DMA_RING_ENTER, a pending submission or the timeout, user
+ * space sees DMA_RING_NEED_WAKEUP meanwhile
+ */
+static void
+dma_ring_sleep(struct dma_ring_ctx *ctx, long timeout)
+{
+	DEFINE_WAIT(wait);
+
+	prepare_to_wait(&ctx->wait, &wait, TASK_INTERRUPTIBLE);
+	ctx->ring->flags |= DMA_RING_NEED_WAKEUP;
+	smp_mb();
+	if(!dma_ring_pending(ctx) && !kthread_should_stop())
+		schedule_timeout(timeout);
+	finish_wait(&ctx->wait, &wait);
+	ctx->ring->flags &= ~DMA_RING_NEED_WAKEUP;
+}
+
+/**
+ * Polling consumer
+ *
+ * The thread borrows the owner's mm while it is busy. On an empty ring it
+ * spins DMA_RING_SPIN passes, then naps a jiffy at a time until ctx->idle
+ * jiffies passed without submissions. Then it returns the mm and sleeps
+ * until DMA_RING_ENTER wakes it.
+ */
+static int
+dma_ring_thread(void *data)
+{
+	struct dma_ring_ctx *ctx = data;
+	struct uio_dma_device *ddev = ctx->ddev;
+	unsigned long idle_end;
+	unsigned int spins;
+	int done;
+
+	while(!kthread_should_stop()) {
+		if(!atomic_inc_not_zero(&ctx->mm->mm_users))
+			break;  /* owner exited */
+		use_mm(ctx->mm);
+
+		idle_end = jiffies + ctx->idle;
+		spins = 0;
+		while(!kthread_should_stop()) {
+			mutex_lock(&ctx->lock);
+			done = dma_ring_process(ddev, ctx, DMA_RING_BUDGET);
+			mutex_unlock(&ctx->lock);
+
+			if(done) {
+				idle_end = jiffies + ctx->idle;
+				spins = 0;
+				cond_resched();
+				continue;
+			}
+			if(time_after(jiffies, idle_end))
+				break;
+			if(++spins < DMA_RING_SPIN)
+				cpu_relax();
+			else
+				dma_ring_sleep(ctx, 1);
+		}
+
+		unuse_mm(ctx->mm);
+		mmput(ctx->mm);
+
+		dma_ring_sleep(ctx, MAX_SCHEDULE_TIMEOUT);
+	}
+
+	/* wait for kthread_stop() */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while(!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+/**
+ * Allocate the ring of ddev, DMA_RING_SETUP
+ */
+long
+dma_ring_setup(struct uio_dma_device *ddev, unsigned long arg)
+{
+	long ret;
+	struct dma_ring_setup setup;
+	struct dma_ring_ctx *ctx;
+
+	if(copy_from_user(&setup, (const void __user *)arg, sizeof(setup)))
+		return -EFAULT;
+
+	if(!setup.entries || setup.entries > DMA_RING_MAX_ENTRIES ||
+	   (setup.entries & (setup.entries - 1)))
+		return -EINVAL;
+
+	mutex_lock(&ddev->ring_lock);
+	if(ddev->ring) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if(!ctx) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ctx->size = PAGE_ALIGN(DMA_RING_SIZE(setup.entries));
+	ctx->ring = vmalloc_user(ctx->size);
+	if(!ctx->ring) {
+		ret = -ENOMEM;
+		goto err_ring;
+	}
+	ctx->ring->entries = setup.entries;
+	ctx->sq = DMA_RING_SQ(ctx->ring);
+	ctx->cq = DMA_RING_CQ(ctx->ring);
+	ctx->mask = setup.entries - 1;
+	ctx->idle = usecs_to_jiffies(setup.idle_us);
+	mutex_init(&ctx->lock);
+	init_waitqueue_head(&ctx->wait);
+	init_waitqueue_head(&ctx->poll_wait);
+	ctx->ddev = ddev;
+
+	ctx->mm = current->mm;
+	atomic_inc(&ctx->mm->mm_count);
+
+	if(setup.flags & DMA_RING_SETUP_POLL) {
+		ctx->thread = kthread_run(dma_ring_thread, ctx, "uio%d-dma-ring", ddev->minor);
+		if(IS_ERR(ctx->thread)) {
+			ret = PTR_ERR(ctx->thread);
+			goto err_thread;
+		}
+	}
+
+	setup.size = ctx->size;
+	if(copy_to_user((void __user *)arg, &setup, sizeof(setup))) {
+		ret = -EFAULT;
+		goto err_copy;
+	}
+
+	/* dma_ring_enter() reads ddev->ring without the lock */
+	smp_wmb();
+	ddev->ring = ctx;
+
+	mutex_unlock(&ddev->ring_lock);
+	return 0;
+
+err_copy:
+	if(ctx->thread)
+		kthread_stop(ctx->thread);
+err_thread:
+	mmdrop(ctx->mm);
+	vfree(ctx->ring);
+err_ring:
+	kfree(ctx);
+out:
+	mutex_unlock(&ddev->ring_lock);
+	return ret;
+}
+
+/**
+ * Consume the ring or wake its thread, DMA_RING_ENTER and other ioctls
+ */
+void
+dma_ring_enter(struct uio_dma_device *ddev)
+{
+	struct dma_ring_ctx *ctx = ddev->ring;
+
+	if(!ctx)
+		return;
+
+	if(ctx->thread) {
+		if(ACCESS_ONCE(ctx->ring->flags) & DMA_RING_NEED_WAKEUP)
+			wake_up_interruptible(&ctx->wait);
+		return;
+	}
+
+	if(current->mm == ctx->mm)
+		dma_ring_drain(ddev, ctx);
+}
+
+unsigned int
+dma_ring_poll(struct uio_dma_device *ddev, struct file *fp, poll_table *wait)
+{
+	struct dma_ring_ctx *ctx = ddev->ring;
+
+	if(!ctx)
+		return POLLERR;
+
+	poll_wait(fp, &ctx->poll_wait, wait);
+	dma_ring_enter(ddev);
+
+	return ctx->ring->cq_tail != ACCESS_ONCE(ctx->ring->cq_head) ? POLLIN | POLLRDNORM : 0;
+}
+
+int
+dma_ring_mmap(struct uio_dma_device *ddev, struct vm_area_struct *vma)
+{
+	struct dma_ring_ctx *ctx = ddev->ring;
+
+	if(!ctx)
+		return -ENXIO;
+	if(vma->vm_end - vma->vm_start != ctx->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ctx->ring, 0);
+}
+
+/**
+ * Stop the consumer and free the ring, called when the last fd is closed
+ */
+void
+dma_ring_destroy(struct uio_dma_device *ddev)
+{
+	struct dma_ring_ctx *ctx;
+
+	mutex_lock(&ddev->ring_lock);
+	ctx = ddev->ring;
+	ddev->ring = NULL;
+	mutex_unlock(&ddev->ring_lock);
+
+	if(!ctx)
+		return;
+
+	if(ctx->thread)
+		kthread_stop(ctx->thread);
+
+	mmdrop(ctx->mm);
+	vfree(ctx->ring);
+	kfree(ctx);
+}
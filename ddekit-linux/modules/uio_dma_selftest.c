@@ -0,0 +1,145 @@
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/kernel.h>
+
+#include "uio_dma.h"
+
+/* map/unmap pairs timed per table size */
+#define SELFTEST_ROUNDS 256
+/* the pairs may take this many times longer at the largest table than at the smallest */
+#define SELFTEST_MAX_GROWTH 4
+
+/** Map/unmap latency selftest **/
+
+static const unsigned int selftest_live[] = { 64, 256, 1024, 4096, 16384 };
+
+static long
+selftest_map(struct uio_dma_device *ddev, unsigned long va, struct dma_op_list *req)
+{
+	memset(req, 0, sizeof(*req));
+	req->op.va = va;
+	req->op.size = PAGE_SIZE;
+	req->op.direction = DDEKIT_DMA_TODEVICE;
+
+	return ddev->dma_ops->map(req, ddev);
+}
+
+static void
+selftest_unmap(struct uio_dma_device *ddev, struct dma_op_list *req)
+{
+	ddev->dma_ops->unmap(req, ddev);
+}
+
+/**
+ * Measure the latency of map/unmap against the number of live mappings
+ *
+ * The test maps one page per live mapping of an anonymous buffer in the
+ * calling process, then times SELFTEST_ROUNDS map/unmap pairs, each of
+ * another page. The registration cache and the flush queue are drained
+ * before, so every pair pins, maps, unmaps and unpins its page.
+ *
+ * The test fails if a map fails or the pairs at the largest table take more
+ * than SELFTEST_MAX_GROWTH times as long as at the smallest. It claims the
+ * device, which has to be closed.
+ *
+ * \param max  largest number of live mappings to test
+ * \param buf  receives one line per table size and the verdict
+ * \return number of characters written or error code, -ERANGE on failure
+ */
+ssize_t
+dma_selftest(struct uio_dma_device *ddev, unsigned int max, char *buf, size_t len)
+{
+	struct dma_op_list *live;
+	struct dma_op_list pair;
+	unsigned long addr, size, spare;
+	unsigned int nr = 0, i, t;
+	ktime_t start;
+	s64 ns, first = 0, last = 0;
+	ssize_t n = 0;
+	long ret = 0;
+
+	if(atomic_cmpxchg(&ddev->ref_cnt, 0, DMA_REF_SELFTEST))
+		return -EBUSY;
+
+	if(!max || max > selftest_live[ARRAY_SIZE(selftest_live) - 1])
+		max = selftest_live[ARRAY_SIZE(selftest_live) - 1];
+
+	live = vmalloc(max * sizeof(*live));
+	if(!live) {
+		ret = -ENOMEM;
+		goto out_release;
+	}
+
+	/* one page per live mapping plus one per timed pair */
+	size = (unsigned long)(max + SELFTEST_ROUNDS) << PAGE_SHIFT;
+	down_write(&current->mm->mmap_sem);
+	addr = do_mmap(NULL, 0, size, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, 0);
+	up_write(&current->mm->mmap_sem);
+	if(IS_ERR_VALUE(addr)) {
+		ret = (long)addr;
+		goto out_free;
+	}
+	spare = addr + ((unsigned long)max << PAGE_SHIFT);
+
+	n += scnprintf(buf + n, len - n, "%s: live  map+unmap [ns]\n",
+	               ddev->dma_ops == &uio_iommu_ops ? "iommu" : "bounce");
+
+	for(t = 0; t < ARRAY_SIZE(selftest_live) && selftest_live[t] <= max; t++) {
+		for(; nr < selftest_live[t]; nr++) {
+			ret = selftest_map(ddev, addr + ((unsigned long)nr << PAGE_SHIFT), &live[nr]);
+			if(ret) {
+				n += scnprintf(buf + n, len - n, "FAIL: map of live page %u: %ld\n", nr, ret);
+				goto out_unmap;
+			}
+		}
+
+		dma_iommu_drain(ddev);
+
+		start = ktime_get();
+		for(i = 0; i < SELFTEST_ROUNDS; i++) {
+			ret = selftest_map(ddev, spare + ((unsigned long)i << PAGE_SHIFT), &pair);
+			if(ret) {
+				n += scnprintf(buf + n, len - n, "FAIL: map of page %u: %ld\n", i, ret);
+				goto out_unmap;
+			}
+			selftest_unmap(ddev, &pair);
+		}
+		ns = div_s64(ktime_to_ns(ktime_sub(ktime_get(), start)), SELFTEST_ROUNDS);
+
+		if(!t)
+			first = ns;
+		last = ns;
+		n += scnprintf(buf + n, len - n, "%5u  %lld\n", nr, (long long)ns);
+	}
+
+	if(last > first * SELFTEST_MAX_GROWTH) {
+		n += scnprintf(buf + n, len - n, "FAIL: %lld ns at %u live mappings, %lld ns at %u\n",
+		               (long long)last, nr, (long long)first, selftest_live[0]);
+		ret = -ERANGE;
+	} else {
+		n += scnprintf(buf + n, len - n, "PASS\n");
+	}
+
+out_unmap:
+	while(nr--)
+		selftest_unmap(ddev, &live[nr]);
+
+	down_write(&current->mm->mmap_sem);
+	do_munmap(current->mm, addr, size);
+	up_write(&current->mm->mmap_sem);
+
+	/* drop the registrations and the notifier on the calling process */
+	dma_iommu_release_all(ddev);
+out_free:
+	vfree(live);
+out_release:
+	atomic_set(&ddev->ref_cnt, 0);
+	wake_up_interruptible(&ddev->close);
+
+	return ret ? ret : n;
+}
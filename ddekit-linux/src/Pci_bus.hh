@@ -41,8 +41,10 @@ namespace DDEKit
 			int munmap_resource(ddekit_addr_t, ddekit_addr_t);
 			char * nameLookup(int device_id, int vendor_id, char * dest, int len);
 			int bind_irq(int);
+			int numa_node();
 			void unbind_irq(int);
 			int pcie_register(unsigned, unsigned, unsigned);
+			struct ddekit_dma_ctx *dma_ctx(unsigned, unsigned, unsigned);
 			const ddekit_pci_dev_t* to_dev(unsigned, unsigned, unsigned);
 			int request_ioport(ddekit_addr_t , ddekit_addr_t);
 			//void port_io(int port, int *val, int len, bool write);
@@ -13,6 +13,7 @@
 
 #include <ddekit/printf.h>
 #include <ddekit/memory.h>
+#include <ddekit/dma.h>
 
 #include "Pci_device.h"
 #include "Pci_resource.h"
@@ -30,6 +31,7 @@ Pci_device::Pci_device(Pci_bus *bus, struct pci_dev * dev, int num)
 {
 	//assign pci_device
 	device = dev;
+	dma_ctx = 0;
 	/* pci device human readable name */	
 	device_name = (char *)ddekit_simple_malloc(128);
 	bus->nameLookup(device->device_id, device->vendor_id, device_name, 128);
@@ -47,6 +49,7 @@ Pci_device::Pci_device(Pci_bus *bus, struct pci_dev * dev, int num)
 
 	//read resources
 	init_resources();
+	init_numa_node();
 
 	uio_register(0);
 
@@ -89,6 +92,43 @@ Pci_device::get_uio_id()
 	return uio_id;
 }
 
+int
+Pci_device::get_numa_node()
+{
+	return numa_node;
+}
+
+/**
+ * DMA context of the device, its uio_dma device is opened on first use
+ */
+struct ddekit_dma_ctx *
+Pci_device::get_dma_ctx()
+{
+	if(!dma_ctx && uio_id >= 0)
+		dma_ctx = ddekit_dma_ctx_open(uio_id);
+	return dma_ctx;
+}
+
+/**
+ * Read the NUMA node the device is attached to, -1 if unknown
+ */
+void
+Pci_device::init_numa_node()
+{
+	char path[128];
+	snprintf(path, sizeof(path), "%s/numa_node", sysfs_path);
+	std::ifstream node(path, std::ios::in);
+
+	numa_node = -1;
+	if(node.fail()) {
+		ddekit_printf("%s: Error openening file %s for reading\n", __func__, path);
+		return;
+	}
+	node >> numa_node;
+	if(node.fail())
+		numa_node = -1;
+}
+
 void
 Pci_device::init_resources()
 {
@@ -9,6 +9,7 @@ EXTERN_C_END
 #include "Pci_resource.h"
 
 typedef struct ddekit_pci_dev ddekit_pci_dev_t;
+struct ddekit_dma_ctx;
 
 namespace DDEKit
 {
@@ -23,6 +24,8 @@ namespace DDEKit
 		//	Pci_device& operator=(Pci_device &rhs);
 			void name();
 			int get_uio_id();
+			int get_numa_node();
+			struct ddekit_dma_ctx *get_dma_ctx();
 			void dump_resources();
 			ddekit_addr_t  mmap(ddekit_addr_t, ddekit_addr_t);
 			ddekit_pci_dev_t *ref;
@@ -37,11 +40,14 @@ namespace DDEKit
 			int slot;
 			int fun;
 			int uio_id;
+			int numa_node;
+			struct ddekit_dma_ctx *dma_ctx;
 			char * sysfs_path;
 			char * device_name;
 			char * pci_name;
 			std::list<Pci_resource> resource;
 			void init_resources(void);
+			void init_numa_node(void);
 			int uio_register(int);
 			void uio_release(int, int);
 			int bind_irq(int irq, int);
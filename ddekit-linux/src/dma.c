@@ -13,54 +13,579 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
 
 void ddekit_dma_init(void);
 
 ddekit_addr_t ddekit_dma_map(ddekit_addr_t, unsigned int, ddekit_dma_dir_t);
 void ddekit_dma_unmap(ddekit_addr_t, unsigned int, ddekit_dma_dir_t);
 
-static int dma_fd;
+/* context of the first PCI device, used for NULL; head of all contexts */
+static struct ddekit_dma_ctx dma_primary = { -1, -1, DMA_MODE_BOUNCE, 1, ~0ULL, 0, 0 };
+static pthread_mutex_t dma_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct ddekit_dma_ctx *
+dma_ctx(struct ddekit_dma_ctx *ctx)
+{
+	return ctx ? ctx : &dma_primary;
+}
+
+static struct ddekit_dma_stats dma_stats;
 
 void
-ddekit_dma_init()
+ddekit_dma_get_stats(struct ddekit_dma_stats *stats)
+{
+	*stats = dma_stats;
+}
+
+static unsigned long long
+dma_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* count a system call started at start in the log2 histogram, as uio_dma does */
+static void
+dma_hist_add(unsigned long *hist, unsigned long long start)
+{
+	unsigned long long ns = dma_now_ns() - start;
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if(bucket >= DDEKIT_DMA_HIST_BUCKETS)
+		bucket = DDEKIT_DMA_HIST_BUCKETS - 1;
+	__sync_fetch_and_add(&hist[bucket], 1);
+}
+
+/*****************************
+ ** Pre-mapped memory       **
+ *****************************/
+
+/*
+ * Memory registered once for DMA at startup (the coherent arena and the
+ * streaming page pool) already has a bus address. Mapping a buffer inside
+ * such a region only looks that address up; unmapping it does nothing.
+ * Regions are never removed, so the table is read without locking.
+ */
+
+#define DMA_STATIC_MAX 256
+
+struct dma_static {
+	ddekit_addr_t va;
+	ddekit_addr_t bus;
+	unsigned long size;
+};
+
+static struct dma_static dma_static[DMA_STATIC_MAX];
+static volatile unsigned int dma_static_nr;
+static pthread_mutex_t dma_static_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* bounds of all regions, rejecting other buffers with two compares */
+static ddekit_addr_t dma_static_va_lo = ~0UL, dma_static_va_hi;
+static ddekit_addr_t dma_static_bus_lo = ~0UL, dma_static_bus_hi;
+
+/**
+ * Register memory that is mapped for DMA for the lifetime of the process
+ *
+ * \return 0 on success, -1 if the table is full
+ */
+int
+ddekit_dma_add_static(ddekit_addr_t va, unsigned long size, ddekit_addr_t bus)
+{
+	struct dma_static *r;
+
+	pthread_mutex_lock(&dma_static_lock);
+	if(dma_static_nr == DMA_STATIC_MAX) {
+		pthread_mutex_unlock(&dma_static_lock);
+		return -1;
+	}
+
+	r = &dma_static[dma_static_nr];
+	r->va = va;
+	r->bus = bus;
+	r->size = size;
+
+	if(va < dma_static_va_lo) dma_static_va_lo = va;
+	if(va + size > dma_static_va_hi) dma_static_va_hi = va + size;
+	if(bus < dma_static_bus_lo) dma_static_bus_lo = bus;
+	if(bus + size > dma_static_bus_hi) dma_static_bus_hi = bus + size;
+
+	__sync_synchronize();
+	dma_static_nr++;
+	pthread_mutex_unlock(&dma_static_lock);
+
+	return 0;
+}
+
+/**
+ * Look up the bus address of [va, va + size) in pre-mapped memory
+ *
+ * \return bus address, 0 if the buffer is not pre-mapped as a whole
+ */
+static inline ddekit_addr_t
+dma_static_map(ddekit_addr_t va, unsigned long size)
+{
+	unsigned int i, nr;
+
+	if(va < dma_static_va_lo || va + size > dma_static_va_hi)
+		return 0;
+
+	nr = dma_static_nr;
+	__sync_synchronize();
+	for(i = 0; i < nr; i++) {
+		if(va >= dma_static[i].va && va + size <= dma_static[i].va + dma_static[i].size)
+			return dma_static[i].bus + (va - dma_static[i].va);
+	}
+
+	return 0;
+}
+
+/**
+ * \return 1 if [bus, bus + size) was returned by dma_static_map()
+ */
+static inline int
+dma_static_unmap(ddekit_addr_t bus, unsigned long size)
+{
+	unsigned int i, nr;
+
+	if(bus < dma_static_bus_lo || bus + size > dma_static_bus_hi)
+		return 0;
+
+	nr = dma_static_nr;
+	__sync_synchronize();
+	for(i = 0; i < nr; i++) {
+		if(bus >= dma_static[i].bus && bus + size <= dma_static[i].bus + dma_static[i].size)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Pre-mapped memory is mapped for the primary device only, and only used
+ * where its bus address is within the DMA mask of the device
+ */
+static inline ddekit_addr_t
+dma_ctx_static_map(struct ddekit_dma_ctx *ctx, ddekit_addr_t va, unsigned long size)
+{
+	ddekit_addr_t bus;
+
+	if(!ctx->primary || !(bus = dma_static_map(va, size)))
+		return 0;
+	return bus + size - 1 <= ctx->dma_mask ? bus : 0;
+}
+
+static inline int
+dma_ctx_static_unmap(struct ddekit_dma_ctx *ctx, ddekit_addr_t bus, unsigned long size)
+{
+	return ctx->primary && dma_static_unmap(bus, size);
+}
+
+/*****************************************
+ ** Submission/completion ring (opt-in) **
+ *****************************************/
+
+/*
+ * With DDEKIT_DMA_RING=poll, map and unmap requests are posted to a ring
+ * shared with uio_dma and consumed by a kernel thread, so in steady state
+ * they cost no system call. DMA_RING_ENTER is only issued when the thread
+ * went to sleep after DDEKIT_DMA_RING_IDLE_US (default 1000) without work.
+ * With DDEKIT_DMA_RING=1 the ring is consumed on the next ioctl, which
+ * defers unmappings to the next mapping.
+ *
+ * Mappings wait for their completion. Unmappings towards the device do
+ * not; unmappings from the device wait, because a bounce buffer is only
+ * copied back when the unmapping is processed.
+ */
+
+#define DMA_RING_ENTRIES  256
+#define DMA_RING_IDLE_US  1000
+#define DMA_RING_SPINS    1024
+
+struct dma_ring_wait {
+	volatile int  done;
+	unsigned long iova;
+	long          result;
+};
+
+/* ring of a DMA context */
+struct ddekit_dma_ring {
+	struct dma_ring     *ring;
+	struct dma_ring_sqe *sq;
+	struct dma_ring_cqe *cq;
+	int                  polled;
+	pthread_mutex_t      sq_lock;
+	pthread_mutex_t      cq_lock;
+};
+
+static void
+dma_ring_init(struct ddekit_dma_ctx *ctx)
+{
+	struct dma_ring_setup setup;
+	struct ddekit_dma_ring *r;
+	char *env = getenv("DDEKIT_DMA_RING");
+	int polled;
+	void *va;
+
+	if(!env || (strcmp(env, "1") && strcmp(env, "poll")))
+		return;
+
+	polled = !strcmp(env, "poll");
+	setup.entries = DMA_RING_ENTRIES;
+	if((env = getenv("DDEKIT_DMA_RING_ENTRIES")))
+		setup.entries = strtoul(env, NULL, 0);
+	setup.idle_us = DMA_RING_IDLE_US;
+	if((env = getenv("DDEKIT_DMA_RING_IDLE_US")))
+		setup.idle_us = strtoul(env, NULL, 0);
+	setup.flags = polled ? DMA_RING_SETUP_POLL : 0;
+	setup.size = 0;
+
+	if(ioctl(ctx->fd, DMA_RING_SETUP, (unsigned long)&setup)) {
+		ddekit_printf("%s: ring setup failed (%d): %s\n", __func__, errno, strerror(errno));
+		return;
+	}
+
+	va = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd,
+	          DMA_RING_PGOFF * sysconf(_SC_PAGESIZE));
+	if(va == MAP_FAILED) {
+		ddekit_printf("%s: mapping ring failed (%d): %s\n", __func__, errno, strerror(errno));
+		return;
+	}
+
+	if(!(r = malloc(sizeof(*r)))) {
+		munmap(va, setup.size);
+		return;
+	}
+	r->sq = DMA_RING_SQ((struct dma_ring *)va);
+	r->cq = DMA_RING_CQ((struct dma_ring *)va);
+	r->polled = polled;
+	pthread_mutex_init(&r->sq_lock, NULL);
+	pthread_mutex_init(&r->cq_lock, NULL);
+	r->ring = va;
+	ctx->ring = r;
+
+	ddekit_printf("%s: uio%d: %u entries, %s\n", __func__, ctx->uio_id, setup.entries,
+	              polled ? "polled by uio_dma" : "consumed on ioctl");
+}
+
+/**
+ * Let uio_dma consume the ring
+ *
+ * \param force  enter the kernel even without polling thread
+ */
+static void
+dma_ring_kick(struct ddekit_dma_ctx *ctx, int force)
+{
+	struct ddekit_dma_ring *r = ctx->ring;
+
+	__sync_synchronize();
+	if(r->polled ? (*(volatile unsigned int *)&r->ring->flags & DMA_RING_NEED_WAKEUP) : force) {
+		ioctl(ctx->fd, DMA_RING_ENTER, 0);
+		__sync_fetch_and_add(&dma_stats.ioctls, 1);
+	}
+}
+
+/**
+ * Hand completions to their waiters, called with the cq_lock held
+ */
+static void
+dma_ring_reap(struct ddekit_dma_ring *r)
+{
+	unsigned int head = r->ring->cq_head;
+	unsigned int tail = *(volatile unsigned int *)&r->ring->cq_tail;
+	struct dma_ring_cqe *cqe;
+	struct dma_ring_wait *w;
+
+	__sync_synchronize();
+	for(; head != tail; head++) {
+		cqe = &r->cq[head & (r->ring->entries - 1)];
+		if(!cqe->tag) {
+			ddekit_printf("%s: unmapping failed (%ld)\n", __func__, cqe->result);
+			continue;
+		}
+		w = (struct dma_ring_wait *)cqe->tag;
+		w->iova = cqe->iova;
+		w->result = cqe->result;
+		__sync_synchronize();
+		w->done = 1;
+	}
+	__sync_synchronize();
+	r->ring->cq_head = head;
+}
+
+static void
+dma_ring_submit(struct ddekit_dma_ctx *ctx, unsigned int opcode, struct dma_op *op,
+                struct dma_ring_wait *w)
+{
+	struct ddekit_dma_ring *r = ctx->ring;
+	struct dma_ring_sqe *sqe;
+	unsigned int tail;
+
+	pthread_mutex_lock(&r->sq_lock);
+	tail = r->ring->sq_tail;
+	while(tail - *(volatile unsigned int *)&r->ring->sq_head >= r->ring->entries) {
+		/* full, make the consumer run and drop finished completions */
+		dma_ring_kick(ctx, 1);
+		if(!pthread_mutex_trylock(&r->cq_lock)) {
+			dma_ring_reap(r);
+			pthread_mutex_unlock(&r->cq_lock);
+		}
+		sched_yield();
+	}
+
+	sqe = &r->sq[tail & (r->ring->entries - 1)];
+	sqe->op = *op;
+	sqe->tag = (unsigned long)w;
+	sqe->opcode = opcode;
+	__sync_synchronize();
+	r->ring->sq_tail = tail + 1;
+	pthread_mutex_unlock(&r->sq_lock);
+}
+
+static void
+dma_ring_complete(struct ddekit_dma_ctx *ctx, struct dma_ring_wait *w)
+{
+	struct ddekit_dma_ring *r = ctx->ring;
+	unsigned long spins = 0;
+
+	while(!w->done) {
+		if(!pthread_mutex_trylock(&r->cq_lock)) {
+			dma_ring_reap(r);
+			pthread_mutex_unlock(&r->cq_lock);
+		}
+		if(!w->done && ++spins % DMA_RING_SPINS == 0) {
+			/* the thread may have gone to sleep meanwhile */
+			dma_ring_kick(ctx, 1);
+			sched_yield();
+		}
+	}
+}
+
+static int
+dma_ring_map(struct ddekit_dma_ctx *ctx, struct dma_op *op)
+{
+	struct dma_ring_wait w = { 0, 0, 0 };
+
+	dma_ring_submit(ctx, DMA_RING_OP_MAP, op, &w);
+	dma_ring_kick(ctx, 1);
+	dma_ring_complete(ctx, &w);
+
+	op->iova = w.iova;
+	return w.result ? -1 : 0;
+}
+
+static int
+dma_ring_unmap(struct ddekit_dma_ctx *ctx, struct dma_op *op)
+{
+	struct dma_ring_wait w = { 0, 0, 0 };
+
+	if(op->direction == DDEKIT_DMA_TODEVICE) {
+		dma_ring_submit(ctx, DMA_RING_OP_UNMAP, op, NULL);
+		dma_ring_kick(ctx, 0);
+		return 0;
+	}
+
+	dma_ring_submit(ctx, DMA_RING_OP_UNMAP, op, &w);
+	dma_ring_kick(ctx, 1);
+	dma_ring_complete(ctx, &w);
+
+	return w.result ? -1 : 0;
+}
+
+/*****************************
+ ** DMA contexts            **
+ *****************************/
+
+/**
+ * Open /dev/uioN-dma for ctx and set up its mode and ring
+ *
+ * \return 0 on success, -1 on error
+ */
+static int
+dma_ctx_init(struct ddekit_dma_ctx *ctx, int uio_id)
 {
 	char buf[128];
-	snprintf(buf, sizeof(buf), "/dev/uio%d-dma", ddekit_pci_bind_irq(0));
 
-	dma_fd = open(buf, O_RDWR);
-	if(dma_fd < 0) {
-		ddekit_printf("%s: Error opening DMA mapping device %s (%d): %s\n", __FUNCTION__, buf, errno, strerror(errno));
+	snprintf(buf, sizeof(buf), "/dev/uio%d-dma", uio_id);
+	ctx->fd = open(buf, O_RDWR);
+	if(ctx->fd < 0) {
+		ddekit_printf("%s: Error opening DMA mapping device %s (%d): %s\n", __func__, buf, errno, strerror(errno));
+		return -1;
 	}
+
+	ctx->uio_id = uio_id;
+	ctx->dma_mask = ~0ULL;
+	ctx->ring = 0;
+	/* a module without DMA_GET_MODE runs the device with bounce buffers */
+	if(ioctl(ctx->fd, DMA_GET_MODE, &ctx->mode))
+		ctx->mode = DMA_MODE_BOUNCE;
+
+	dma_ring_init(ctx);
+	return 0;
+}
+
+/**
+ * Get the DMA context of the device bound to /dev/uio<uio_id>
+ *
+ * Contexts are opened on first use and kept for the lifetime of the
+ * process, the one of the primary device is shared.
+ *
+ * \return context or NULL if the uio_dma device cannot be opened
+ */
+struct ddekit_dma_ctx *
+ddekit_dma_ctx_open(int uio_id)
+{
+	struct ddekit_dma_ctx *ctx, *last = &dma_primary;
+
+	pthread_mutex_lock(&dma_ctx_lock);
+	for(ctx = &dma_primary; ctx; last = ctx, ctx = ctx->next)
+		if(ctx->uio_id == uio_id && ctx->fd >= 0)
+			goto out;
+
+	if(!(ctx = calloc(1, sizeof(*ctx))))
+		goto out;
+	if(dma_ctx_init(ctx, uio_id)) {
+		free(ctx);
+		ctx = 0;
+		goto out;
+	}
+	ctx->primary = 0;
+	ctx->next = 0;
+	__sync_synchronize();
+	last->next = ctx;
+	ddekit_printf("%s: uio%d in %s mode\n", __func__, uio_id,
+	              ctx->mode == DMA_MODE_IOMMU ? "iommu" : "bounce");
+out:
+	pthread_mutex_unlock(&dma_ctx_lock);
+	return ctx;
+}
+
+/**
+ * Get ctx, or the context of the primary device for NULL
+ */
+struct ddekit_dma_ctx *
+ddekit_dma_ctx_get(struct ddekit_dma_ctx *ctx)
+{
+	return dma_ctx(ctx);
+}
+
+/**
+ * Set the highest bus address the device of ctx can reach
+ *
+ * Pre-mapped memory beyond the mask is mapped per buffer instead.
+ */
+void
+ddekit_dma_ctx_set_mask(struct ddekit_dma_ctx *ctx, unsigned long long mask)
+{
+	dma_ctx(ctx)->dma_mask = mask;
 }
 
 void
-ddekit_dma_unmap_single(ddekit_addr_t pa, unsigned int size, ddekit_dma_dir_t direction)
+ddekit_dma_init()
+{
+	pthread_mutex_lock(&dma_ctx_lock);
+	dma_ctx_init(&dma_primary, ddekit_pci_bind_irq(0));
+	pthread_mutex_unlock(&dma_ctx_lock);
+}
+
+/**
+ * Make len bytes at offset of the mapping at handle coherent for the CPU
+ * (DDEKIT_DMA_FROMDEVICE) or for the device (DDEKIT_DMA_TODEVICE)
+ *
+ * Only bounce buffers need copying, the call returns without a system call
+ * for IOMMU mappings and pre-mapped memory.
+ */
+void
+ddekit_dma_sync_single(struct ddekit_dma_ctx *ctx, ddekit_addr_t handle, unsigned long offset,
+                       unsigned int len, ddekit_dma_dir_t direction)
+{
+	int ret;
+	struct dma_op dma;
+
+	ctx = dma_ctx(ctx);
+	__sync_fetch_and_add(&dma_stats.syncs, 1);
+	/* the device accesses IOMMU mappings directly */
+	if(ctx->mode == DMA_MODE_IOMMU || !len || dma_ctx_static_unmap(ctx, handle + offset, len))
+		return;
+
+	dma.iova = handle;
+	dma.va = offset;
+	dma.size = len;
+	dma.direction = direction;
+
+	ret = ioctl(ctx->fd, DMA_SYNC, (unsigned long)&dma);
+	__sync_fetch_and_add(&dma_stats.ioctls, 1);
+	if(ret)
+		ddekit_printf("%s: ioctl returned (%d): %s\n", __func__, errno, strerror(errno));
+}
+
+void
+ddekit_dma_unmap_single(struct ddekit_dma_ctx *ctx, ddekit_addr_t pa, unsigned int size,
+                        ddekit_dma_dir_t direction)
 {
 	int ret;
 	struct dma_op dma;
+	unsigned long long start;
 
+	ctx = dma_ctx(ctx);
 	dma.iova = (unsigned long)pa;
 	dma.size = (unsigned long)size;
 	dma.direction = direction;
 	
-	ret = ioctl(dma_fd, DMA_UNMAP, (unsigned long)&dma);
+	if(dma_ctx_static_unmap(ctx, pa, size)) {
+		ret = 0;
+	} else {
+		start = dma_now_ns();
+		if(ctx->ring) {
+			ret = dma_ring_unmap(ctx, &dma);
+		} else {
+			ret = ioctl(ctx->fd, DMA_UNMAP, (unsigned long)&dma);
+			__sync_fetch_and_add(&dma_stats.ioctls, 1);
+		}
+		dma_hist_add(dma_stats.unmap_hist, start);
+	}
 	if(ret)
 		ddekit_fatal("%s: ioctl returned (%d): %s\n", __FUNCTION__, errno, strerror(errno));
+
+	__sync_fetch_and_sub(&dma_stats.streaming_bytes, size);
+	__sync_fetch_and_sub(&dma_stats.mappings, 1);
+	__sync_fetch_and_add(&dma_stats.unmap_calls, 1);
 }
 
 ddekit_addr_t
-ddekit_dma_map_single(ddekit_addr_t virt, unsigned int size, ddekit_dma_dir_t direction)
+ddekit_dma_map_single(struct ddekit_dma_ctx *ctx, ddekit_addr_t virt, unsigned int size,
+                      ddekit_dma_dir_t direction)
 {
 	int ret;
 	struct dma_op dma;
+	unsigned long long start;
 
+	ctx = dma_ctx(ctx);
 	dma.direction = direction;
 	dma.size = (unsigned long)size;
 	dma.va = (unsigned long)virt;
 	dma.iova = (unsigned long)0;
 
-	ret = ioctl(dma_fd, DMA_MAP, (unsigned long)&dma);
+	if((dma.iova = dma_ctx_static_map(ctx, virt, size))) {
+		ret = 0;
+		__sync_fetch_and_add(&dma_stats.lookups, 1);
+	} else {
+		start = dma_now_ns();
+		if(ctx->ring) {
+			ret = dma_ring_map(ctx, &dma);
+		} else {
+			ret = ioctl(ctx->fd, DMA_MAP, (unsigned long)&dma);
+			__sync_fetch_and_add(&dma_stats.ioctls, 1);
+		}
+		dma_hist_add(dma_stats.map_hist, start);
+	}
 	
 	if(ret)
 		ddekit_fatal("%s: ioctl returned (%d): %s\n", __FUNCTION__, errno, strerror(errno));
@@ -68,6 +593,235 @@ ddekit_dma_map_single(ddekit_addr_t virt, unsigned int size, ddekit_dma_dir_t di
 	if(!dma.iova)
 		ddekit_fatal("%s: mapping failed\n");
 
+	__sync_fetch_and_add(&dma_stats.streaming_bytes, size);
+	__sync_fetch_and_add(&dma_stats.mappings, 1);
+	__sync_fetch_and_add(&dma_stats.map_calls, 1);
+
 	return (ddekit_addr_t)dma.iova;
 }
 
+
+/* cleared if uio_dma lacks the batch ioctls */
+static int dma_batch_supported = 1;
+
+static void
+dma_batch_account(struct dma_op *ops, unsigned int nr, int map)
+{
+	unsigned int i;
+	unsigned long bytes = 0;
+
+	for(i = 0; i < nr; i++)
+		bytes += ops[i].size;
+
+	if(map) {
+		__sync_fetch_and_add(&dma_stats.streaming_bytes, bytes);
+		__sync_fetch_and_add(&dma_stats.mappings, nr);
+		__sync_fetch_and_add(&dma_stats.map_calls, nr);
+	} else {
+		__sync_fetch_and_sub(&dma_stats.streaming_bytes, bytes);
+		__sync_fetch_and_sub(&dma_stats.mappings, nr);
+		__sync_fetch_and_add(&dma_stats.unmap_calls, nr);
+	}
+}
+
+/**
+ * Map nr buffers described by ops, returning their bus addresses in iova
+ *
+ * Buffers in pre-mapped memory are only looked up, the others are mapped
+ * with one system call per run of up to DMA_BATCH_MAX buffers. On failure
+ * no buffer stays mapped.
+ *
+ * \return 0 on success, -1 on error
+ */
+int
+ddekit_dma_map_batch(struct ddekit_dma_ctx *ctx, struct dma_op *ops, unsigned int nr)
+{
+	int ret;
+	unsigned int i, n;
+	struct dma_batch batch;
+	unsigned long long start;
+
+	ctx = dma_ctx(ctx);
+	for(i = 0; i < nr; i += n) {
+		if((ops[i].iova = dma_ctx_static_map(ctx, ops[i].va, ops[i].size))) {
+			__sync_fetch_and_add(&dma_stats.lookups, 1);
+			n = 1;
+			continue;
+		}
+
+		/* run of buffers that uio_dma has to map */
+		for(n = 1; i + n < nr && n < DMA_BATCH_MAX; n++)
+			if(dma_ctx_static_map(ctx, ops[i + n].va, ops[i + n].size))
+				break;
+
+		if(!dma_batch_supported) {
+			dma_batch_account(ops, i, 1);
+			for(n = 0; n < nr - i; n++)
+				ops[i + n].iova = ddekit_dma_map_single(ctx, ops[i + n].va, ops[i + n].size,
+				                                        ops[i + n].direction);
+			return 0;
+		}
+
+		batch.ops = (unsigned long)&ops[i];
+		batch.nr = n;
+		batch.done = 0;
+
+		start = dma_now_ns();
+		ret = ioctl(ctx->fd, DMA_MAP_BATCH, (unsigned long)&batch);
+		__sync_fetch_and_add(&dma_stats.ioctls, 1);
+		dma_hist_add(dma_stats.map_hist, start);
+		if(ret && errno == ENOTTY) {
+			ddekit_printf("%s: uio_dma has no batch ioctls, mapping single buffers\n", __func__);
+			dma_batch_supported = 0;
+			n = 0;
+			continue;
+		}
+		if(ret) {
+			ddekit_printf("%s: ioctl returned (%d): %s\n", __func__, errno, strerror(errno));
+			if(i) {
+				dma_batch_account(ops, i, 1);
+				ddekit_dma_unmap_batch(ctx, ops, i);
+			}
+			return -1;
+		}
+	}
+
+	dma_batch_account(ops, nr, 1);
+
+	return 0;
+}
+
+/**
+ * Unmap nr buffers mapped with ddekit_dma_map_batch()
+ */
+void
+ddekit_dma_unmap_batch(struct ddekit_dma_ctx *ctx, struct dma_op *ops, unsigned int nr)
+{
+	int ret;
+	unsigned int i, n;
+	struct dma_batch batch;
+	unsigned long long start;
+
+	ctx = dma_ctx(ctx);
+	if(!dma_batch_supported || ctx->ring) {
+		for(i = 0; i < nr; i++)
+			ddekit_dma_unmap_single(ctx, ops[i].iova, ops[i].size, ops[i].direction);
+		return;
+	}
+
+	for(i = 0; i < nr; i += n) {
+		if(dma_ctx_static_unmap(ctx, ops[i].iova, ops[i].size)) {
+			n = 1;
+			continue;
+		}
+
+		for(n = 1; i + n < nr && n < DMA_BATCH_MAX; n++)
+			if(dma_ctx_static_unmap(ctx, ops[i + n].iova, ops[i + n].size))
+				break;
+
+		batch.ops = (unsigned long)&ops[i];
+		batch.nr = n;
+		batch.done = 0;
+
+		start = dma_now_ns();
+		ret = ioctl(ctx->fd, DMA_UNMAP_BATCH, (unsigned long)&batch);
+		__sync_fetch_and_add(&dma_stats.ioctls, 1);
+		dma_hist_add(dma_stats.unmap_hist, start);
+		if(ret)
+			ddekit_fatal("%s: ioctl returned (%d): %s\n", __func__, errno, strerror(errno));
+	}
+
+	dma_batch_account(ops, nr, 0);
+}
+
+
+/* coalesced buffers mapped per ddekit_dma_map_batch() of a scatter-gather list */
+#define DMA_SG_CHUNK 64
+
+/*
+ * Describe the run of segments adjacent in memory from sg on by op, for
+ * unmapping their bus addresses must be adjacent too
+ *
+ * \return number of segments in the run
+ */
+static unsigned int
+dma_sg_coalesce(struct ddekit_dma_seg *sg, unsigned int nr, ddekit_dma_dir_t dir,
+                struct dma_op *op, int map)
+{
+	unsigned int n;
+
+	op->va = sg[0].addr;
+	op->iova = map ? 0 : sg[0].dma;
+	op->size = sg[0].size;
+	op->direction = dir;
+
+	for(n = 1; n < nr; n++) {
+		if(sg[n].addr != op->va + op->size)
+			break;
+		if(!map && sg[n].dma != op->iova + op->size)
+			break;
+		op->size += sg[n].size;
+	}
+
+	return n;
+}
+
+/**
+ * Map a scatter-gather list, returning the bus address of each segment in dma
+ *
+ * Segments adjacent in memory are mapped as one buffer, and the buffers of
+ * up to DMA_SG_CHUNK runs are mapped with one ddekit_dma_map_batch(). On
+ * failure no segment stays mapped.
+ *
+ * \return 0 on success, -1 on error
+ */
+int
+ddekit_dma_map_sg(struct ddekit_dma_ctx *ctx, struct ddekit_dma_seg *sg, unsigned int nr,
+                  ddekit_dma_dir_t dir)
+{
+	struct dma_op ops[DMA_SG_CHUNK];
+	unsigned int segs[DMA_SG_CHUNK];
+	unsigned int i = 0, start, j, k, n;
+	unsigned long off;
+
+	while(i < nr) {
+		start = i;
+		for(n = 0; i < nr && n < DMA_SG_CHUNK; n++) {
+			segs[n] = dma_sg_coalesce(&sg[i], nr - i, dir, &ops[n], 1);
+			i += segs[n];
+		}
+
+		if(ddekit_dma_map_batch(ctx, ops, n)) {
+			if(start)
+				ddekit_dma_unmap_sg(ctx, sg, start, dir);
+			return -1;
+		}
+
+		for(j = 0, k = start; j < n; j++) {
+			for(off = 0; segs[j]--; k++) {
+				sg[k].dma = ops[j].iova + off;
+				off += sg[k].size;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Unmap a scatter-gather list mapped with ddekit_dma_map_sg()
+ */
+void
+ddekit_dma_unmap_sg(struct ddekit_dma_ctx *ctx, struct ddekit_dma_seg *sg, unsigned int nr,
+                    ddekit_dma_dir_t dir)
+{
+	struct dma_op ops[DMA_SG_CHUNK];
+	unsigned int i = 0, n;
+
+	while(i < nr) {
+		for(n = 0; i < nr && n < DMA_SG_CHUNK; n++)
+			i += dma_sg_coalesce(&sg[i], nr - i, dir, &ops[n], 0);
+
+		ddekit_dma_unmap_batch(ctx, ops, n);
+	}
+}
@@ -34,9 +34,13 @@ extern void ddekit_init_threads(void);
 extern void ddekit_init_irqs(void);
 extern void ddekit_pgtab_init(void);
 extern void ddekit_pci_init(void);
+extern void ddekit_numa_init(void);
 extern void ddekit_init_timers(void);
 
 extern void ddekit_dma_init(void);
+extern void ddekit_trace_init(void);
+extern void ddekit_prefault_init(void);
+extern void ddekit_prefault_pools(void);
 
 void (*handler)(void*) = (void*)0;
 void *argument = (void *)0;
@@ -58,12 +62,16 @@ void ddekit_register_exit_handler(void (*fun)(void*), void *arg)
 void ddekit_init(void)
 {
 	atexit(ddekit_deinit);
+	ddekit_trace_init();
 	ddekit_pci_init();
+	ddekit_numa_init();
+	ddekit_prefault_init();
+	ddekit_dma_init();
 	ddekit_mem_init();
 	ddekit_pgtab_init();
 	ddekit_init_threads();
-	ddekit_dma_init();
 	ddekit_init_irqs();
 	ddekit_init_timers();
+	ddekit_prefault_pools();
 }
 
@@ -25,6 +25,7 @@
 
 #include <ddekit/compiler.h>
 #include <ddekit/printf.h>
+#include <ddekit/trace.h>
 #include <stdlib.h>
 
 
@@ -41,7 +42,10 @@
  */
 EXTERN_C void * ddekit_simple_malloc(unsigned size)
 {
-	return malloc(size);
+	void *p = malloc(size);
+
+	ddekit_trace_alloc(DDEKIT_TRACE_SIMPLE, 0, size, p);
+	return p;
 }
 
 
@@ -52,6 +56,7 @@ EXTERN_C void * ddekit_simple_malloc(unsigned size)
  */
 EXTERN_C void ddekit_simple_free(void *p)
 {
+	ddekit_trace_free(DDEKIT_TRACE_SIMPLE, 0, 0, p);
 	free(p);
 
 }
@@ -17,6 +17,7 @@
 #include <ddekit/pgtab.h>
 #include <ddekit/dma.h>
 #include <ddekit/pci.h>
+#include <ddekit/trace.h>
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -84,16 +85,79 @@ typedef struct ddekit_slab
 	 */
 	pthread_mutex_t	lock;
 	int            contiguous;
+	/* cache of freed objects, linked through their first word */
+	void          *free_objs;
+	unsigned       nr_free;
+	/* free list capacity beyond SLAB_FREE_MAX, see ddekit_slab_prefault() */
+	unsigned       reserve;
+	/* accounting, see ddekit_slab_get_stats() */
+	unsigned long  active;
+	unsigned long  total;
+	unsigned long  high_water;
+	unsigned long  allocs;
+	unsigned long  frees;
 }ddekit_slab_t;
 
 #define UMEM 0
 
+/* freed objects kept per slab before they are returned to malloc */
+#define SLAB_FREE_MAX 256
+
+/* bytes prefaulted into each new slab, see ddekit_mem_set_prefault() */
+static unsigned long slab_prefault_bytes;
+
+static inline unsigned slab_free_max(ddekit_slab_t *slab)
+{
+	return slab->reserve > SLAB_FREE_MAX ? slab->reserve : SLAB_FREE_MAX;
+}
+
+/*
+ * Account nr allocations (nr_new of them by malloc) or deallocations
+ * (nr < 0, nr_new of them by free), called with slab->lock held
+ */
+static inline void slab_account(ddekit_slab_t *slab, long nr, long nr_new)
+{
+	if (nr > 0) {
+		slab->allocs += nr;
+		slab->active += nr;
+		slab->total  += nr_new;
+		if (slab->active > slab->high_water)
+			slab->high_water = slab->active;
+	} else {
+		slab->frees  -= nr;
+		slab->active += nr;
+		slab->total  -= nr_new;
+	}
+}
+
+
 /**
  * Allocate object in slab
  */
 EXTERN_C void *ddekit_slab_alloc(ddekit_slab_t * slab)
 {
-	return malloc(slab->size);
+	void *obj;
+
+	pthread_mutex_lock(&slab->lock);
+	if ((obj = slab->free_objs)) {
+		slab->free_objs = *(void **)obj;
+		slab->nr_free--;
+		slab_account(slab, 1, 0);
+	}
+	pthread_mutex_unlock(&slab->lock);
+
+	if (!obj) {
+		if (!(obj = malloc(slab->size)))
+			return 0;
+
+		pthread_mutex_lock(&slab->lock);
+		slab_account(slab, 1, 1);
+		pthread_mutex_unlock(&slab->lock);
+	}
+
+	ddekit_trace_alloc(DDEKIT_TRACE_SLAB, slab, slab->size, obj);
+
+	return obj;
 }
 
 
@@ -102,10 +166,101 @@ EXTERN_C void *ddekit_slab_alloc(ddekit_slab_t * slab)
  */
 EXTERN_C void  ddekit_slab_free(ddekit_slab_t * slab, void *objp)
 {
+	ddekit_trace_free(DDEKIT_TRACE_SLAB, slab, slab->size, objp);
+
+	pthread_mutex_lock(&slab->lock);
+	if (slab->nr_free < slab_free_max(slab)) {
+		*(void **)objp = slab->free_objs;
+		slab->free_objs = objp;
+		slab->nr_free++;
+		slab_account(slab, -1, 0);
+		objp = 0;
+	} else
+		slab_account(slab, -1, 1);
+	pthread_mutex_unlock(&slab->lock);
+
 	free(objp);
 }
 
 
+/**
+ * Free nr objects in slab
+ */
+EXTERN_C void ddekit_slab_free_bulk(ddekit_slab_t * slab, unsigned nr, void **objs)
+{
+	unsigned i = 0;
+
+	if (ddekit_trace_enabled) {
+		for (; i < nr; i++)
+			ddekit_trace_free(DDEKIT_TRACE_SLAB, slab, slab->size, objs[i]);
+		i = 0;
+	}
+
+	pthread_mutex_lock(&slab->lock);
+	for (; i < nr && slab->nr_free < slab_free_max(slab); i++) {
+		*(void **)objs[i] = slab->free_objs;
+		slab->free_objs = objs[i];
+		slab->nr_free++;
+	}
+	slab_account(slab, -(long)nr, nr - i);
+	pthread_mutex_unlock(&slab->lock);
+
+	for (; i < nr; i++)
+		free(objs[i]);
+}
+
+
+/**
+ * Fill the free list of slab with nr objects whose pages are touched
+ *
+ * The slab keeps at least nr freed objects cached from now on, so objects
+ * in the prefaulted working set never go back to malloc.
+ *
+ * \return number of objects added
+ */
+EXTERN_C int ddekit_slab_prefault(ddekit_slab_t * slab, unsigned nr)
+{
+	unsigned i;
+	void *obj;
+
+	pthread_mutex_lock(&slab->lock);
+	if (nr > slab->reserve)
+		slab->reserve = nr;
+	pthread_mutex_unlock(&slab->lock);
+
+	for (i = 0; i < nr; i++) {
+		if (!(obj = malloc(slab->size)))
+			break;
+		memset(obj, 0, slab->size);
+
+		pthread_mutex_lock(&slab->lock);
+		*(void **)obj = slab->free_objs;
+		slab->free_objs = obj;
+		slab->nr_free++;
+		slab->total++;
+		pthread_mutex_unlock(&slab->lock);
+	}
+
+	return i;
+}
+
+
+/**
+ * Read accounting information of slab cache
+ */
+EXTERN_C void ddekit_slab_get_stats(ddekit_slab_t * slab, struct ddekit_slab_stats *stats)
+{
+	pthread_mutex_lock(&slab->lock);
+	stats->obj_size   = slab->size;
+	stats->active     = slab->active;
+	stats->total      = slab->total;
+	stats->high_water = slab->high_water;
+	stats->allocs     = slab->allocs;
+	stats->frees      = slab->frees;
+	pthread_mutex_unlock(&slab->lock);
+}
+
+
 /**
  * Store user pointer in slab cache
  */
@@ -133,6 +288,12 @@ EXTERN_C void *ddekit_slab_get_data(ddekit_slab_t * slab)
  */
 EXTERN_C void  ddekit_slab_destroy (ddekit_slab_t * slab)
 {
+	void *obj;
+
+	while ((obj = slab->free_objs)) {
+		slab->free_objs = *(void **)obj;
+		free(obj);
+	}
 	ddekit_simple_free(slab);
 }
 
@@ -151,8 +312,17 @@ EXTERN_C ddekit_slab_t * ddekit_slab_init(unsigned size, int contiguous)
 	/* maybe use ddekit_slab_t instead of *slab? */
 	slab = (ddekit_slab_t *) ddekit_simple_malloc(sizeof(*slab));
 	pthread_mutex_init(&slab->lock, NULL);
-	slab->size = size;
+	/* freed objects store the free list link */
+	slab->size = size < sizeof(void *) ? sizeof(void *) : size;
 	slab->contiguous = contiguous;
+	slab->free_objs = 0;
+	slab->nr_free = 0;
+	slab->reserve = 0;
+	slab->active = slab->total = slab->high_water = 0;
+	slab->allocs = slab->frees = 0;
+
+	if (slab_prefault_bytes)
+		ddekit_slab_prefault(slab, (slab_prefault_bytes + slab->size - 1) / slab->size);
 	
 	return slab;
 }
@@ -162,152 +332,1448 @@ EXTERN_C ddekit_slab_t * ddekit_slab_init(unsigned size, int contiguous)
  ** Large block memory allocator **
  **********************************/
 
+/*
+ * Large blocks are page-aligned anonymous mappings kept in a segregated
+ * cache with one free list per order (block size = LARGE_PAGE_SIZE <<
+ * order). Freed blocks stay mapped for reuse: the most recently freed
+ * LARGE_HOT_BLOCKS per order keep their pages, further blocks are trimmed
+ * with MADV_DONTNEED and parked on a cold list until LARGE_COLD_BLOCKS is
+ * reached. Blocks above LARGE_MAX_ORDER are mapped and unmapped directly.
+ *
+ * The owner of a block is looked up in a hash indexed by its page number,
+ * so blocks carry no header and keep their alignment.
+ *
+ * Setting DDEKIT_LARGE_THP=1 aligns blocks of at least LARGE_THP_SIZE to
+ * that size and marks them MADV_HUGEPAGE.
+ */
+
+#define LARGE_PAGE_SHIFT    12
+#define LARGE_PAGE_SIZE     (1UL << LARGE_PAGE_SHIFT)
+#define LARGE_MAX_ORDER     10          /* 4 MB */
+#define LARGE_HOT_BLOCKS    4
+#define LARGE_COLD_BLOCKS   64
+#define LARGE_HASH_SIZE     1024
+#define LARGE_THP_SIZE      (2UL << 20)
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+struct large_block
+{
+	char               *va;
+	unsigned long       size;   /* mapped size in bytes */
+	int                 order;  /* free list, -1 if not cached */
+	struct large_block *next;   /* hash or free list link */
+};
+
+struct large_order
+{
+	struct large_block *hot;
+	struct large_block *cold;
+	int                 nr_hot;
+	int                 nr_cold;
+	int                 reserve;  /* hot blocks kept beyond LARGE_HOT_BLOCKS */
+};
+
 pthread_mutex_t large_alloc_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+EXTERN_C void ddekit_numa_bind_memory(void *va, unsigned long size);
+
+static struct large_order  large_orders[LARGE_MAX_ORDER + 1];
+static struct large_block *large_hash[LARGE_HASH_SIZE];
+static int                 large_thp = -1;
+static unsigned long       large_in_use;  /* bytes handed out */
+
+static inline unsigned large_hash_idx(const void *va)
+{
+	return ((unsigned long)va >> LARGE_PAGE_SHIFT) % LARGE_HASH_SIZE;
+}
+
+
+static inline int large_order_of(unsigned long size)
+{
+	int order = 0;
+
+	while ((LARGE_PAGE_SIZE << order) < size)
+		order++;
+
+	return order;
+}
+
+
+/**
+ * Map a fresh block, optionally THP-aligned
+ */
+static char *large_map(unsigned long size)
+{
+	char *va, *aligned;
+	unsigned long head;
+
+	if (large_thp < 0) {
+		char *env = getenv("DDEKIT_LARGE_THP");
+		large_thp = env && env[0] == '1';
+	}
+
+	if (!large_thp || size < LARGE_THP_SIZE) {
+		va = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+		                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (va == MAP_FAILED)
+			return 0;
+		ddekit_numa_bind_memory(va, size);
+		return va;
+	}
+
+	/* over-map and cut off the unaligned head and tail */
+	va = (char *) mmap(NULL, size + LARGE_THP_SIZE, PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (va == MAP_FAILED)
+		return 0;
+
+	aligned = (char *)(((unsigned long)va + LARGE_THP_SIZE - 1) & ~(LARGE_THP_SIZE - 1));
+	head = aligned - va;
+	if (head)
+		munmap(va, head);
+	munmap(aligned + size, LARGE_THP_SIZE - head);
+
+	madvise(aligned, size, MADV_HUGEPAGE);
+	ddekit_numa_bind_memory(aligned, size);
+
+	return aligned;
+}
+
+
+/**
+ * Put a released block on its free list, trimming or unmapping surplus
+ *
+ * Called with large_alloc_mtx held.
+ */
+static void large_cache(struct large_block *b)
+{
+	struct large_order *o;
+	struct large_block *victim, **pp;
+
+	if (b->order < 0) {
+		ddekit_pgtab_pagemap_invalidate(b->va, b->size);
+		munmap(b->va, b->size);
+		ddekit_simple_free(b);
+		return;
+	}
+
+	o = &large_orders[b->order];
+	b->next = o->hot;
+	o->hot = b;
+
+	if (++o->nr_hot <= LARGE_HOT_BLOCKS || o->nr_hot <= o->reserve)
+		return;
+
+	/* move the least recently freed hot block to the cold list */
+	for (pp = &o->hot; (*pp)->next; pp = &(*pp)->next) ;
+	victim = *pp;
+	*pp = 0;
+	o->nr_hot--;
+
+	ddekit_pgtab_pagemap_invalidate(victim->va, victim->size);
+	if (o->nr_cold >= LARGE_COLD_BLOCKS) {
+		munmap(victim->va, victim->size);
+		ddekit_simple_free(victim);
+		return;
+	}
+
+	madvise(victim->va, victim->size, MADV_DONTNEED);
+	victim->next = o->cold;
+	o->cold = victim;
+	o->nr_cold++;
+}
+
+
+static int contig_free(void *objp);
+
 /**
  * Free large block of memory
  *
+ * Also releases blocks from ddekit_contig_malloc().
  * This is no useful for allocation < page size.
  */
 EXTERN_C void ddekit_large_free(void *objp)
 {
-	free(objp);
+	struct large_block *b, **pp;
+
+	if (!objp)
+		return;
+
+	pthread_mutex_lock(&large_alloc_mtx);
+	for (pp = &large_hash[large_hash_idx(objp)]; (b = *pp); pp = &b->next) {
+		if (b->va == objp) {
+			*pp = b->next;
+			large_in_use -= b->size;
+			large_cache(b);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&large_alloc_mtx);
+
+	if (b) {
+		ddekit_trace_free(DDEKIT_TRACE_LARGE, 0, 0, objp);
+		return;
+	}
+
+	if (contig_free(objp))
+		ddekit_printf("%s: %p is not a large block\n", __func__, objp);
+	else
+		ddekit_trace_free(DDEKIT_TRACE_CONTIG, 0, 0, objp);
 }
 
 
 /**
  * Allocate large block of memory
- * DMA
+ *
+ * The block is page-aligned.
  * This is not useful for allocation < page size.
  */
 EXTERN_C void *ddekit_large_malloc(int size)
 {
-	return malloc(size);
-}
+	struct large_block *b = 0;
+	struct large_order *o;
+	unsigned long bytes;
+	int order;
+	unsigned idx;
 
-//TODO remove define and determine operationg mode at runtime
-//#define IOMMU
+	if (size <= 0)
+		return 0;
 
-static int fd = 0;
+	order = large_order_of(size);
+	bytes = LARGE_PAGE_SIZE << order;
+	if (order > LARGE_MAX_ORDER) {
+		bytes = (size + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+		order = -1;
+	}
 
-EXTERN_C void *ddekit_dma_alloc_coherent(int size, ddekit_addr_t *dma_addr)
-{
-	int ret;
-	void *ptr = NULL;
-	struct dma_op dma_req;
+	pthread_mutex_lock(&large_alloc_mtx);
+	if (order >= 0) {
+		o = &large_orders[order];
+		if ((b = o->hot)) {
+			o->hot = b->next;
+			o->nr_hot--;
+		} else if ((b = o->cold)) {
+			o->cold = b->next;
+			o->nr_cold--;
+		}
+	}
+	pthread_mutex_unlock(&large_alloc_mtx);
 
-#ifdef IOMMU
-	//ptr = malloc(size);
-	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	if(MAP_FAILED == ptr)
-		ddekit_panic("%s: mmap() failed (%d) %s\n", __func__, errno, strerror(errno));
+	if (!b) {
+		if (!(b = (struct large_block *) ddekit_simple_malloc(sizeof(*b))))
+			return 0;
+		if (!(b->va = large_map(bytes))) {
+			ddekit_printf("%s: mmap() of %lu bytes failed (%d) %s\n",
+			              __func__, bytes, errno, strerror(errno));
+			ddekit_simple_free(b);
+			return 0;
+		}
+		b->size = bytes;
+		b->order = order;
+	}
 
-	dma_req.size = size;
-	dma_req.va = (unsigned long)ptr;
-	dma_req.iova = 0;
+	idx = large_hash_idx(b->va);
+	pthread_mutex_lock(&large_alloc_mtx);
+	b->next = large_hash[idx];
+	large_hash[idx] = b;
+	large_in_use += b->size;
+	pthread_mutex_unlock(&large_alloc_mtx);
 
-	ddekit_printf("%s: translating %d allocated bytes from %p\n", __func__, size, ptr);
-	
-	ret = ioctl(fd, DMA_MAP, &dma_req);
-	if(ret < 0)
-		ddekit_panic("%s: error reading (%d) %s\n", __func__, errno, strerror(errno));
-	
-	if(!dma_req.iova)
-		ddekit_panic("%s: error mapping %p (%d)\n", __func__, ptr, size);
+	ddekit_trace_alloc(DDEKIT_TRACE_LARGE, 0, size, b->va);
 
-	if(dma_req.iova != dma_req.va)
-		ddekit_info("%s: error mapping %p from 0x%lx to 0x%lx (%d)\n", __func__, ptr, dma_req.va, dma_req.iova, dma_req.size);
+	return b->va;
+}
 
-#else
-	
-	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if(ptr == MAP_FAILED)
-		ddekit_panic("%s: mmap() failed (%d) %s\n", __func__, errno, strerror(errno));
+/**
+ * Map nr blocks of at least size bytes, touch them and keep them hot
+ *
+ * \return number of blocks added
+ */
+EXTERN_C int ddekit_large_prefault(unsigned long size, int nr)
+{
+	struct large_block *b;
+	struct large_order *o;
+	int order, i;
 
-	ddekit_printf("%s: translating %d allocated bytes from %p\n", __func__, size, ptr);
-	dma_req.size = size;
-	dma_req.va = (unsigned long)ptr;
-	dma_req.iova= 0;
+	order = large_order_of(size);
+	if (order > LARGE_MAX_ORDER)
+		return 0;
+	o = &large_orders[order];
 
-	ret = ioctl(fd, DMA_TRANSLATE, &dma_req);
-	if(ret < 0)
-		ddekit_panic("%s: error reading (%d) %s\n", __func__, errno, strerror(errno));
-#endif
-	*dma_addr = dma_req.iova;
+	pthread_mutex_lock(&large_alloc_mtx);
+	o->reserve += nr;
+	pthread_mutex_unlock(&large_alloc_mtx);
 
-	if(!ptr)
-		ddekit_panic("%d: %s\n", errno, strerror(errno));
+	for (i = 0; i < nr; i++) {
+		if (!(b = (struct large_block *) ddekit_simple_malloc(sizeof(*b))))
+			break;
+		b->size = LARGE_PAGE_SIZE << order;
+		b->order = order;
+		if (!(b->va = large_map(b->size))) {
+			ddekit_simple_free(b);
+			break;
+		}
+		memset(b->va, 0, b->size);
 
-	return ptr;
+		pthread_mutex_lock(&large_alloc_mtx);
+		b->next = o->hot;
+		o->hot = b;
+		o->nr_hot++;
+		pthread_mutex_unlock(&large_alloc_mtx);
+	}
+
+	return i;
 }
 
-EXTERN_C void ddekit_dma_free_coherent(void *objp, int size, ddekit_addr_t dma)
+/* fd, mode and DMA mask of the device memory is pre-mapped for */
+static inline struct ddekit_dma_ctx *dma_primary(void)
 {
-#ifdef IOMMU
-	int ret;
-	struct dma_op dma_req;
+	return ddekit_dma_ctx_get(NULL);
+}
 
-	dma_req.size = size;
-	dma_req.iova = (unsigned long)dma;
+/*
+ * Look up the bus address of a buffer mapped from /dev/uioN-dma without
+ * IOMMU. The bus address is the physical address, which the pgtab pagemap
+ * backend provides without a round trip to the module. It fails with
+ * ERANGE if the buffer lies above high, the DMA mask of the device.
+ */
+static int dma_translate_bounce(int dev_fd, struct dma_op *dma_req, ddekit_addr_t high)
+{
+	ddekit_addr_t pa;
 
-	ddekit_printf("%s: unmapping %d allocated bytes from %p\n", __func__, size, objp);
-	
-	ret = ioctl(fd, DMA_UNMAP, &dma_req);
-	if(ret < 0)
-		ddekit_panic("%s: error reading (%d) %s\n", __func__, errno, strerror(errno));
-	
-//	free(objp);
-	munmap(objp, size);
-#else
-	int ret;
-	struct dma_op dma_req;
-	
-	if(size < 0) {
-		ddekit_printf("%s: error freeing %p\n", __func__, objp);
-		return;
+	if (!ddekit_pgtab_pagemap_translate((void *)dma_req->va, dma_req->size, &pa))
+		dma_req->iova = pa;
+	else if (ioctl(dev_fd, DMA_TRANSLATE, dma_req) < 0)
+		return -1;
+
+	if (dma_req->iova + dma_req->size - 1 > high) {
+		errno = ERANGE;
+		return -1;
 	}
-		
-	dma_req.size = size;
-	dma_req.va = (unsigned long int)objp;
-	dma_req.iova = dma;
+	return 0;
+}
 
-	ret = munmap(objp, size);
-	
-	if(ret) 
-		ddekit_printf("%s: error unmapping %p (%d): %s\n", __func__, objp, errno, strerror(errno));
 
-	ret = ioctl(fd, DMA_FREE, &dma_req);	
-	if(ret != 0)
-		ddekit_printf("%s: ret: %d (%d) %s\n", __func__, ret, errno, strerror(errno));
+/*******************************
+ ** DMA-coherent memory arena **
+ *******************************/
+
+/*
+ * Coherent memory is served from huge pages that are pinned and made
+ * DMA-able once at startup (DMA_REGISTER). Each huge page forms one
+ * chunk, which is physically contiguous and therefore has a single bus
+ * address. Chunks are sub-allocated in DMA_ARENA_GRAIN units using a
+ * bitmap, so allocating and freeing coherent memory needs no system call.
+ * Allocations that do not fit into the arena fall back to mapping
+ * /dev/uioN-dma per allocation. Without huge pages, the arena consists of
+ * ordinary pages mapped into the IOMMU domain once (DMA_IOMMU_MAP).
+ *
+ * The arena is configured by environment variables:
+ *   DDEKIT_DMA_ARENA      arena size in MB, 0 disables the arena
+ *   DDEKIT_DMA_HUGEPAGE   huge page size, "2M" (default) or "1G"
+ */
+
+#define DMA_ARENA_SIZE      (16UL << 20) /* 16 MB */
+#define DMA_ARENA_GRAIN     4096UL
+#define DMA_ARENA_SHIFT_2M  21
+#define DMA_ARENA_SHIFT_1G  30
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
 #endif
+
+#define BITS_PER_WORD       (8 * sizeof(unsigned long))
+
+struct dma_chunk
+{
+	char             *va;       /* virtual start address */
+	ddekit_addr_t     bus;      /* bus address of va */
+	unsigned long     size;     /* in bytes */
+	unsigned long     nr_grains;
+	unsigned long     nr_free;  /* free grains */
+	unsigned long     hint;     /* next-fit search start */
+	unsigned long    *bitmap;   /* one bit per used grain */
+	unsigned long    *heads;    /* one bit per first grain of an allocation */
+	struct dma_chunk *next;
+};
+
+struct dma_arena
+{
+	pthread_mutex_t   lock;
+	struct dma_chunk *chunks;
+};
+
+static struct dma_arena coherent_arena = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static inline int grain_test(unsigned long *map, unsigned long i)
+{
+	return (map[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 1;
+}
+
+
+static void grains_set(struct dma_chunk *c, unsigned long first, unsigned long n, int used)
+{
+	unsigned long i;
+
+	for (i = first; i < first + n; i++) {
+		if (used)
+			c->bitmap[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+		else
+			c->bitmap[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+	}
 }
 
+
 /**
- * Allocate large block of memory (special interface)
+ * Find and reserve a run of free grains in a chunk
  *
- * This is no useful for allocation < page size.
+ * The run's bus address respects the given alignment (a power of two),
+ * lies within [low, high] and does not cross a multiple of boundary (a
+ * power of two, 0 for none).
  *
- * FIXME implementation missing...
+ * \return offset of the run in the chunk or -1
  */
-EXTERN_C void *ddekit_contig_malloc(unsigned long size __attribute__((unused)),
-                           unsigned long low __attribute__((unused)),
-                           unsigned long high __attribute__((unused)),
-                           unsigned long alignment __attribute__((unused)),
-                           unsigned long boundary __attribute__((unused)))
+static long dma_chunk_alloc(struct dma_chunk *c, unsigned long size,
+                            unsigned long align, ddekit_addr_t low,
+                            ddekit_addr_t high, unsigned long boundary)
 {
-	ddekit_debug("%s: not implemented\n", __func__);
-	return 0;
+	unsigned long n = (size + DMA_ARENA_GRAIN - 1) / DMA_ARENA_GRAIN;
+	unsigned long step, start, i, tries;
+
+	if (n > c->nr_free)
+		return -1;
+	if (align < DMA_ARENA_GRAIN)
+		align = DMA_ARENA_GRAIN;
+	step = align / DMA_ARENA_GRAIN;
+
+	/* two passes: from the hint to the end, then from the beginning */
+	for (tries = 0; tries < 2; tries++) {
+		start = tries ? 0 : c->hint;
+		/* first grain with an aligned bus address */
+		start += ((align - ((c->bus + start * DMA_ARENA_GRAIN) & (align - 1))) & (align - 1)) / DMA_ARENA_GRAIN;
+
+		for (; start + n <= c->nr_grains; start += step) {
+			ddekit_addr_t first = c->bus + start * DMA_ARENA_GRAIN;
+			ddekit_addr_t last  = first + size - 1;
+
+			if (first < low)
+				continue;
+			if (last > high)
+				break;
+			if (boundary && ((first ^ last) & ~(boundary - 1)))
+				continue;
+
+			for (i = 0; i < n && !grain_test(c->bitmap, start + i); i++) ;
+			if (i < n) {
+				/* skip the used grain, keeping the alignment */
+				start += (i / step) * step;
+				continue;
+			}
+
+			grains_set(c, start, n, 1);
+			c->heads[start / BITS_PER_WORD] |= 1UL << (start % BITS_PER_WORD);
+			c->nr_free -= n;
+			c->hint = start + n < c->nr_grains ? start + n : 0;
+			return start * DMA_ARENA_GRAIN;
+		}
+	}
+
+	return -1;
 }
 
-EXTERN_C int ddekit_pci_bind_irq(int);
 
-EXTERN_C void ddekit_mem_init()
+/**
+ * Release the allocation starting at offset
+ *
+ * The allocation extends up to the next allocation head or free grain.
+ */
+static void dma_chunk_free(struct dma_chunk *c, unsigned long offset)
 {
-	char buf[128];
-	ddekit_printf("dma-iommu memory init\n");
-	snprintf(buf, sizeof(buf), "/dev/uio%d-dma", ddekit_pci_bind_irq(0));
-	fd = open(buf, O_RDWR);
-	if(fd < 0) {
-		ddekit_panic("%s: error (%d) %s (%s)\n", __func__, errno, strerror(errno), buf);	
+	unsigned long first = offset / DMA_ARENA_GRAIN;
+	unsigned long n = 1;
+
+	if (!grain_test(c->heads, first)) {
+		ddekit_printf("%s: %p is not an allocation\n", __func__, c->va + offset);
+		return;
 	}
+
+	while (first + n < c->nr_grains && grain_test(c->bitmap, first + n)
+	       && !grain_test(c->heads, first + n))
+		n++;
+
+	c->heads[first / BITS_PER_WORD] &= ~(1UL << (first % BITS_PER_WORD));
+	grains_set(c, first, n, 0);
+	c->nr_free += n;
+}
+
+
+static struct dma_chunk *dma_chunk_create(void *va, ddekit_addr_t bus, unsigned long size)
+{
+	struct dma_chunk *c;
+	unsigned long words;
+
+	c = (struct dma_chunk *) ddekit_simple_malloc(sizeof(*c));
+	if (!c)
+		return 0;
+
+	c->va        = (char *)va;
+	c->bus       = bus;
+	c->size      = size;
+	c->nr_grains = size / DMA_ARENA_GRAIN;
+	c->nr_free   = c->nr_grains;
+	c->hint      = 0;
+
+	words = (c->nr_grains + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	c->bitmap = (unsigned long *) ddekit_simple_malloc(2 * words * sizeof(unsigned long));
+	if (!c->bitmap) {
+		ddekit_simple_free(c);
+		return 0;
+	}
+	memset(c->bitmap, 0, 2 * words * sizeof(unsigned long));
+	c->heads = c->bitmap + words;
+
+	return c;
+}
+
+
+/**
+ * Allocate from the first chunk of an arena that satisfies the constraints
+ *
+ * \return virtual address or 0
+ */
+static void *dma_arena_alloc(struct dma_arena *arena, unsigned long size,
+                             unsigned long align, ddekit_addr_t low,
+                             ddekit_addr_t high, unsigned long boundary,
+                             ddekit_addr_t *dma_addr)
+{
+	struct dma_chunk *c;
+	long offset = -1;
+
+	pthread_mutex_lock(&arena->lock);
+	for (c = arena->chunks; c; c = c->next) {
+		if ((offset = dma_chunk_alloc(c, size, align, low, high, boundary)) >= 0)
+			break;
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	if (!c)
+		return 0;
+
+	*dma_addr = c->bus + offset;
+	return c->va + offset;
+}
+
+
+/**
+ * Return memory to the arena it was allocated from
+ *
+ * \return 0 on success, -1 if the memory does not belong to the arena
+ */
+static int dma_arena_free(struct dma_arena *arena, void *ptr)
+{
+	struct dma_chunk *c;
+	int ret = -1;
+
+	pthread_mutex_lock(&arena->lock);
+	for (c = arena->chunks; c; c = c->next) {
+		if ((char *)ptr >= c->va && (char *)ptr < c->va + c->size) {
+			dma_chunk_free(c, (char *)ptr - c->va);
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	return ret;
+}
+
+
+/**
+ * Sum up used and total bytes of an arena
+ */
+static void dma_arena_usage(struct dma_arena *arena, unsigned long *used, unsigned long *total)
+{
+	struct dma_chunk *c;
+
+	*used = *total = 0;
+	pthread_mutex_lock(&arena->lock);
+	for (c = arena->chunks; c; c = c->next) {
+		*used  += (c->nr_grains - c->nr_free) * DMA_ARENA_GRAIN;
+		*total += c->size;
+	}
+	pthread_mutex_unlock(&arena->lock);
+}
+
+
+static void dma_arena_add(struct dma_arena *arena, struct dma_chunk *c)
+{
+	pthread_mutex_lock(&arena->lock);
+	c->next = arena->chunks;
+	arena->chunks = c;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+
+/* huge page size for the coherent arena and the streaming page pool */
+static unsigned long dma_hugepage_shift(void)
+{
+	char *env = getenv("DDEKIT_DMA_HUGEPAGE");
+
+	if (env && (env[0] == '1') && (env[1] == 'G'))
+		return DMA_ARENA_SHIFT_1G;
+	return DMA_ARENA_SHIFT_2M;
+}
+
+
+/**
+ * Map ordinary pages into the IOMMU domain as one region
+ *
+ * This is the fallback without huge pages. The region is mapped at
+ * iova == va like streaming mappings, so the two never overlap, and handed
+ * to add in pieces of up to hpage bytes. Bounce buffer mode has no IOMMU
+ * domain to map into.
+ */
+static char *dma_iommu_region_register(unsigned long *size, unsigned long hpage,
+                                       int (*add)(char *va, ddekit_addr_t bus, unsigned long size),
+                                       const char *what)
+{
+	unsigned long off, len;
+	char *va;
+	struct dma_op dma_req;
+
+	if (dma_primary()->mode != DMA_MODE_IOMMU) {
+		*size = 0;
+		return 0;
+	}
+
+	va = (char *) mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (va == MAP_FAILED) {
+		*size = 0;
+		return 0;
+	}
+	ddekit_numa_bind_memory(va, *size);
+
+	dma_req.va = (unsigned long)va;
+	dma_req.size = *size;
+	dma_req.iova = 0;
+	dma_req.direction = DDEKIT_DMA_BIDIRECTIONAL;
+
+	if (ioctl(dma_primary()->fd, DMA_IOMMU_MAP, &dma_req) < 0) {
+		ddekit_info("%s: mapping %s failed (%d) %s\n", __func__, what, errno, strerror(errno));
+		munmap(va, *size);
+		*size = 0;
+		return 0;
+	}
+	for (off = 0; off < *size; off += len) {
+		len = *size - off < hpage ? *size - off : hpage;
+		if (add(va + off, dma_req.iova + off, len) < 0)
+			break;
+	}
+
+	/* the region stays mapped as a whole, unused parts included */
+	ddekit_dma_add_static(dma_req.va, *size, dma_req.iova);
+	*size = off;
+
+	ddekit_info("%s: %lu KB in %s at iova 0x%lx\n", __func__, off >> 10, what, dma_req.iova);
+
+	return off ? va : 0;
+}
+
+
+/**
+ * Reserve huge pages and register each of them with uio_dma
+ *
+ * \param size  bytes to reserve, rounded up to huge pages, or to base
+ *              pages for the fallback without huge pages
+ * \param add   called for each registered huge page, returns -1 to stop
+ * \param what  name for messages
+ *
+ * \return start of the reservation or 0, *size returns the registered bytes
+ */
+static char *dma_hugepages_register(unsigned long *size,
+                                    int (*add)(char *va, ddekit_addr_t bus, unsigned long size),
+                                    const char *what)
+{
+	unsigned long shift = dma_hugepage_shift();
+	unsigned long hpage = 1UL << shift;
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long want = *size;
+	unsigned long off;
+	char *va;
+	struct dma_op dma_req;
+
+	*size = (want + hpage - 1) & ~(hpage - 1);
+	if (!*size)
+		return 0;
+
+	va = (char *) mmap(NULL, *size, PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT),
+	                   -1, 0);
+	if (va == MAP_FAILED) {
+		ddekit_info("%s: no huge pages for %s (%d) %s, falling back\n",
+		            __func__, what, errno, strerror(errno));
+		/* ordinary pages are pinned and mapped as requested, not per huge page */
+		*size = (want + page - 1) & ~(page - 1);
+		return dma_iommu_region_register(size, hpage, add, what);
+	}
+
+	/* pages are faulted in on the device's node when DMA_REGISTER pins them */
+	ddekit_numa_bind_memory(va, *size);
+
+	for (off = 0; off < *size; off += hpage) {
+		dma_req.va = (unsigned long)(va + off);
+		dma_req.size = hpage;
+		dma_req.iova = 0;
+
+		if (ioctl(dma_primary()->fd, DMA_REGISTER, &dma_req) < 0) {
+			ddekit_info("%s: registering huge page %p failed (%d) %s\n",
+			            __func__, va + off, errno, strerror(errno));
+			break;
+		}
+
+		if (add(va + off, dma_req.iova, hpage) < 0) {
+			ioctl(dma_primary()->fd, DMA_UNREGISTER, &dma_req);
+			break;
+		}
+
+		/* buffers in the huge page are mapped by lookup from now on */
+		ddekit_dma_add_static(dma_req.va, hpage, dma_req.iova);
+	}
+
+	if (off < *size)
+		munmap(va + off, *size - off);
+	*size = off;
+
+	ddekit_info("%s: %lu huge pages of %lu KB in %s\n", __func__, off >> shift, hpage >> 10, what);
+
+	return off ? va : 0;
+}
+
+
+static int dma_arena_add_hugepage(char *va, ddekit_addr_t bus, unsigned long size)
+{
+	struct dma_chunk *c;
+
+	if (!(c = dma_chunk_create(va, bus, size)))
+		return -1;
+	dma_arena_add(&coherent_arena, c);
+
+	return 0;
+}
+
+
+static void dma_arena_init(void)
+{
+	unsigned long size = DMA_ARENA_SIZE;
+	char *env;
+
+	if ((env = getenv("DDEKIT_DMA_ARENA")))
+		size = strtoul(env, NULL, 0) << 20;
+
+	dma_hugepages_register(&size, dma_arena_add_hugepage, "coherent arena");
+}
+
+
+/*
+ * Coherent memory outside the arena: with IOMMU anonymous memory is mapped
+ * at iova == va, with bounce buffers uio_dma provides it through mmap().
+ * dev_fd is the uio_dma device of the DMA context.
+ */
+static void *dma_alloc_coherent_iommu(int dev_fd, int size, ddekit_addr_t *dma_addr)
+{
+	int ret;
+	void *ptr = NULL;
+	struct dma_op dma_req;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(MAP_FAILED == ptr)
+		ddekit_panic("%s: mmap() failed (%d) %s\n", __func__, errno, strerror(errno));
+
+	dma_req.size = size;
+	dma_req.va = (unsigned long)ptr;
+	dma_req.iova = 0;
+	dma_req.direction = DDEKIT_DMA_BIDIRECTIONAL;
+
+	ddekit_printf("%s: translating %d allocated bytes from %p\n", __func__, size, ptr);
+	
+	ret = ioctl(dev_fd, DMA_MAP, &dma_req);
+	if(ret < 0)
+		ddekit_panic("%s: error reading (%d) %s\n", __func__, errno, strerror(errno));
+	
+	if(!dma_req.iova)
+		ddekit_panic("%s: error mapping %p (%d)\n", __func__, ptr, size);
+
+	if(dma_req.iova != dma_req.va)
+		ddekit_info("%s: error mapping %p from 0x%lx to 0x%lx (%d)\n", __func__, ptr, dma_req.va, dma_req.iova, dma_req.size);
+
+	*dma_addr = dma_req.iova;
+
+	return ptr;
+}
+
+static void *dma_alloc_coherent_bounce(int dev_fd, int size, ddekit_addr_t high,
+                                       ddekit_addr_t *dma_addr)
+{
+	int ret;
+	void *ptr = NULL;
+	struct dma_op dma_req;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, 0);
+	if(ptr == MAP_FAILED)
+		ddekit_panic("%s: mmap() failed (%d) %s\n", __func__, errno, strerror(errno));
+
+	ddekit_printf("%s: translating %d allocated bytes from %p\n", __func__, size, ptr);
+	dma_req.size = size;
+	dma_req.va = (unsigned long)ptr;
+	dma_req.iova= 0;
+
+	ret = dma_translate_bounce(dev_fd, &dma_req, high);
+	if(ret < 0) {
+		ddekit_printf("%s: no bus address of %p below 0x%lx (%d) %s\n", __func__,
+		              ptr, high, errno, strerror(errno));
+		ddekit_pgtab_pagemap_invalidate(ptr, size);
+		munmap(ptr, size);
+		ioctl(dev_fd, DMA_FREE, &dma_req);
+		return 0;
+	}
+
+	*dma_addr = dma_req.iova;
+
+	return ptr;
+}
+
+static void dma_free_coherent_iommu(int dev_fd, void *objp, int size, ddekit_addr_t dma)
+{
+	int ret;
+	struct dma_op dma_req;
+
+	if (size > 0)
+		ddekit_pgtab_pagemap_invalidate(objp, size);
+
+	dma_req.size = size;
+	dma_req.iova = (unsigned long)dma;
+
+	ddekit_printf("%s: unmapping %d allocated bytes from %p\n", __func__, size, objp);
+	
+	ret = ioctl(dev_fd, DMA_UNMAP, &dma_req);
+	if(ret < 0)
+		ddekit_panic("%s: error reading (%d) %s\n", __func__, errno, strerror(errno));
+	
+	munmap(objp, size);
+}
+
+static void dma_free_coherent_bounce(int dev_fd, void *objp, int size, ddekit_addr_t dma)
+{
+	int ret;
+	struct dma_op dma_req;
+	
+	if(size < 0) {
+		ddekit_printf("%s: error freeing %p\n", __func__, objp);
+		return;
+	}
+
+	ddekit_pgtab_pagemap_invalidate(objp, size);
+		
+	dma_req.size = size;
+	dma_req.va = (unsigned long int)objp;
+	dma_req.iova = dma;
+
+	ret = munmap(objp, size);
+	
+	if(ret) 
+		ddekit_printf("%s: error unmapping %p (%d): %s\n", __func__, objp, errno, strerror(errno));
+
+	ret = ioctl(dev_fd, DMA_FREE, &dma_req);	
+	if(ret != 0)
+		ddekit_printf("%s: ret: %d (%d) %s\n", __func__, ret, errno, strerror(errno));
+}
+
+
+static void *contig_map_iommu(unsigned long size, ddekit_addr_t high, ddekit_addr_t *bus);
+static void contig_unmap_iommu(void *va, unsigned long size, ddekit_addr_t bus);
+static void *contig_map_bounce(unsigned long size, ddekit_addr_t high, ddekit_addr_t *bus);
+static void contig_unmap_bounce(void *va, unsigned long size, ddekit_addr_t bus);
+
+/* contiguous pool chunks of the DMA mode */
+static void *(*contig_map)(unsigned long size, ddekit_addr_t high, ddekit_addr_t *bus) = contig_map_bounce;
+static void (*contig_unmap)(void *va, unsigned long size, ddekit_addr_t bus) = contig_unmap_bounce;
+
+/**
+ * Select the strategies for the DMA mode of the primary device
+ */
+static void dma_mode_init(void)
+{
+	if (dma_primary()->mode == DMA_MODE_IOMMU) {
+		contig_map = contig_map_iommu;
+		contig_unmap = contig_unmap_iommu;
+	} else {
+		contig_map = contig_map_bounce;
+		contig_unmap = contig_unmap_bounce;
+	}
+}
+
+
+/* bytes of coherent memory mapped per allocation, outside the arena */
+static unsigned long coherent_mapped_bytes;
+
+/*
+ * The arena is mapped for the primary device, other devices get coherent
+ * memory mapped per allocation through their own uio_dma device.
+ */
+EXTERN_C void *ddekit_dma_alloc_coherent(struct ddekit_dma_ctx *ctx, int size, ddekit_addr_t *dma_addr)
+{
+	void *ptr = 0;
+	unsigned long high = ~0UL;
+
+	ctx = ddekit_dma_ctx_get(ctx);
+	if (ctx->dma_mask < high)
+		high = ctx->dma_mask;
+
+	if (size > 0 && ctx->primary &&
+	    (ptr = dma_arena_alloc(&coherent_arena, size, DMA_ARENA_GRAIN,
+	                           0, high, 0, dma_addr))) {
+		memset(ptr, 0, size);
+	} else {
+		if (ctx->mode == DMA_MODE_IOMMU)
+			ptr = dma_alloc_coherent_iommu(ctx->fd, size, dma_addr);
+		else
+			ptr = dma_alloc_coherent_bounce(ctx->fd, size, high, dma_addr);
+		if (ptr)
+			__sync_fetch_and_add(&coherent_mapped_bytes, size);
+	}
+
+	ddekit_trace_alloc(DDEKIT_TRACE_COHERENT, 0, size, ptr);
+
+	return ptr;
+}
+
+
+EXTERN_C void ddekit_dma_free_coherent(struct ddekit_dma_ctx *ctx, void *objp, int size, ddekit_addr_t dma)
+{
+	ddekit_trace_free(DDEKIT_TRACE_COHERENT, 0, size, objp);
+
+	if (size > 0 && !dma_arena_free(&coherent_arena, objp))
+		return;
+
+	ctx = ddekit_dma_ctx_get(ctx);
+	if (ctx->mode == DMA_MODE_IOMMU)
+		dma_free_coherent_iommu(ctx->fd, objp, size, dma);
+	else
+		dma_free_coherent_bounce(ctx->fd, objp, size, dma);
+	__sync_fetch_and_sub(&coherent_mapped_bytes, size);
+}
+
+/******************************
+ ** Streaming DMA page pool  **
+ ******************************/
+
+/*
+ * Pages for streaming DMA buffers (e.g., network packets) that are mapped
+ * once at startup like the coherent arena. The pool is a stack of free
+ * pages and the bus address of each huge page, so allocation and free are
+ * O(1), and ddekit_dma_map_single() on a pool page is a lookup without
+ * system call, pinning or IOTLB flush. When the pool is empty callers fall
+ * back to ordinary memory.
+ *
+ *   DDEKIT_DMA_POOL      pool size in MB, 0 disables the pool
+ */
+
+#define DMA_POOL_SIZE       (8UL << 20) /* 8 MB */
+#define DMA_POOL_PAGE       4096UL
+
+static struct
+{
+	pthread_mutex_t  lock;
+	void           **free;      /* stack of free pages */
+	unsigned long    nr_free;
+	unsigned long    nr_pages;
+	char            *start;     /* [start, end) holds all pool pages */
+	char            *end;
+	unsigned long    shift;     /* huge page shift */
+	ddekit_addr_t   *bus;       /* bus address per huge page */
+} dma_pool = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0, 0 };
+
+
+static inline ddekit_addr_t dma_pool_bus(void *page)
+{
+	unsigned long off = (char *)page - dma_pool.start;
+
+	return dma_pool.bus[off >> dma_pool.shift] + (off & ((1UL << dma_pool.shift) - 1));
+}
+
+
+static int dma_pool_add_hugepage(char *va, ddekit_addr_t bus, unsigned long size)
+{
+	unsigned long off;
+
+	if (!dma_pool.start)
+		dma_pool.start = va;
+
+	pthread_mutex_lock(&dma_pool.lock);
+	dma_pool.bus[(va - dma_pool.start) >> dma_pool.shift] = bus;
+	for (off = 0; off < size; off += DMA_POOL_PAGE)
+		dma_pool.free[dma_pool.nr_free++] = va + off;
+	dma_pool.nr_pages = dma_pool.nr_free;
+	pthread_mutex_unlock(&dma_pool.lock);
+
+	return 0;
+}
+
+
+static void dma_pool_init(void)
+{
+	unsigned long size = DMA_POOL_SIZE;
+	unsigned long hpage, max;
+	char *env;
+
+	if ((env = getenv("DDEKIT_DMA_POOL")))
+		size = strtoul(env, NULL, 0) << 20;
+
+	dma_pool.shift = dma_hugepage_shift();
+	hpage = 1UL << dma_pool.shift;
+	/* the fallback without huge pages registers less than this */
+	max = (size + hpage - 1) & ~(hpage - 1);
+	if (!max)
+		return;
+
+	dma_pool.free = (void **) ddekit_simple_malloc(max / DMA_POOL_PAGE * sizeof(void *));
+	dma_pool.bus  = (ddekit_addr_t *) ddekit_simple_malloc(max / hpage * sizeof(ddekit_addr_t));
+	if (!dma_pool.free || !dma_pool.bus)
+		return;
+
+	if (dma_hugepages_register(&size, dma_pool_add_hugepage, "streaming page pool"))
+		dma_pool.end = dma_pool.start + size;
+}
+
+
+/**
+ * Allocate a page of the streaming DMA pool
+ */
+EXTERN_C void *ddekit_dma_page_alloc(ddekit_addr_t *dma_addr)
+{
+	void *va = 0;
+
+	if (!dma_pool.nr_free)
+		return 0;
+
+	pthread_mutex_lock(&dma_pool.lock);
+	if (dma_pool.nr_free)
+		va = dma_pool.free[--dma_pool.nr_free];
+	pthread_mutex_unlock(&dma_pool.lock);
+
+	if (va && dma_addr)
+		*dma_addr = dma_pool_bus(va);
+
+	return va;
+}
+
+
+/**
+ * Return a page to the streaming DMA pool
+ *
+ * \return 0 on success, -1 if the page is not from the pool
+ */
+EXTERN_C int ddekit_dma_page_free(void *page)
+{
+	char *p = (char *)page;
+
+	if (p < dma_pool.start || p >= dma_pool.end)
+		return -1;
+
+	p = dma_pool.start + ((p - dma_pool.start) & ~(DMA_POOL_PAGE - 1));
+
+	pthread_mutex_lock(&dma_pool.lock);
+	dma_pool.free[dma_pool.nr_free++] = p;
+	pthread_mutex_unlock(&dma_pool.lock);
+
+	return 0;
+}
+
+/*******************************
+ ** Contiguous memory pool    **
+ *******************************/
+
+/*
+ * Contiguous memory is obtained from uio_dma in chunks of at least
+ * CONTIG_CHUNK_SIZE. Without IOMMU each chunk is a dma_alloc_coherent()
+ * buffer mapped into our address space via mmap() on /dev/uioN-dma and is
+ * physically contiguous. With IOMMU a chunk is anonymous memory mapped with
+ * DMA_MAP at iova == va, contiguous in the device's address space. Chunks
+ * are never returned to the kernel; allocations are served from the chunk
+ * bitmaps and only a new chunk costs system calls.
+ *
+ * A chunk is only added to the pool if it serves the request it was mapped
+ * for, and the pool does not grow beyond DDEKIT_CONTIG_POOL MB (default
+ * 64).
+ */
+
+#define CONTIG_CHUNK_SIZE   (4UL << 20) /* largest dma_alloc_coherent() */
+#define CONTIG_POOL_MAX     (64UL << 20)
+
+static struct dma_arena contig_arena = { PTHREAD_MUTEX_INITIALIZER, 0 };
+static unsigned long contig_pool_bytes;
+static unsigned long contig_pool_max = CONTIG_POOL_MAX;
+
+static void *contig_map_bounce(unsigned long size, ddekit_addr_t high, ddekit_addr_t *bus)
+{
+	void *ptr;
+	struct dma_op dma_req;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dma_primary()->fd, 0);
+	if(ptr == MAP_FAILED) {
+		ddekit_printf("%s: mmap() failed (%d) %s\n", __func__, errno, strerror(errno));
+		return 0;
+	}
+
+	dma_req.size = size;
+	dma_req.va = (unsigned long)ptr;
+	dma_req.iova = 0;
+
+	if(dma_translate_bounce(dma_primary()->fd, &dma_req, high) < 0) {
+		ddekit_printf("%s: error translating %p (%d) %s\n", __func__, ptr, errno, strerror(errno));
+		contig_unmap_bounce(ptr, size, dma_req.iova);
+		return 0;
+	}
+
+	*bus = dma_req.iova;
+	return ptr;
+}
+
+static void contig_unmap_bounce(void *va, unsigned long size, ddekit_addr_t bus)
+{
+	struct dma_op dma_req;
+
+	dma_req.size = size;
+	dma_req.va = (unsigned long)va;
+	dma_req.iova = bus;
+
+	ddekit_pgtab_pagemap_invalidate(va, size);
+	munmap(va, size);
+	ioctl(dma_primary()->fd, DMA_FREE, &dma_req);
+}
+
+static void *contig_map_iommu(unsigned long size, ddekit_addr_t high, ddekit_addr_t *bus)
+{
+	void *ptr;
+	struct dma_op dma_req;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+
+#ifdef MAP_32BIT
+	/* the iova is the va, devices limited to 32 bits need a low one */
+	if (high <= 0xffffffffUL)
+		flags |= MAP_32BIT;
+#endif
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if(ptr == MAP_FAILED) {
+		ddekit_printf("%s: mmap() failed (%d) %s\n", __func__, errno, strerror(errno));
+		return 0;
+	}
+
+	dma_req.size = size;
+	dma_req.va = (unsigned long)ptr;
+	dma_req.iova = 0;
+	dma_req.direction = DDEKIT_DMA_BIDIRECTIONAL;
+
+	if(ioctl(dma_primary()->fd, DMA_MAP, &dma_req) < 0) {
+		ddekit_printf("%s: error mapping %p (%d) %s\n", __func__, ptr, errno, strerror(errno));
+		munmap(ptr, size);
+		return 0;
+	}
+
+	*bus = dma_req.iova;
+	return ptr;
+}
+
+static void contig_unmap_iommu(void *va, unsigned long size, ddekit_addr_t bus)
+{
+	struct dma_op dma_req;
+
+	dma_req.size = size;
+	dma_req.va = (unsigned long)va;
+	dma_req.iova = bus;
+
+	if(ioctl(dma_primary()->fd, DMA_UNMAP, &dma_req) < 0)
+		ddekit_printf("%s: error unmapping %p (%d) %s\n", __func__, va, errno, strerror(errno));
+	munmap(va, size);
+}
+
+/**
+ * Map a new chunk of contiguous memory from uio_dma, counted against the
+ * pool limit
+ */
+static struct dma_chunk *contig_chunk_map(unsigned long size, ddekit_addr_t high)
+{
+	void *ptr;
+	ddekit_addr_t bus;
+	struct dma_chunk *c;
+
+	if(__sync_add_and_fetch(&contig_pool_bytes, size) > contig_pool_max) {
+		ddekit_printf("%s: pool limit of %lu MB reached\n", __func__, contig_pool_max >> 20);
+		goto err;
+	}
+
+	if(!(ptr = contig_map(size, high, &bus)))
+		goto err;
+
+	if(!(c = dma_chunk_create(ptr, bus, size))) {
+		contig_unmap(ptr, size, bus);
+		goto err;
+	}
+
+	return c;
+
+err:
+	__sync_fetch_and_sub(&contig_pool_bytes, size);
+	return 0;
+}
+
+static void contig_chunk_unmap(struct dma_chunk *c)
+{
+	contig_unmap(c->va, c->size, c->bus);
+	__sync_fetch_and_sub(&contig_pool_bytes, c->size);
+	ddekit_simple_free(c->bitmap);
+	ddekit_simple_free(c);
+}
+
+/**
+ * Grow the pool by a chunk for a block it cannot serve
+ *
+ * \return the block, 0 if the new chunk does not satisfy the constraints
+ */
+static void *contig_grow(unsigned long size, unsigned long low, unsigned long high,
+                         unsigned long alignment, unsigned long boundary, ddekit_addr_t *bus)
+{
+	unsigned long chunk_size;
+	struct dma_chunk *c;
+	long offset;
+
+	/* large enough for an aligned block */
+	chunk_size = size + (alignment > DMA_ARENA_GRAIN ? alignment : 0);
+	chunk_size = (chunk_size + DMA_ARENA_GRAIN - 1) & ~(DMA_ARENA_GRAIN - 1);
+	if(chunk_size < CONTIG_CHUNK_SIZE)
+		chunk_size = CONTIG_CHUNK_SIZE;
+
+	if(!(c = contig_chunk_map(chunk_size, high)))
+		return 0;
+
+	/* the chunk is not in the pool yet, nobody else allocates from it */
+	if((offset = dma_chunk_alloc(c, size, alignment, low, high, boundary)) < 0) {
+		ddekit_printf("%s: new chunk at bus 0x%lx has no block of %lu bytes in [0x%lx, 0x%lx]\n",
+		              __func__, c->bus, size, low, high);
+		contig_chunk_unmap(c);
+		return 0;
+	}
+
+	dma_arena_add(&contig_arena, c);
+
+	*bus = c->bus + offset;
+	return c->va + offset;
+}
+
+
+/**
+ * Allocate large block of memory (special interface)
+ *
+ * The block is contiguous for the device, its bus address lies within
+ * [low, high], is aligned to alignment and does not cross a multiple of
+ * boundary. Blocks are released using ddekit_large_free().
+ *
+ * This is no useful for allocation < page size.
+ */
+EXTERN_C void *ddekit_contig_malloc(unsigned long size,
+                           unsigned long low,
+                           unsigned long high,
+                           unsigned long alignment,
+                           unsigned long boundary)
+{
+	void *ptr;
+	ddekit_addr_t bus;
+
+	if(!size || (alignment & (alignment - 1)) || (boundary & (boundary - 1)))
+		return 0;
+	if(boundary && size > boundary)
+		return 0;
+
+	ptr = dma_arena_alloc(&contig_arena, size, alignment, low, high, boundary, &bus);
+	if(!ptr)
+		ptr = contig_grow(size, low, high, alignment, boundary, &bus);
+	if(!ptr)
+		return 0;
+
+	ddekit_pgtab_set_region_with_size(ptr, bus, size, PTE_TYPE_CONTIG);
+	ddekit_trace_alloc(DDEKIT_TRACE_CONTIG, 0, size, ptr);
+
+	return ptr;
+}
+
+
+/**
+ * Release block allocated by ddekit_contig_malloc()
+ *
+ * \return 0 on success, -1 if the block is not from the contiguous pool
+ */
+static int contig_free(void *objp)
+{
+	if(dma_arena_free(&contig_arena, objp))
+		return -1;
+
+	ddekit_pgtab_clear_region(objp, PTE_TYPE_CONTIG);
+	return 0;
+}
+
+/**
+ * Grow the contiguous pool to at least size bytes, up to the pool limit
+ *
+ * Bounce mode chunks are mapped with remap_pfn_range() and never fault,
+ * IOMMU mode chunks are populated and pinned by DMA_MAP. The coherent
+ * arena needs no prefaulting either, DMA_REGISTER pins it.
+ *
+ * \return pool size in bytes
+ */
+EXTERN_C unsigned long ddekit_dma_prefault(unsigned long size)
+{
+	unsigned long used, total;
+	struct dma_chunk *c;
+
+	dma_arena_usage(&contig_arena, &used, &total);
+	while (total < size) {
+		if (!(c = contig_chunk_map(CONTIG_CHUNK_SIZE, ~0UL)))
+			break;
+		dma_arena_add(&contig_arena, c);
+		total += CONTIG_CHUNK_SIZE;
+	}
+
+	return total;
+}
+
+
+/**
+ * Set the number of bytes prefaulted into each slab created from now on
+ */
+EXTERN_C void ddekit_mem_set_prefault(unsigned long slab_bytes)
+{
+	slab_prefault_bytes = slab_bytes;
+}
+
+/****************
+ ** Accounting **
+ ****************/
+
+/**
+ * Read accounting information of large blocks and DMA memory
+ */
+EXTERN_C void ddekit_mem_get_stats(struct ddekit_mem_stats *stats)
+{
+	struct ddekit_dma_stats dma;
+	int order;
+
+	pthread_mutex_lock(&large_alloc_mtx);
+	stats->large_bytes = large_in_use;
+	stats->large_cached = 0;
+	for (order = 0; order <= LARGE_MAX_ORDER; order++)
+		stats->large_cached += (large_orders[order].nr_hot + large_orders[order].nr_cold)
+		                       * (LARGE_PAGE_SIZE << order);
+	pthread_mutex_unlock(&large_alloc_mtx);
+
+	dma_arena_usage(&coherent_arena, &stats->coherent_bytes, &stats->coherent_arena);
+	stats->coherent_mapped = coherent_mapped_bytes;
+	dma_arena_usage(&contig_arena, &stats->contig_bytes, &stats->contig_pool);
+
+	pthread_mutex_lock(&dma_pool.lock);
+	stats->pool_bytes = (dma_pool.nr_pages - dma_pool.nr_free) * DMA_POOL_PAGE;
+	stats->pool_size  = dma_pool.nr_pages * DMA_POOL_PAGE;
+	pthread_mutex_unlock(&dma_pool.lock);
+
+	ddekit_dma_get_stats(&dma);
+	stats->streaming_bytes = dma.streaming_bytes;
+	stats->mappings        = dma.mappings;
+	stats->map_calls       = dma.map_calls + dma.unmap_calls;
+	stats->dma_ioctls      = dma.ioctls;
+	stats->dma_lookups     = dma.lookups;
+}
+
+
+/* nonzero buckets of a streaming DMA latency histogram as "bucket:count" */
+static int dma_dump_hist_line(char *buf, int len, const char *name, const unsigned long *hist)
+{
+	int ret = snprintf(buf, len, "%-19s:", name);
+	int i;
+
+	for(i = 0; i < DDEKIT_DMA_HIST_BUCKETS && ret < len; i++)
+		if(hist[i])
+			ret += snprintf(buf + ret, len - ret, " %d:%lu", i, hist[i]);
+	if(ret < len)
+		ret += snprintf(buf + ret, len - ret, "\n");
+	return ret;
+}
+
+static int dma_dump_hist(char *buf, int len)
+{
+	struct ddekit_dma_stats d;
+	int ret;
+
+	ddekit_dma_get_stats(&d);
+	ret = snprintf(buf, len, "# latency          : <log2 ns>:<system calls>\n");
+	if(ret < len)
+		ret += dma_dump_hist_line(buf + ret, len - ret, "dma-map-latency", d.map_hist);
+	if(ret < len)
+		ret += dma_dump_hist_line(buf + ret, len - ret, "dma-unmap-latency", d.unmap_hist);
+	return ret;
+}
+
+/**
+ * Print accounting information of large blocks and DMA memory
+ *
+ * \return number of characters written, excluding the terminating 0
+ */
+EXTERN_C int ddekit_mem_dump_stats(char *buf, int len)
+{
+	struct ddekit_mem_stats s;
+	int ret;
+
+	ddekit_mem_get_stats(&s);
+	ret = snprintf(buf, len,
+	               "# arena            : <used bytes> <size bytes>\n"
+	               "large              : %12lu %12lu\n"
+	               "dma-coherent-arena : %12lu %12lu\n"
+	               "dma-coherent-mapped: %12lu %12lu\n"
+	               "dma-contig         : %12lu %12lu\n"
+	               "dma-page-pool      : %12lu %12lu\n"
+	               "dma-streaming      : %12lu %12lu mappings\n"
+	               "dma-ioctls         : %12lu %12lu (un)mappings\n"
+	               "dma-lookups        : %12lu mappings of pre-mapped memory\n",
+	               s.large_bytes, s.large_bytes + s.large_cached,
+	               s.coherent_bytes, s.coherent_arena,
+	               s.coherent_mapped, s.coherent_mapped,
+	               s.contig_bytes, s.contig_pool,
+	               s.pool_bytes, s.pool_size,
+	               s.streaming_bytes, s.mappings,
+	               s.dma_ioctls, s.map_calls,
+	               s.dma_lookups);
+	if(ret < len)
+		ret += dma_dump_hist(buf + ret, len - ret);
+
+	return ret < len ? ret : (len ? len - 1 : 0);
+}
+
+EXTERN_C void ddekit_mem_init()
+{
+	/* the primary DMA context is opened by ddekit_dma_init() */
+	if(dma_primary()->fd < 0)
+		ddekit_panic("%s: no DMA mapping device\n", __func__);
+
+	dma_mode_init();
+	ddekit_printf("%s memory init\n", dma_primary()->mode == DMA_MODE_IOMMU ? "dma-iommu" : "dma-bounce");
+
+	if (getenv("DDEKIT_CONTIG_POOL"))
+		contig_pool_max = strtoul(getenv("DDEKIT_CONTIG_POOL"), NULL, 0) << 20;
+
+	dma_arena_init();
+	dma_pool_init();
 }
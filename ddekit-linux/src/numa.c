@@ -0,0 +1,180 @@
+/**
+ * NUMA placement of DDEKit memory and threads
+ *
+ * DDEKit memory and threads are placed on the NUMA node of the driven PCI
+ * device. The node is read from sysfs by the PCI layer and may be
+ * overridden by setting DDEKIT_NUMA_NODE (-1 disables placement).
+ *
+ * Placement uses the raw mbind/set_mempolicy system calls, so there is no
+ * dependency on libnuma.
+ */
+#define _GNU_SOURCE
+
+#include <ddekit/printf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define MPOL_PREFERRED      1
+#define NUMA_MAX_NODES      64
+#define NUMA_MASK_WORDS     (NUMA_MAX_NODES / (8 * sizeof(unsigned long)))
+/* the kernel reads maxnode - 1 bits of the mask */
+#define NUMA_MAXNODE        (NUMA_MAX_NODES + 1)
+
+extern int ddekit_pci_numa_node(void);
+
+static int numa_node = -1;
+
+/* CPUs of numa_node, empty if unknown */
+static cpu_set_t numa_cpus;
+
+
+/**
+ * Parse a sysfs cpulist ("0-3,8,10-11") into a cpu set
+ */
+static int numa_parse_cpulist(const char *list, cpu_set_t *set)
+{
+	char *end;
+	long first, last;
+
+	CPU_ZERO(set);
+	while (*list && *list != '\n') {
+		first = strtol(list, &end, 10);
+		if (end == list)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list)
+				return -1;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		list = (*end == ',') ? end + 1 : end;
+	}
+
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+
+static int numa_read_cpus(int node, cpu_set_t *set)
+{
+	char path[64];
+	char buf[1024];
+	FILE *f;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (!(f = fopen(path, "r")))
+		return -1;
+	if (fgets(buf, sizeof(buf), f))
+		ret = numa_parse_cpulist(buf, set);
+	fclose(f);
+
+	return ret;
+}
+
+
+static void numa_nodemask(unsigned long *mask)
+{
+	memset(mask, 0, NUMA_MASK_WORDS * sizeof(unsigned long));
+	mask[numa_node / (8 * sizeof(unsigned long))] = 1UL << (numa_node % (8 * sizeof(unsigned long)));
+}
+
+
+/**
+ * Return the NUMA node DDEKit places memory and threads on, -1 for none
+ */
+int ddekit_numa_node(void)
+{
+	return numa_node;
+}
+
+
+/**
+ * Prefer the DDEKit node for future page faults in [va, va + size)
+ */
+void ddekit_numa_bind_memory(void *va, unsigned long size)
+{
+	unsigned long mask[NUMA_MASK_WORDS];
+
+	if (numa_node < 0)
+		return;
+
+	numa_nodemask(mask);
+
+	if (syscall(SYS_mbind, va, size, MPOL_PREFERRED, mask, NUMA_MAXNODE, 0))
+		ddekit_printf("%s: mbind(%p, %lu) failed (%d) %s\n", __func__, va, size,
+		              errno, strerror(errno));
+}
+
+
+static void numa_set_mempolicy(void)
+{
+	unsigned long mask[NUMA_MASK_WORDS];
+
+	numa_nodemask(mask);
+
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NUMA_MAXNODE))
+		ddekit_printf("%s: set_mempolicy failed (%d) %s\n", __func__, errno, strerror(errno));
+}
+
+
+/**
+ * Bind the calling thread and its future allocations to the DDEKit node
+ */
+void ddekit_numa_bind_thread(void)
+{
+	int err;
+
+	if (numa_node < 0)
+		return;
+
+	numa_set_mempolicy();
+
+	if (CPU_COUNT(&numa_cpus)
+	    && (err = pthread_setaffinity_np(pthread_self(), sizeof(numa_cpus), &numa_cpus)))
+		ddekit_printf("%s: setting affinity failed (%d) %s\n", __func__, err, strerror(err));
+}
+
+
+/**
+ * Determine the DDEKit node and make it the preferred node of the initial
+ * thread, which allocates most driver memory during initialization
+ *
+ * Must be called after the PCI layer has been initialized.
+ */
+void ddekit_numa_init(void)
+{
+	char *env;
+
+	if ((env = getenv("DDEKIT_NUMA_NODE")))
+		numa_node = atoi(env);
+	else
+		numa_node = ddekit_pci_numa_node();
+
+	if (numa_node >= NUMA_MAX_NODES) {
+		ddekit_printf("%s: node %d out of range\n", __func__, numa_node);
+		numa_node = -1;
+	}
+
+	if (numa_node < 0) {
+		ddekit_printf("%s: no NUMA placement\n", __func__);
+		return;
+	}
+
+	if (numa_read_cpus(numa_node, &numa_cpus))
+		CPU_ZERO(&numa_cpus);
+
+	ddekit_printf("%s: placing memory and threads on node %d (%d CPUs)\n", __func__,
+	              numa_node, CPU_COUNT(&numa_cpus));
+
+	numa_set_mempolicy();
+}
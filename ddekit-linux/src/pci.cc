@@ -264,6 +264,25 @@ DDEKit::Pci_bus::to_dev(unsigned short bus, unsigned short slot, unsigned short
 }
 */
 
+/*
+ * DMA context by the address on the virtual bus of DDE, where slot is the
+ * device number (as in find())
+ */
+struct ddekit_dma_ctx *
+DDEKit::Pci_bus::dma_ctx(unsigned bus, unsigned slot, unsigned func)
+{
+	std::list<Pci_device>::iterator i;
+
+	if(bus != 0 || func != 0)
+		return NULL;
+
+	for(i = __devices.begin(); i != __devices.end(); i++) {
+		if(i->ref->num == (int)slot)
+			return i->get_dma_ctx();
+	}
+	return NULL;
+}
+
 int
 DDEKit::Pci_bus::pcie_register(unsigned bus, unsigned slot, unsigned func)
 {
@@ -297,6 +316,18 @@ DDEKit::Pci_bus::bind_irq(int irq)
 	return -1;
 }
 
+int
+DDEKit::Pci_bus::numa_node()
+{
+	std::list<Pci_device>::iterator i;
+
+	/* the device bound by bind_irq() */
+	for(i = __devices.begin(); i != __devices.end(); ++i) {
+		return (*i).get_numa_node();
+	}
+	return -1;
+}
+
 void
 DDEKit::Pci_bus::unbind_irq(int irq)
 {
@@ -353,6 +384,12 @@ ddekit_uio_register(unsigned bus, unsigned slot, unsigned func, int msi)
 	return ddekit_pci_bus->pcie_register(bus, slot, func);
 }
 
+EXTERN_C struct ddekit_dma_ctx *
+ddekit_pci_get_dma_ctx(int bus, int slot, int func)
+{
+	return ddekit_pci_bus->dma_ctx(bus, slot, func);
+}
+
 EXTERN_C int
 ddekit_pci_bind_irq(int irq)
 {
@@ -365,6 +402,12 @@ ddekit_pci_unbind_irq(int irq)
 	ddekit_pci_bus->unbind_irq(irq);
 }
 
+EXTERN_C int
+ddekit_pci_numa_node(void)
+{
+	return ddekit_pci_bus->numa_node();
+}
+
 #define PCI_INTERRUPT_LINE    0x3c
 #define PCI_INTERRUPT_PIN     0x3d
 #define PCI_INTERRUPT_MAX_LAT 0x3f
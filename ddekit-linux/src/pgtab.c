@@ -4,11 +4,17 @@
  * \author  Christian Helmuth <ch12@os.inf.tu-dresden.de>
  * \date    2006-11-01
  *
- * This implementation uses l4rm (especially the AVL tree and userptr) to
- * manage virt->phys mappings. Each mapping region is represented by one
- * pgtab_object that is kept in the l4rm region userptr.
+ * Regions are kept in two interval indexes, one sorted by virtual and one
+ * sorted by physical start address. Each index is an array of entries that
+ * also records the largest end address of all entries up to it, so a
+ * lookup is a binary search followed by a short backward scan that stops
+ * as soon as no earlier region can contain the address.
  *
- * For this to work, dataspaces must be attached to l4rm regions!
+ * Lookups take no lock. Writers are serialized by region_lock and update
+ * the indexes inside a seqlock write section; readers retry if a writer
+ * was active. An index that has to grow is replaced by a copy twice its
+ * size. The old array is never freed because a reader may still search
+ * it; geometric growth bounds those arrays by the size of the live index.
  */
 
 #include <ddekit/pgtab.h>
@@ -16,6 +22,7 @@
 #include <ddekit/panic.h>
 #include <ddekit/printf.h>
 #include <ddekit/semaphore.h>
+#include <ddekit/lock.h>
 #include <ddekit/types.h>
 
 #define _XOPEN_SOURCE 500
@@ -34,78 +41,511 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include <unistd.h>
 
+#define PGTAB_INDEX_MIN  64
+
+#define L4_PAGESHIFT (12)
+#define L4_PAGESIZE  (1 << L4_PAGESHIFT)
 
 /**
- * "Page-table" object
+ * "Page-table" entry
  */
-struct pgtab_object
-{
-	ddekit_addr_t va;    /* virtual start address */
-	ddekit_addr_t pa;    /* physical start address */
-	ddekit_addr_t va_end;
-	/* FIXME reconsider the following members */
-	ssize_t size;
-	unsigned  type;  /* pgtab region type */
-	
-	struct pgtab_object * next;
-	struct pgtab_object * prev;
+struct pgtab_entry
+{
+	ddekit_addr_t start;    /* index key: virtual or physical start address */
+	ddekit_addr_t end;      /* index key: end address (exclusive) */
+	ddekit_addr_t max_end;  /* largest end of this and all preceding entries */
+	ddekit_addr_t va;       /* virtual start address */
+	ddekit_addr_t pa;       /* physical start address */
+	ssize_t size;           /* region size in bytes */
+	unsigned  type;         /* pgtab region type */
 };
 
 /**
- * pa_list_head of page-table object list (for get_virtaddr())
+ * Interval index, entries sorted by start
  */
-static struct pgtab_object pa_list_head =
-{
-	.va = 0,
-	.pa = 0,
-	.va_end = 0,
-	.size = 0,
-	.type = 0,
-	.next = &pa_list_head,
-	.prev = &pa_list_head
+struct pgtab_index
+{
+	unsigned long nr;
+	unsigned long capacity;
+	struct pgtab_entry entries[];
 };
 
+static struct pgtab_index * volatile va_index;
+static struct pgtab_index * volatile pa_index;
+
+/* seqlock sequence, odd while a writer updates the indexes */
+static volatile unsigned long pgtab_seq;
+
+static ddekit_sem_t *region_lock;
+
+
+static inline unsigned long read_seqbegin(void)
+{
+	unsigned long seq;
+
+	while ((seq = __atomic_load_n(&pgtab_seq, __ATOMIC_ACQUIRE)) & 1) ;
 
+	return seq;
+}
 
-#define DMA_CACHE 0
+/* readers only need to order their loads, no full barrier */
+static inline int read_seqretry(unsigned long seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return pgtab_seq != seq;
+}
+
+static inline void write_seqbegin(void)
+{
+	pgtab_seq++;
+	__sync_synchronize();
+}
+
+static inline void write_seqend(void)
+{
+	__sync_synchronize();
+	pgtab_seq++;
+}
 
 
 static void  __attribute__((used)) dump_pgtab_list(void)
 {
-	struct pgtab_object *p = pa_list_head.next;
+	struct pgtab_index *idx = va_index;
+	unsigned long i;
 
 	ddekit_printf("PA LIST DUMP\n");
-	for ( ; p != &pa_list_head; p = p->next)
+	for (i = 0; idx && i < idx->nr; i++)
 	{
-		ddekit_printf("\t0x%08x -> 0x%08x (%d)\n", p->va, p->pa, p->size);
+		ddekit_printf("\t0x%08lx -> 0x%08lx (%zd)\n", idx->entries[i].va,
+		              idx->entries[i].pa, idx->entries[i].size);
 	}
 	ddekit_printf("PA END DUMP\n");
 }
 
-static ddekit_sem_t *pa_list_lock;
-static ddekit_sem_t *region_lock;
+static struct pgtab_index *index_alloc(unsigned long capacity)
+{
+	struct pgtab_index *idx;
+
+	idx = ddekit_simple_malloc(sizeof(*idx) + capacity * sizeof(idx->entries[0]));
+	if (idx) {
+		idx->nr = 0;
+		idx->capacity = capacity;
+	}
+
+	return idx;
+}
 
 void ddekit_pgtab_init(void);
 void ddekit_pgtab_init(void)
 {
-	pa_list_lock = ddekit_sem_init(1);
 	region_lock = ddekit_sem_init(1);
+	va_index = index_alloc(PGTAB_INDEX_MIN);
+	pa_index = index_alloc(PGTAB_INDEX_MIN);
+	if (!va_index || !pa_index)
+		ddekit_panic("%s: no memory for pgtab index", __func__);
 }
 
-static struct pgtab_object *__find(ddekit_addr_t virt)
+
+/**
+ * Find the entry containing addr, -1 if none
+ *
+ * Safe against concurrent writers as long as the caller validates the
+ * result with read_seqretry(): idx->capacity never changes and nr is
+ * clamped to it, so a torn index only yields a wrong answer.
+ */
+static long __find(struct pgtab_index *idx, ddekit_addr_t addr)
 {
-	struct pgtab_object *p = NULL;
+	unsigned long nr = idx->nr;
+	long lo = 0, hi, mid;
+
+	if (nr > idx->capacity)
+		nr = idx->capacity;
+
+	/* last entry starting at or below addr */
+	hi = nr - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
 
-	for (p = pa_list_head.next; p != &pa_list_head; p = p->next)
-	{
-		if (virt >= p->va && virt < p->va_end)
+	for (; hi >= 0 && idx->entries[hi].max_end > addr; hi--) {
+		if (addr < idx->entries[hi].end)
+			return hi;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Look up the region containing addr without taking a lock
+ *
+ * \return 0 and a copy of the entry in e, -1 if there is none
+ */
+static int lookup(struct pgtab_index * volatile *index, ddekit_addr_t addr,
+                  struct pgtab_entry *e)
+{
+	struct pgtab_index *idx;
+	unsigned long seq;
+	long i;
+
+	do {
+		seq = read_seqbegin();
+		idx = *index;
+		i = __find(idx, addr);
+		if (i >= 0)
+			*e = idx->entries[i];
+	} while (read_seqretry(seq));
+
+	return i < 0 ? -1 : 0;
+}
+
+
+/**
+ * Recompute max_end from entry first on, called inside the write section
+ */
+static void index_fixup(struct pgtab_index *idx, unsigned long first)
+{
+	ddekit_addr_t max_end = first ? idx->entries[first - 1].max_end : 0;
+	unsigned long i;
+
+	for (i = first; i < idx->nr; i++) {
+		if (idx->entries[i].end > max_end)
+			max_end = idx->entries[i].end;
+		idx->entries[i].max_end = max_end;
+	}
+}
+
+
+/**
+ * Make room for one more entry, called with region_lock held
+ *
+ * \return 0 on success, -1 if out of memory
+ */
+static int index_reserve(struct pgtab_index * volatile *index)
+{
+	struct pgtab_index *old = *index, *idx;
+
+	if (old->nr < old->capacity)
+		return 0;
+
+	if (!(idx = index_alloc(old->capacity * 2)))
+		return -1;
+	memcpy(idx->entries, old->entries, old->nr * sizeof(old->entries[0]));
+	idx->nr = old->nr;
+
+	/* publish the copy; old stays valid for readers still searching it */
+	__sync_synchronize();
+	*index = idx;
+
+	return 0;
+}
+
+
+/**
+ * Insert entry by start address, called inside the write section
+ */
+static void index_insert(struct pgtab_index *idx, const struct pgtab_entry *e)
+{
+	unsigned long lo = 0, hi = idx->nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].start <= e->start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	memmove(&idx->entries[lo + 1], &idx->entries[lo],
+	        (idx->nr - lo) * sizeof(idx->entries[0]));
+	idx->entries[lo] = *e;
+	idx->nr++;
+	index_fixup(idx, lo);
+}
+
+
+/**
+ * Remove the entry of region (va, pa), called inside the write section
+ */
+static void index_remove(struct pgtab_index *idx, ddekit_addr_t key,
+                         ddekit_addr_t va, ddekit_addr_t pa)
+{
+	long i = __find(idx, key);
+
+	/* regions may overlap, look for the exact one */
+	for (; i >= 0 && idx->entries[i].max_end > key; i--) {
+		if (idx->entries[i].va == va && idx->entries[i].pa == pa)
+			break;
+	}
+	if (i < 0 || idx->entries[i].va != va || idx->entries[i].pa != pa)
+		return;
+
+	idx->nr--;
+	memmove(&idx->entries[i], &idx->entries[i + 1],
+	        (idx->nr - i) * sizeof(idx->entries[0]));
+	index_fixup(idx, i);
+}
+
+/*****************************
+ ** pagemap translation     **
+ *****************************/
+
+/*
+ * Buffers that are not registered as a region can be translated
+ * explicitly by reading /proc/self/pagemap if DDEKIT_PAGEMAP=1. The
+ * kernel hides PFNs from processes without CAP_SYS_ADMIN, and a
+ * translation stays valid only while the page is mapped and resident, so
+ * callers translate memory they pinned and drop the translations with
+ * ddekit_pgtab_pagemap_invalidate() before unmapping it.
+ * ddekit_pgtab_get_physaddr() does not use the pagemap: its result is
+ * passed on as a virtual address for streaming DMA.
+ *
+ * Translations are cached per page in an LRU of DDEKIT_PAGEMAP_CACHE
+ * entries (default 4096). A miss reads the PAGEMAP_BATCH entries around
+ * the page with one pread(), and caches those inside the buffer.
+ */
+
+#define PAGEMAP_BATCH          16
+#define PAGEMAP_CACHE_DEFAULT  4096
+#define PAGEMAP_PRESENT        (1ULL << 63)
+#define PAGEMAP_PFN_MASK       ((1ULL << 55) - 1)
+
+struct pagemap_entry
+{
+	ddekit_addr_t vpn;    /* virtual page number, 0 if unused */
+	ddekit_addr_t pfn;
+	unsigned hnext;       /* hash chain, 0 terminates */
+	unsigned prev, next;  /* LRU list, entry 0 is the list head */
+};
+
+static int pagemap_fd = -1;
+static pthread_once_t pagemap_once = PTHREAD_ONCE_INIT;
+static ddekit_lock_t pagemap_lock;
+static struct pagemap_entry *pagemap_cache;
+static unsigned *pagemap_hash;
+static unsigned long pagemap_hash_mask;
+
+static inline unsigned pagemap_bucket(ddekit_addr_t vpn)
+{
+	return (vpn * 0x9e3779b97f4a7c15ULL >> 32) & pagemap_hash_mask;
+}
+
+static void pagemap_lru_unlink(unsigned i)
+{
+	pagemap_cache[pagemap_cache[i].prev].next = pagemap_cache[i].next;
+	pagemap_cache[pagemap_cache[i].next].prev = pagemap_cache[i].prev;
+}
+
+static void pagemap_lru_push(unsigned i)
+{
+	pagemap_cache[i].prev = 0;
+	pagemap_cache[i].next = pagemap_cache[0].next;
+	pagemap_cache[pagemap_cache[0].next].prev = i;
+	pagemap_cache[0].next = i;
+}
+
+static void pagemap_unhash(unsigned i)
+{
+	unsigned *pp = &pagemap_hash[pagemap_bucket(pagemap_cache[i].vpn)];
+
+	for (; *pp; pp = &pagemap_cache[*pp].hnext) {
+		if (*pp == i) {
+			*pp = pagemap_cache[i].hnext;
 			break;
+		}
+	}
+	pagemap_cache[i].vpn = 0;
+}
+
+/**
+ * Find vpn in the cache and make it most recently used, called locked
+ */
+static unsigned pagemap_lookup(ddekit_addr_t vpn)
+{
+	unsigned i;
+
+	for (i = pagemap_hash[pagemap_bucket(vpn)]; i; i = pagemap_cache[i].hnext) {
+		if (pagemap_cache[i].vpn == vpn) {
+			pagemap_lru_unlink(i);
+			pagemap_lru_push(i);
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Cache a translation, replacing the least recently used, called locked
+ */
+static void pagemap_insert(ddekit_addr_t vpn, ddekit_addr_t pfn)
+{
+	unsigned i, b;
+
+	if ((i = pagemap_lookup(vpn))) {
+		pagemap_cache[i].pfn = pfn;
+		return;
+	}
+
+	i = pagemap_cache[0].prev;
+	if (pagemap_cache[i].vpn)
+		pagemap_unhash(i);
+	pagemap_lru_unlink(i);
+
+	b = pagemap_bucket(vpn);
+	pagemap_cache[i].vpn = vpn;
+	pagemap_cache[i].pfn = pfn;
+	pagemap_cache[i].hnext = pagemap_hash[b];
+	pagemap_hash[b] = i;
+	pagemap_lru_push(i);
+}
+
+static void pagemap_setup(void)
+{
+	static volatile char probe;
+	unsigned long entries = PAGEMAP_CACHE_DEFAULT, i;
+	unsigned long long pme;
+	char *env;
+
+	if (!(env = getenv("DDEKIT_PAGEMAP")) || env[0] != '1')
+		return;
+	if ((env = getenv("DDEKIT_PAGEMAP_CACHE")))
+		entries = strtoul(env, NULL, 0);
+	if (!entries)
+		return;
+
+	pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+	if (pagemap_fd < 0) {
+		ddekit_printf("%s: cannot open pagemap (%d) %s\n", __func__, errno, strerror(errno));
+		return;
+	}
+
+	/* without CAP_SYS_ADMIN present pages read as PFN 0 */
+	probe = 1;
+	if (pread(pagemap_fd, &pme, sizeof(pme),
+	          ((ddekit_addr_t)&probe >> L4_PAGESHIFT) * sizeof(pme)) != sizeof(pme)
+	    || !(pme & PAGEMAP_PRESENT) || !(pme & PAGEMAP_PFN_MASK)) {
+		ddekit_printf("%s: pagemap shows no PFNs, CAP_SYS_ADMIN missing?\n", __func__);
+		goto err;
 	}
 
-	return p == &pa_list_head ? NULL : p;
+	for (pagemap_hash_mask = 1; pagemap_hash_mask < entries; pagemap_hash_mask <<= 1) ;
+	pagemap_cache = ddekit_simple_malloc((entries + 1) * sizeof(*pagemap_cache));
+	pagemap_hash = ddekit_simple_malloc(pagemap_hash_mask * sizeof(*pagemap_hash));
+	if (!pagemap_cache || !pagemap_hash) {
+		ddekit_printf("%s: no memory for %lu entries\n", __func__, entries);
+		goto err;
+	}
+	memset(pagemap_hash, 0, pagemap_hash_mask * sizeof(*pagemap_hash));
+	pagemap_hash_mask--;
+
+	/* all entries start unused on the LRU list */
+	pagemap_cache[0].prev = pagemap_cache[0].next = 0;
+	for (i = 1; i <= entries; i++) {
+		pagemap_cache[i].vpn = 0;
+		pagemap_lru_push(i);
+	}
+
+	ddekit_lock_init(&pagemap_lock);
+	ddekit_printf("%s: translating unregistered memory via pagemap (%lu pages cached)\n",
+	              __func__, entries);
+	return;
+
+err:
+	ddekit_simple_free(pagemap_cache);
+	ddekit_simple_free(pagemap_hash);
+	pagemap_cache = NULL;
+	pagemap_hash = NULL;
+	close(pagemap_fd);
+	pagemap_fd = -1;
+}
+
+
+/**
+ * Translate virt of the buffer [virt, virt + size) using the pagemap cache
+ *
+ * \return 0 and the physical address in phys, -1 if untranslatable
+ */
+int ddekit_pgtab_pagemap_translate(const void *virt, unsigned long size, ddekit_addr_t *phys)
+{
+	unsigned long long pme[PAGEMAP_BATCH];
+	ddekit_addr_t vpn = (ddekit_addr_t)virt >> L4_PAGESHIFT;
+	ddekit_addr_t last = ((ddekit_addr_t)virt + (size ? size - 1 : 0)) >> L4_PAGESHIFT;
+	ddekit_addr_t first, pfn = 0;
+	ssize_t ret;
+	unsigned i;
+
+	pthread_once(&pagemap_once, pagemap_setup);
+	if (pagemap_fd < 0)
+		return -1;
+
+	ddekit_lock_lock(&pagemap_lock);
+	if ((i = pagemap_lookup(vpn)))
+		pfn = pagemap_cache[i].pfn;
+	ddekit_lock_unlock(&pagemap_lock);
+
+	if (!i) {
+		first = vpn & ~(ddekit_addr_t)(PAGEMAP_BATCH - 1);
+		ret = pread(pagemap_fd, pme, sizeof(pme), first * sizeof(pme[0]));
+		if (ret < (ssize_t)sizeof(pme[0]))
+			return -1;
+
+		/* pages outside the buffer would not be invalidated with it */
+		ddekit_lock_lock(&pagemap_lock);
+		for (i = 0; i < ret / sizeof(pme[0]); i++) {
+			if (first + i < vpn || first + i > last)
+				continue;
+			if ((pme[i] & PAGEMAP_PRESENT) && (pme[i] & PAGEMAP_PFN_MASK))
+				pagemap_insert(first + i, pme[i] & PAGEMAP_PFN_MASK);
+		}
+		ddekit_lock_unlock(&pagemap_lock);
+
+		i = vpn - first;
+		if (i >= ret / sizeof(pme[0]) || !(pme[i] & PAGEMAP_PRESENT))
+			return -1;
+		pfn = pme[i] & PAGEMAP_PFN_MASK;
+		if (!pfn)
+			return -1;
+	}
+
+	*phys = (pfn << L4_PAGESHIFT) | ((ddekit_addr_t)virt & (L4_PAGESIZE - 1));
+	return 0;
+}
+
+
+/**
+ * Drop cached translations of [virt, virt + size), e.g., before munmap()
+ */
+void ddekit_pgtab_pagemap_invalidate(const void *virt, unsigned long size)
+{
+	ddekit_addr_t vpn = (ddekit_addr_t)virt >> L4_PAGESHIFT;
+	ddekit_addr_t end = ((ddekit_addr_t)virt + size + L4_PAGESIZE - 1) >> L4_PAGESHIFT;
+	unsigned i;
+
+	if (pagemap_fd < 0)
+		return;
+
+	ddekit_lock_lock(&pagemap_lock);
+	for (; vpn < end; vpn++) {
+		if ((i = pagemap_lookup(vpn))) {
+			pagemap_unhash(i);
+			/* unused entries are recycled first */
+			pagemap_lru_unlink(i);
+			pagemap_cache[i].prev = pagemap_cache[0].prev;
+			pagemap_cache[i].next = 0;
+			pagemap_cache[pagemap_cache[0].prev].next = i;
+			pagemap_cache[0].prev = i;
+		}
+	}
+	ddekit_lock_unlock(&pagemap_lock);
 }
 
 /*****************************
@@ -120,19 +560,15 @@ static struct pgtab_object *__find(ddekit_addr_t virt)
  */
 ddekit_addr_t ddekit_pgtab_get_physaddr(const void *virt)
 {
-	/* find pgtab object */
-	ddekit_sem_down(pa_list_lock);
-	struct pgtab_object *p = __find((ddekit_addr_t)virt);
-	ddekit_sem_up(pa_list_lock);
-	if (!p) {
+	struct pgtab_entry e;
+
+	if (lookup(&va_index, (ddekit_addr_t)virt, &e)) {
 		/* if we can't translate it, return it - needed for DMA! */
 		return (ddekit_addr_t)virt;
 	}
 
 	/* return virt->phys mapping */
-	ssize_t offset = (ddekit_addr_t) virt - p->va;
-
-	return p->pa + offset;
+	return e.pa + ((ddekit_addr_t)virt - e.va);
 }
 
 /**
@@ -143,59 +579,43 @@ ddekit_addr_t ddekit_pgtab_get_physaddr(const void *virt)
  */
 ddekit_addr_t ddekit_pgtab_get_virtaddr(const ddekit_addr_t physical)
 {
-	/* find pgtab object */
-	struct pgtab_object *p;
-	ddekit_addr_t retval = 0;
-	
-	/* find phys->virt mapping */
-	ddekit_sem_down(pa_list_lock);
-	for (p = pa_list_head.next ; p != &pa_list_head ; p = p->next) {
-		if (p->pa <= (ddekit_addr_t)physical && 
-		    (ddekit_addr_t)physical < p->pa + p->size) {
-			ssize_t offset = (ddekit_addr_t) physical - p->pa;
-			retval = p->va + offset;
-			break;
-		}
-	}
-	ddekit_sem_up(pa_list_lock);
+	struct pgtab_entry e;
 
-	if (!retval)
+	if (lookup(&pa_index, physical, &e)) {
 		ddekit_debug("%s: no phys->virt mapping for physical address %p", __func__, (void*)physical);
+		return 0;
+	}
 
-	return retval;
+	return e.va + (physical - e.pa);
 }
 
 
 
 int ddekit_pgtab_get_type(const void *virt)
 {
-	/* find pgtab object */
-	ddekit_sem_down(pa_list_lock);
-	struct pgtab_object *p = __find((ddekit_addr_t)virt);
-	ddekit_sem_up(pa_list_lock);
-	if (!p) {
+	struct pgtab_entry e;
+
+	if (lookup(&va_index, (ddekit_addr_t)virt, &e)) {
 		/* XXX this is verbose */
 		ddekit_debug("%s: no virt->phys mapping for %p", __func__, virt);
 		return -1;
 	}
 
-	return p->type;
+	return e.type;
 }
 
 
 int ddekit_pgtab_get_size(const void *virt)
 {
-	/* find pgtab object */
-	ddekit_sem_down(pa_list_lock);
-	struct pgtab_object *p = __find((ddekit_addr_t)virt);
-	ddekit_sem_up(pa_list_lock);
-	if (!p) {
+	struct pgtab_entry e;
+
+	if (lookup(&va_index, (ddekit_addr_t)virt, &e)) {
 		/* XXX this is verbose */
 		ddekit_debug("%s: no virt->phys mapping for %p", __func__, virt);
 		return -1;
 	}
 
-	return p->size;
+	return e.size;
 }
 
 
@@ -207,34 +627,23 @@ int ddekit_pgtab_get_size(const void *virt)
  */
 void ddekit_pgtab_clear_region(void *virt, int type __attribute__((unused)))
 {
+	struct pgtab_entry e;
 
 	ddekit_sem_down(region_lock);
-	ddekit_sem_down(pa_list_lock);
-	struct pgtab_object *p = __find((ddekit_addr_t)virt);
-	if (!p) {
+	if (lookup(&va_index, (ddekit_addr_t)virt, &e)) {
 		/* XXX this is verbose */
 		ddekit_urgent("%s: no virt->phys mapping for %p\n", __func__, virt);
 		goto out;
 	}
 
-
-	/* remove pgtab object from list */
-	p->next->prev= p->prev;
-	p->prev->next= p->next;
-	ddekit_sem_up(pa_list_lock);
-	//ddekit_printf("removed %p 0x%08x from pgtab\n", virt, p->pa);
-	ddekit_sem_up(region_lock);
-	
-	
-	
-	/* free pgtab object */
-	ddekit_simple_free(p);
-	return;
+	write_seqbegin();
+	index_remove(va_index, e.va, e.va, e.pa);
+	index_remove(pa_index, e.pa, e.va, e.pa);
+	write_seqend();
+	//ddekit_printf("removed %p 0x%08x from pgtab\n", virt, e.pa);
 
 out:
-	ddekit_sem_up(pa_list_lock);
 	ddekit_sem_up(region_lock);
-
 }
 
 
@@ -248,37 +657,36 @@ out:
  */
 void ddekit_pgtab_set_region(void *virt, ddekit_addr_t phys, int pages, int type)
 {
-	/* allocate pgtab object */
+	struct pgtab_entry e;
+
+	/* initialize pgtab entry */
+	e.va   = (ddekit_addr_t)virt;
+	e.pa   = phys;
+	e.size = (ssize_t)pages << L4_PAGESHIFT;
+	e.type = type;
+
 	ddekit_sem_down(region_lock);
-	struct pgtab_object *dp, *p = ddekit_simple_malloc(sizeof(*p));
-	if (!p) {
+	if (index_reserve(&va_index) || index_reserve(&pa_index)) {
 		ddekit_printf("ddekit heap exhausted\n");
 		goto out;
 	}
-	/* initialize pgtab object */
-	p->va   = (ddekit_addr_t)virt;
-	p->pa   = phys;
-	p->size = pages;
-	p->va_end = p->va + p->size;
-	p->type = type;
-
-	ddekit_sem_down(pa_list_lock);
-	p->next = &pa_list_head;
-	p->prev = pa_list_head.prev;
-	p->prev->next = p;
-	pa_list_head.prev = p;
-	
-	ddekit_sem_up(pa_list_lock);
+
+	write_seqbegin();
+	e.start = e.va;
+	e.end   = e.va + e.size;
+	index_insert(va_index, &e);
+	e.start = e.pa;
+	e.end   = e.pa + e.size;
+	index_insert(pa_index, &e);
+	write_seqend();
 //	ddekit_printf("added %p 0x%08x to pgtab\n", virt, phys);
 out:
 	ddekit_sem_up(region_lock);
 }
 
-#define L4_PAGESHIFT (12)
-#define L4_PAGESIZE  (1 << L4_PAGESHIFT)
 int l4_round_page(int size)
 {
-	return (size & ~(L4_PAGESIZE-1)) + (L4_PAGESIZE - 1);
+	return (size + L4_PAGESIZE - 1) & ~(L4_PAGESIZE - 1);
 }
 void ddekit_pgtab_set_region_with_size(void *virt, ddekit_addr_t phys, int size, int type)
 {
@@ -287,4 +695,3 @@ void ddekit_pgtab_set_region_with_size(void *virt, ddekit_addr_t phys, int size,
 //	ddekit_printf("%s: virt %p, phys %p, pages %d\n", __func__, virt, phys, p);
 	ddekit_pgtab_set_region(virt, phys, p, type);
 }
-
@@ -0,0 +1,145 @@
+/**
+ * Locked and prefaulted memory
+ *
+ * Setting DDEKIT_MLOCK=1 locks all current and future mappings of the
+ * process (mlockall) and prefaults the DDEKit pools during initialization,
+ * so the RX/TX path does not take page faults after warm-up. The pool
+ * sizes are set by environment variables:
+ *
+ *   DDEKIT_PREFAULT_SLAB   KB of objects prefaulted into each slab cache,
+ *                          including caches created later (default 64)
+ *   DDEKIT_PREFAULT_PAGES  number of single pages kept for
+ *                          ddekit_large_malloc() (default 256)
+ *   DDEKIT_PREFAULT_DMA    MB of contiguous DMA memory (default 4)
+ *
+ * Thread stacks are touched before a thread starts.
+ */
+#define _GNU_SOURCE
+
+#include <ddekit/printf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#define PREFAULT_PAGE_SIZE       4096UL
+#define PREFAULT_SLAB_DEFAULT    64     /* KB */
+#define PREFAULT_PAGES_DEFAULT   256
+#define PREFAULT_DMA_DEFAULT     4      /* MB */
+
+extern void ddekit_mem_set_prefault(unsigned long slab_bytes);
+extern int ddekit_large_prefault(unsigned long size, int nr);
+extern unsigned long ddekit_dma_prefault(unsigned long size);
+
+int ddekit_prefault_enabled = 0;
+
+/* minor faults at the end of initialization */
+static long prefault_minflt;
+
+
+static unsigned long env_ulong(const char *name, unsigned long def)
+{
+	char *env = getenv(name);
+
+	return env ? strtoul(env, NULL, 0) : def;
+}
+
+
+/**
+ * Touch every page of [va, va + size) from the top, like a growing stack
+ */
+void ddekit_prefault_touch(void *va, unsigned long size)
+{
+	volatile char *p = (volatile char *)va + size;
+
+	while (size >= PREFAULT_PAGE_SIZE) {
+		p -= PREFAULT_PAGE_SIZE;
+		*p = *p;
+		size -= PREFAULT_PAGE_SIZE;
+	}
+	if (size)
+		*(volatile char *)va = *(volatile char *)va;
+}
+
+
+/**
+ * Return the number of bytes locked in memory (VmLck), 0 if unknown
+ */
+unsigned long ddekit_prefault_locked_bytes(void)
+{
+	char line[128];
+	unsigned long kb = 0;
+	FILE *f;
+
+	if (!(f = fopen("/proc/self/status", "r")))
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmLck: %lu kB", &kb) == 1)
+			break;
+	}
+	fclose(f);
+
+	return kb << 10;
+}
+
+
+/**
+ * Return the number of minor page faults since initialization finished
+ */
+long ddekit_prefault_faults(void)
+{
+	struct rusage ru;
+
+	if (!ddekit_prefault_enabled)
+		return -1;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt - prefault_minflt;
+}
+
+
+/**
+ * Lock memory if requested, must be called before the pools are set up
+ */
+void ddekit_prefault_init(void)
+{
+	char *env = getenv("DDEKIT_MLOCK");
+
+	if (!env || env[0] != '1')
+		return;
+
+	ddekit_prefault_enabled = 1;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		ddekit_printf("%s: mlockall failed (%d) %s, prefaulting only\n", __func__,
+		              errno, strerror(errno));
+
+	ddekit_mem_set_prefault(env_ulong("DDEKIT_PREFAULT_SLAB", PREFAULT_SLAB_DEFAULT) << 10);
+}
+
+
+/**
+ * Prefault the page and DMA pools and report the locked memory
+ */
+void ddekit_prefault_pools(void)
+{
+	unsigned long pages, dma;
+	struct rusage ru;
+
+	if (!ddekit_prefault_enabled)
+		return;
+
+	pages = env_ulong("DDEKIT_PREFAULT_PAGES", PREFAULT_PAGES_DEFAULT);
+	pages = ddekit_large_prefault(PREFAULT_PAGE_SIZE, pages);
+
+	dma = ddekit_dma_prefault(env_ulong("DDEKIT_PREFAULT_DMA", PREFAULT_DMA_DEFAULT) << 20);
+
+	getrusage(RUSAGE_SELF, &ru);
+	prefault_minflt = ru.ru_minflt;
+
+	ddekit_info("%s: %lu pages, %lu KB DMA pool, %lu KB locked\n", __func__,
+	            pages, dma >> 10, ddekit_prefault_locked_bytes() >> 10);
+}
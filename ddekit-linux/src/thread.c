@@ -18,6 +18,10 @@
 
 static struct ddekit_slab *ddekit_stack_slab = NULL;
 
+extern void ddekit_numa_bind_thread(void);
+extern void ddekit_prefault_touch(void *va, unsigned long size);
+extern int ddekit_prefault_enabled;
+
 struct ddekit_thread {
 	pthread_t pthread;
 	void *data;
@@ -91,6 +95,9 @@ static void *ddekit_thread_startup(void *arg) {
 	void (*_fn)(void *) = su->fun;
 	void *_arg = su->arg;
 
+	/* run on the device's NUMA node, if any */
+	ddekit_numa_bind_thread();
+
 	/* init dde thread structure */
 	su->td = ddekit_thread_setup_myself(su->name);
 	thread_ptr = su->td;
@@ -146,6 +153,10 @@ ddekit_thread_t *ddekit_thread_create(void (*fun)(void *), void *arg, const char
 		ddekit_panic("Cannot allocate stack for new thread.");
 	su.stack = stack;
 
+	/* fault the stack in now instead of on the thread's hot path */
+	if (ddekit_prefault_enabled)
+		ddekit_prefault_touch(stack, DDEKIT_THREAD_STACK_SIZE);
+
 	/*
 	 * Setup new thread's attributes, namely stack address and stack size.
 	 *
@@ -0,0 +1,203 @@
+/**
+ * Allocation trace recorder
+ *
+ * Tracing is enabled by setting DDEKIT_ALLOC_TRACE to the name of the
+ * trace file. DDEKIT_ALLOC_TRACE_RING sets the ring size in records
+ * (default 65536, rounded up to a power of two).
+ *
+ * Producers reserve a ring slot with an atomic increment and mark it
+ * complete by storing its sequence number last. A flusher thread writes
+ * completed slots to the file. A producer that would overwrite a slot not
+ * yet written out waits for the flusher, so no records are lost.
+ */
+#define _GNU_SOURCE
+
+#include <ddekit/trace.h>
+#include <ddekit/printf.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING_DEFAULT  65536
+#define TRACE_FLUSH_NS      10000000   /* 10 ms */
+
+int ddekit_trace_enabled = 0;
+
+static struct ddekit_trace_record *trace_ring;
+static unsigned long trace_ring_size;    /* power of two */
+static unsigned long trace_head;         /* next slot to reserve */
+static unsigned long trace_tail;         /* next slot to write out */
+static int trace_fd = -1;
+
+static pthread_mutex_t trace_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* gettid() of the calling thread, 0 until its first record */
+static __thread unsigned long trace_tid;
+
+
+void ddekit_trace_record(int op, int cls, unsigned long cache,
+                         unsigned long size, unsigned long ptr)
+{
+	struct ddekit_trace_record *rec;
+	struct timespec ts;
+	unsigned long idx;
+
+	idx = __sync_fetch_and_add(&trace_head, 1);
+
+	/* ring full - wait until the flusher has written the old slot */
+	while (idx - *(volatile unsigned long *)&trace_tail >= trace_ring_size
+	       && *(volatile int *)&ddekit_trace_enabled)
+		sched_yield();
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (!trace_tid)
+		trace_tid = syscall(SYS_gettid);
+
+	rec = &trace_ring[idx & (trace_ring_size - 1)];
+	rec->ts     = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->thread = trace_tid;
+	rec->op     = op;
+	rec->cls    = cls;
+	rec->cache  = cache;
+	rec->size   = size;
+	rec->ptr    = ptr;
+
+	__sync_synchronize();
+	rec->seq    = idx + 1;
+}
+
+
+/**
+ * Write out a contiguous run of completed slots starting at the tail
+ */
+void ddekit_trace_flush(void)
+{
+	unsigned long tail, end, first, n;
+	size_t done, len;
+	ssize_t ret;
+
+	if (!ddekit_trace_enabled)
+		return;
+
+	pthread_mutex_lock(&trace_flush_lock);
+	tail = trace_tail;
+	for (end = tail; end != trace_head; end++) {
+		if (*(volatile unsigned long long *)&trace_ring[end & (trace_ring_size - 1)].seq != end + 1)
+			break;
+	}
+
+	while (tail != end) {
+		first = tail & (trace_ring_size - 1);
+		n = end - tail;
+		if (first + n > trace_ring_size)
+			n = trace_ring_size - first;
+
+		/* short writes continue where they stopped, records stay whole */
+		len = n * sizeof(*trace_ring);
+		for (done = 0; done < len && ddekit_trace_enabled; done += ret) {
+			ret = write(trace_fd, (char *)&trace_ring[first] + done, len - done);
+			if (ret < 0) {
+				ret = 0;
+				if (errno == EINTR)
+					continue;
+				ddekit_printf("%s: write failed (%d) %s, tracing stopped\n", __func__,
+				              errno, strerror(errno));
+				ddekit_trace_enabled = 0;
+			}
+		}
+
+		/* release the slots even on error, producers must not block */
+		tail += n;
+		__sync_synchronize();
+		trace_tail = tail;
+	}
+	pthread_mutex_unlock(&trace_flush_lock);
+}
+
+
+static void *trace_flusher(void *arg __attribute__((unused)))
+{
+	struct timespec delay = { 0, TRACE_FLUSH_NS };
+
+	while (ddekit_trace_enabled) {
+		nanosleep(&delay, NULL);
+		ddekit_trace_flush();
+	}
+
+	return NULL;
+}
+
+
+static void trace_exit(void)
+{
+	ddekit_trace_flush();
+}
+
+
+/**
+ * Set up tracing if requested by the environment
+ */
+void ddekit_trace_init(void)
+{
+	struct ddekit_trace_header hdr;
+	pthread_t flusher;
+	char *file, *env;
+
+	if (!(file = getenv("DDEKIT_ALLOC_TRACE")))
+		return;
+
+	trace_ring_size = TRACE_RING_DEFAULT;
+	if ((env = getenv("DDEKIT_ALLOC_TRACE_RING"))) {
+		unsigned long want = strtoul(env, NULL, 0);
+		for (trace_ring_size = 1; trace_ring_size < want; trace_ring_size <<= 1) ;
+	}
+
+	trace_ring = calloc(trace_ring_size, sizeof(*trace_ring));
+	if (!trace_ring) {
+		ddekit_printf("%s: no memory for %lu records\n", __func__, trace_ring_size);
+		return;
+	}
+
+	trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0) {
+		ddekit_printf("%s: error opening %s (%d) %s\n", __func__, file, errno, strerror(errno));
+		goto err;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DDEKIT_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.record_size = sizeof(struct ddekit_trace_record);
+	if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		ddekit_printf("%s: error writing %s (%d) %s\n", __func__, file, errno, strerror(errno));
+		goto err_close;
+	}
+
+	ddekit_trace_enabled = 1;
+
+	if (pthread_create(&flusher, NULL, trace_flusher, NULL)) {
+		ddekit_printf("%s: cannot start flusher\n", __func__);
+		ddekit_trace_enabled = 0;
+		goto err_close;
+	}
+	pthread_detach(flusher);
+	atexit(trace_exit);
+
+	ddekit_printf("%s: tracing allocations to %s (%lu records ring)\n", __func__,
+	              file, trace_ring_size);
+	return;
+
+err_close:
+	close(trace_fd);
+	trace_fd = -1;
+err:
+	free(trace_ring);
+	trace_ring = NULL;
+}
@@ -0,0 +1,460 @@
+/**
+ * Replay an allocation trace recorded with DDEKIT_ALLOC_TRACE
+ *
+ * The trace is replayed in record order by a single thread against one of
+ * the allocator backends below. Each allocation is touched once per page
+ * (unless -n is given), so the peak RSS reflects the allocator's memory
+ * footprint. Reported are throughput, latency percentiles per operation
+ * and the peak RSS.
+ *
+ * Nested records are skipped by default: only kmalloc(), kmem_cache (not
+ * the kmalloc size caches), page, coherent and contig records are replayed.
+ * Use -a to replay every record or -c to select classes.
+ *
+ * usage: alloc_replay [-b libc|ddekit] [-a] [-c class,...] [-n] trace
+ */
+#define _GNU_SOURCE
+
+#include <ddekit/trace.h>
+#include <ddekit/memory.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define PAGE_SIZE        4096UL
+#define KMALLOC_MIN      32UL
+#define KMALLOC_MAX      (128UL << 10)
+#define NR_KMALLOC       13             /* 32 B ... 128 KB */
+
+static const char *class_names[DDEKIT_TRACE_NR_CLASSES] = {
+	"simple", "slab", "large", "contig", "coherent", "kmalloc", "kmem_cache", "page"
+};
+
+
+/*************
+ ** Backends **
+ *************/
+
+struct backend
+{
+	const char *name;
+	void *(*alloc)(int cls, unsigned long cache, unsigned long size, void **ctx);
+	void  (*free)(int cls, void *ctx, void *ptr);
+};
+
+static void *libc_alloc(int cls, unsigned long cache, unsigned long size, void **ctx)
+{
+	void *p = NULL;
+
+	*ctx = NULL;
+	switch (cls) {
+	case DDEKIT_TRACE_LARGE:
+	case DDEKIT_TRACE_CONTIG:
+	case DDEKIT_TRACE_COHERENT:
+	case DDEKIT_TRACE_PAGE:
+		if (posix_memalign(&p, PAGE_SIZE, size))
+			p = NULL;
+		return p;
+	default:
+		return malloc(size ? size : 1);
+	}
+}
+
+static void libc_free(int cls, void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+
+/* one DDEKit slab per traced cache, created on first use */
+struct slab_map
+{
+	unsigned long       cache;
+	struct ddekit_slab *slab;
+	struct slab_map    *next;
+};
+
+static struct slab_map *slabs;
+static struct ddekit_slab *kmalloc_slabs[NR_KMALLOC];
+
+static struct ddekit_slab *slab_for(unsigned long cache, unsigned long size)
+{
+	struct slab_map *m;
+
+	for (m = slabs; m; m = m->next)
+		if (m->cache == cache)
+			return m->slab;
+
+	m = malloc(sizeof(*m));
+	m->cache = cache;
+	m->slab  = ddekit_slab_init(size, 1);
+	m->next  = slabs;
+	slabs = m;
+
+	return m->slab;
+}
+
+static void *ddekit_backend_alloc(int cls, unsigned long cache, unsigned long size, void **ctx)
+{
+	unsigned long cs;
+	int i;
+
+	*ctx = NULL;
+	switch (cls) {
+	case DDEKIT_TRACE_SLAB:
+	case DDEKIT_TRACE_KMEM_CACHE:
+		*ctx = slab_for(cache, size);
+		return ddekit_slab_alloc(*ctx);
+	case DDEKIT_TRACE_KMALLOC:
+		/* like DDE's kmalloc(): size caches plus back-pointer, then large */
+		size += sizeof(void *);
+		for (i = 0, cs = KMALLOC_MIN; i < NR_KMALLOC && cs < size; i++, cs <<= 1) ;
+		if (i == NR_KMALLOC)
+			return ddekit_large_malloc(size);
+		if (!kmalloc_slabs[i])
+			kmalloc_slabs[i] = ddekit_slab_init(cs, 1);
+		*ctx = kmalloc_slabs[i];
+		return ddekit_slab_alloc(*ctx);
+	case DDEKIT_TRACE_SIMPLE:
+		return ddekit_simple_malloc(size);
+	default:
+		return ddekit_large_malloc(size);
+	}
+}
+
+static void ddekit_backend_free(int cls, void *ctx, void *ptr)
+{
+	if (ctx)
+		ddekit_slab_free(ctx, ptr);
+	else if (cls == DDEKIT_TRACE_SIMPLE)
+		ddekit_simple_free(ptr);
+	else
+		ddekit_large_free(ptr);
+}
+
+static struct backend backends[] = {
+	{ "libc",   libc_alloc,           libc_free },
+	{ "ddekit", ddekit_backend_alloc, ddekit_backend_free },
+};
+
+
+/********************************
+ ** Traced -> replayed pointers **
+ ********************************/
+
+struct live
+{
+	unsigned long key;   /* traced pointer, 0 if empty, 1 if deleted */
+	void         *ptr;
+	void         *ctx;
+	int           cls;
+};
+
+static struct live *live;
+static unsigned long live_size;   /* power of two */
+static unsigned long live_used;   /* occupied or deleted slots */
+
+static unsigned long live_hash(unsigned long key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return key & (live_size - 1);
+}
+
+static struct live *live_find(unsigned long key, int insert)
+{
+	unsigned long i = live_hash(key);
+	struct live *tomb = NULL;
+
+	for (;; i = (i + 1) & (live_size - 1)) {
+		if (live[i].key == key)
+			return &live[i];
+		if (live[i].key == 1 && !tomb)
+			tomb = &live[i];
+		if (live[i].key == 0) {
+			if (!insert)
+				return NULL;
+			if (tomb)
+				return tomb;
+			live_used++;
+			return &live[i];
+		}
+	}
+}
+
+static void live_rehash(void)
+{
+	struct live *old = live;
+	unsigned long i, old_size = live_size;
+
+	live_size = live_size ? live_size * 2 : 1024;
+	live = calloc(live_size, sizeof(*live));
+	live_used = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].key > 1)
+			*live_find(old[i].key, 1) = old[i];
+	}
+	free(old);
+}
+
+
+/***************
+ ** Statistics **
+ ***************/
+
+struct lat
+{
+	unsigned *ns;
+	unsigned long nr;
+	unsigned long long sum;
+};
+
+static int cmp_unsigned(const void *a, const void *b)
+{
+	unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void lat_report(const char *name, struct lat *l)
+{
+	if (!l->nr) {
+		printf("%-6s: no operations\n", name);
+		return;
+	}
+
+	qsort(l->ns, l->nr, sizeof(*l->ns), cmp_unsigned);
+	printf("%-6s: %10lu ops, avg %6llu ns, p50 %6u ns, p99 %6u ns, p99.9 %7u ns, max %8u ns\n",
+	       name, l->nr, l->sum / l->nr,
+	       l->ns[l->nr / 2], l->ns[l->nr * 99 / 100],
+	       l->ns[l->nr * 999 / 1000], l->ns[l->nr - 1]);
+}
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long peak_rss_kb(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+
+/*************
+ ** Replay **
+ *************/
+
+static struct ddekit_trace_record *load(const char *file, unsigned long *nr)
+{
+	struct ddekit_trace_header hdr;
+	struct ddekit_trace_record *recs;
+	FILE *f;
+	long len;
+
+	if (!(f = fopen(file, "rb"))) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return NULL;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1
+	    || memcmp(hdr.magic, DDEKIT_TRACE_MAGIC, sizeof(hdr.magic))
+	    || hdr.record_size != sizeof(*recs)) {
+		fprintf(stderr, "%s: not a DDEKit allocation trace\n", file);
+		fclose(f);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f) - sizeof(hdr);
+	fseek(f, sizeof(hdr), SEEK_SET);
+
+	*nr = len / sizeof(*recs);
+	recs = malloc(*nr * sizeof(*recs) + 1);
+	if (!recs || fread(recs, sizeof(*recs), *nr, f) != *nr) {
+		fprintf(stderr, "%s: error reading %lu records\n", file, *nr);
+		fclose(f);
+		free(recs);
+		return NULL;
+	}
+	fclose(f);
+
+	return recs;
+}
+
+/**
+ * Default selection: skip kmem_cache records of the caches behind kmalloc()
+ */
+static int nested_kmalloc_cache(struct ddekit_trace_record *recs, unsigned long nr,
+                                unsigned long cache)
+{
+	static unsigned long *caches;
+	static unsigned long nr_caches = ~0UL;
+	unsigned long i, j;
+
+	if (nr_caches == ~0UL) {
+		nr_caches = 0;
+		for (i = 0; i < nr; i++) {
+			if (recs[i].cls != DDEKIT_TRACE_KMALLOC || !recs[i].cache)
+				continue;
+			for (j = 0; j < nr_caches && caches[j] != recs[i].cache; j++) ;
+			if (j == nr_caches) {
+				caches = realloc(caches, (nr_caches + 1) * sizeof(*caches));
+				caches[nr_caches++] = recs[i].cache;
+			}
+		}
+	}
+
+	for (j = 0; j < nr_caches; j++)
+		if (caches[j] == cache)
+			return 1;
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-b libc|ddekit] [-a] [-c class,...] [-n] trace\n"
+	                "  -b  allocator backend (default ddekit)\n"
+	                "  -a  replay all records, including nested ones\n"
+	                "  -c  replay only the given classes\n"
+	                "  -n  do not touch allocated memory\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct backend *be = &backends[1];
+	struct ddekit_trace_record *recs, *r;
+	struct lat alloc_lat = { 0 }, free_lat = { 0 };
+	unsigned long nr, i, skipped = 0, unmatched = 0;
+	unsigned long long t0, t1, start, elapsed;
+	unsigned mask = (1 << DDEKIT_TRACE_KMALLOC) | (1 << DDEKIT_TRACE_KMEM_CACHE)
+	              | (1 << DDEKIT_TRACE_PAGE) | (1 << DDEKIT_TRACE_COHERENT)
+	              | (1 << DDEKIT_TRACE_CONTIG);
+	int all = 0, touch = 1, c, cls;
+	long rss_before;
+	char *tok;
+	struct live *l;
+	void *ptr, *ctx;
+
+	while ((c = getopt(argc, argv, "b:ac:n")) != -1) {
+		switch (c) {
+		case 'b':
+			for (i = 0; i < sizeof(backends) / sizeof(*backends); i++)
+				if (!strcmp(optarg, backends[i].name))
+					break;
+			if (i == sizeof(backends) / sizeof(*backends))
+				usage(argv[0]);
+			be = &backends[i];
+			break;
+		case 'a':
+			all = 1;
+			mask = ~0U;
+			break;
+		case 'c':
+			mask = 0;
+			for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+				for (cls = 0; cls < DDEKIT_TRACE_NR_CLASSES; cls++)
+					if (!strcmp(tok, class_names[cls]))
+						break;
+				if (cls == DDEKIT_TRACE_NR_CLASSES)
+					usage(argv[0]);
+				mask |= 1 << cls;
+			}
+			all = 1;
+			break;
+		case 'n':
+			touch = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (!(recs = load(argv[optind], &nr)))
+		return 1;
+
+	alloc_lat.ns = malloc(nr * sizeof(unsigned));
+	free_lat.ns  = malloc(nr * sizeof(unsigned));
+	live_rehash();
+
+	rss_before = peak_rss_kb();
+	start = now_ns();
+
+	for (i = 0; i < nr; i++) {
+		r = &recs[i];
+		/* failed allocations and frees of NULL, 0 and 1 also mark live slots */
+		if (r->ptr <= 1 || r->cls >= DDEKIT_TRACE_NR_CLASSES || !(mask & (1 << r->cls))
+		    || (!all && r->cls == DDEKIT_TRACE_KMEM_CACHE
+		        && nested_kmalloc_cache(recs, nr, r->cache))) {
+			skipped++;
+			continue;
+		}
+
+		if (r->op == DDEKIT_TRACE_ALLOC) {
+			t0 = now_ns();
+			ptr = be->alloc(r->cls, r->cache, r->size, &ctx);
+			t1 = now_ns();
+			alloc_lat.ns[alloc_lat.nr++] = t1 - t0;
+			alloc_lat.sum += t1 - t0;
+
+			if (!ptr) {
+				fprintf(stderr, "record %lu: allocation of %llu bytes failed\n", i, r->size);
+				continue;
+			}
+			if (touch) {
+				unsigned long off;
+				for (off = 0; off < r->size; off += PAGE_SIZE)
+					((volatile char *)ptr)[off] = 0;
+			}
+
+			if (live_used * 2 >= live_size)
+				live_rehash();
+			l = live_find(r->ptr, 1);
+			if (l->key == r->ptr)   /* traced free missing, drop the old block */
+				be->free(l->cls, l->ctx, l->ptr);
+			l->key = r->ptr;
+			l->ptr = ptr;
+			l->ctx = ctx;
+			l->cls = r->cls;
+		} else {
+			if (!(l = live_find(r->ptr, 0)) || l->cls != r->cls) {
+				unmatched++;
+				continue;
+			}
+
+			t0 = now_ns();
+			be->free(l->cls, l->ctx, l->ptr);
+			t1 = now_ns();
+			free_lat.ns[free_lat.nr++] = t1 - t0;
+			free_lat.sum += t1 - t0;
+
+			l->key = 1;
+		}
+	}
+
+	elapsed = now_ns() - start;
+
+	printf("trace   : %s, %lu records, %lu skipped, %lu unmatched frees\n",
+	       argv[optind], nr, skipped, unmatched);
+	printf("backend : %s\n", be->name);
+	printf("replay  : %.3f ms, %.0f ops/s\n", elapsed / 1e6,
+	       (alloc_lat.nr + free_lat.nr) / (elapsed / 1e9));
+	lat_report("alloc", &alloc_lat);
+	lat_report("free", &free_lat);
+	printf("peak RSS: %ld KB (%ld KB before replay)\n", peak_rss_kb(), rss_before);
+
+	return 0;
+}
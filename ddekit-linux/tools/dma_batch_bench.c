@@ -0,0 +1,165 @@
+/**
+ * Compare syscalls per packet of single and batched uio_dma streaming mappings
+ *
+ * Models an RX ring of packet buffers that is refilled and completed over and
+ * over: every round maps one buffer per descriptor and unmaps them again.
+ * This is done once with one DMA_MAP/DMA_UNMAP ioctl per buffer (the path
+ * before DMA_MAP_BATCH) and once with DMA_MAP_BATCH/DMA_UNMAP_BATCH of up to
+ * batch buffers per ioctl. For both, the ioctls and the time per packet are
+ * printed.
+ *
+ * usage: dma_batch_bench [-n rounds] [-r ring size] [-b batch] [-l length] [device]
+ */
+#define _GNU_SOURCE
+
+#include <ddekit/dma.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#define DEFAULT_ROUNDS  1000
+#define DEFAULT_RING    256
+#define DEFAULT_LENGTH  2048
+
+static int dma_fd;
+static unsigned long ioctls;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int dma_ioctl(unsigned long cmd, void *arg, const char *what)
+{
+	ioctls++;
+	if (ioctl(dma_fd, cmd, arg)) {
+		perror(what);
+		return -1;
+	}
+	return 0;
+}
+
+static int round_single(struct dma_op *ops, unsigned int ring)
+{
+	unsigned int i;
+
+	for (i = 0; i < ring; i++)
+		if (dma_ioctl(DMA_MAP, &ops[i], "DMA_MAP"))
+			return -1;
+	for (i = 0; i < ring; i++)
+		if (dma_ioctl(DMA_UNMAP, &ops[i], "DMA_UNMAP"))
+			return -1;
+	return 0;
+}
+
+static int round_batch(struct dma_op *ops, unsigned int ring, unsigned int batch)
+{
+	struct dma_batch b;
+	unsigned int i;
+
+	for (i = 0; i < ring; i += b.nr) {
+		b.ops = (unsigned long)&ops[i];
+		b.nr = ring - i < batch ? ring - i : batch;
+		b.done = 0;
+		if (dma_ioctl(DMA_MAP_BATCH, &b, "DMA_MAP_BATCH"))
+			return -1;
+	}
+	for (i = 0; i < ring; i += b.nr) {
+		b.ops = (unsigned long)&ops[i];
+		b.nr = ring - i < batch ? ring - i : batch;
+		b.done = 0;
+		if (dma_ioctl(DMA_UNMAP_BATCH, &b, "DMA_UNMAP_BATCH"))
+			return -1;
+	}
+	return 0;
+}
+
+/* run rounds of one mode, print ioctls and ns per packet */
+static int bench(const char *name, struct dma_op *ops, unsigned long rounds,
+                 unsigned int ring, unsigned int batch)
+{
+	unsigned long long start, ns;
+	unsigned long r, packets = rounds * ring;
+	int ret;
+
+	ioctls = 0;
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		ret = batch ? round_batch(ops, ring, batch) : round_single(ops, ring);
+		if (ret)
+			return -1;
+	}
+	ns = now_ns() - start;
+
+	printf("%-8s %10lu packets %10lu ioctls %8.3f ioctls/packet %8.1f ns/packet\n",
+	       name, packets, ioctls, (double)ioctls / packets, (double)ns / packets);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long rounds = DEFAULT_ROUNDS, length = DEFAULT_LENGTH;
+	unsigned int ring = DEFAULT_RING, batch = DMA_BATCH_MAX, mode, i;
+	const char *dev = "/dev/uio0-dma";
+	struct dma_op *ops;
+	unsigned char *area;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:b:l:")) != -1) {
+		switch (opt) {
+		case 'n': rounds = strtoul(optarg, NULL, 0); break;
+		case 'r': ring = strtoul(optarg, NULL, 0); break;
+		case 'b': batch = strtoul(optarg, NULL, 0); break;
+		case 'l': length = strtoul(optarg, NULL, 0); break;
+		default:
+			fprintf(stderr, "usage: %s [-n rounds] [-r ring size] [-b batch] [-l length] [device]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		dev = argv[optind];
+	if (!ring || !length || !batch || batch > DMA_BATCH_MAX) {
+		fprintf(stderr, "ring size and length must be > 0, batch 1..%d\n", DMA_BATCH_MAX);
+		return 1;
+	}
+
+	if ((dma_fd = open(dev, O_RDWR)) < 0) {
+		perror(dev);
+		return 1;
+	}
+	if (ioctl(dma_fd, DMA_GET_MODE, &mode)) {
+		perror("DMA_GET_MODE");
+		return 1;
+	}
+
+	area = mmap(NULL, (size_t)ring * length, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	ops = calloc(ring, sizeof(*ops));
+	if (area == MAP_FAILED || !ops) {
+		perror("buffers");
+		return 1;
+	}
+	for (i = 0; i < ring; i++) {
+		ops[i].va = (unsigned long)area + (unsigned long)i * length;
+		ops[i].size = length;
+		ops[i].direction = DDEKIT_DMA_FROMDEVICE;
+	}
+
+	printf("%s: %s mode, %lu rounds of %u buffers of %lu bytes, batch %u\n", dev,
+	       mode == DMA_MODE_IOMMU ? "iommu" : "bounce", rounds, ring, length, batch);
+
+	if (bench("single", ops, rounds, ring, 0) ||
+	    bench("batch", ops, rounds, ring, batch))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,225 @@
+/**
+ * Stress uio_dma streaming mappings of random length
+ *
+ * Buffers of 1 byte to 1 MB at random offsets of a large anonymous area are
+ * mapped and unmapped through the DMA_MAP/DMA_UNMAP ioctls, with up to
+ * LIVE_MAPPINGS of them (possibly sharing pages) live at a time.
+ *
+ * With an IOMMU every page of a mapping is looked up with DMA_LOOKUP and
+ * compared with its physical address from /proc/self/pagemap (needs root).
+ * With bounce buffers the data is checked to survive the round trip through
+ * the bounce buffer.
+ *
+ * usage: dma_stress [-n iterations] [-s seed] [device]
+ */
+#define _GNU_SOURCE
+
+#include <ddekit/dma.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#define PAGE_SHIFT          12
+#define PAGE_SIZE           (1UL << PAGE_SHIFT)
+#define MAX_LEN             (1UL << 20)
+#define AREA_SIZE           (4 * MAX_LEN)
+#define LIVE_MAPPINGS       8
+#define DEFAULT_ITERATIONS  10000
+
+struct mapping
+{
+	struct dma_op op;
+	int live;
+};
+
+static int dma_fd;
+static int pagemap_fd;
+static int iommu;
+static unsigned long errors;
+
+/* physical address of va from /proc/self/pagemap, 0 if not present */
+static unsigned long va_to_phys(unsigned long va)
+{
+	uint64_t entry;
+
+	if (pread(pagemap_fd, &entry, sizeof(entry), (va >> PAGE_SHIFT) * sizeof(entry)) != sizeof(entry))
+		return 0;
+	if (!(entry & (1ULL << 63)))
+		return 0;
+	return (unsigned long)((entry & ((1ULL << 55) - 1)) << PAGE_SHIFT);
+}
+
+/* 1 byte to MAX_LEN, evenly spread over the orders of magnitude */
+static unsigned long random_len(void)
+{
+	unsigned long max = 1UL << (random() % 21);
+
+	return 1 + random() % max;
+}
+
+static void fill(unsigned char *p, unsigned long len, unsigned char seed)
+{
+	unsigned long i;
+
+	for (i = 0; i < len; i++)
+		p[i] = (unsigned char)(seed + i * 7);
+}
+
+static int check(const unsigned char *p, unsigned long len, unsigned char seed)
+{
+	unsigned long i;
+
+	for (i = 0; i < len; i++)
+		if (p[i] != (unsigned char)(seed + i * 7))
+			return -1;
+	return 0;
+}
+
+/* every page of the mapping must reach the page backing its va */
+static void verify_iommu(struct dma_op *op)
+{
+	unsigned long va, phys, dev;
+	struct dma_op lookup;
+
+	if (op->iova != op->va) {
+		fprintf(stderr, "va 0x%lx mapped at iova 0x%lx\n", op->va, op->iova);
+		errors++;
+		return;
+	}
+
+	for (va = op->va & ~(PAGE_SIZE - 1); va < op->va + op->size; va += PAGE_SIZE) {
+		memset(&lookup, 0, sizeof(lookup));
+		lookup.iova = va;
+		if (ioctl(dma_fd, DMA_LOOKUP, &lookup)) {
+			fprintf(stderr, "iova 0x%lx of mapping 0x%lx+%lu not mapped\n", va, op->va, op->size);
+			errors++;
+			continue;
+		}
+		dev = lookup.va & ~(PAGE_SIZE - 1);
+		phys = va_to_phys(va);
+		if (dev != phys) {
+			fprintf(stderr, "iova 0x%lx reaches 0x%lx, page is at 0x%lx\n", va, dev, phys);
+			errors++;
+		}
+	}
+}
+
+static int map(struct mapping *m, unsigned char *area)
+{
+	unsigned long len = random_len();
+	unsigned long off = random() % (AREA_SIZE - len + 1);
+
+	memset(&m->op, 0, sizeof(m->op));
+	m->op.va = (unsigned long)area + off;
+	m->op.size = len;
+	m->op.direction = DDEKIT_DMA_BIDIRECTIONAL;
+
+	fill((unsigned char *)m->op.va, len, (unsigned char)off);
+	if (ioctl(dma_fd, DMA_MAP, &m->op)) {
+		perror("DMA_MAP");
+		return -1;
+	}
+	m->live = 1;
+
+	if (iommu)
+		verify_iommu(&m->op);
+
+	return 0;
+}
+
+static int unmap(struct mapping *m, unsigned char *area)
+{
+	unsigned char seed = (unsigned char)(m->op.va - (unsigned long)area);
+
+	/* the bounce buffer has to bring the data back */
+	if (!iommu)
+		memset((void *)m->op.va, 0, m->op.size);
+
+	if (ioctl(dma_fd, DMA_UNMAP, &m->op)) {
+		perror("DMA_UNMAP");
+		return -1;
+	}
+	m->live = 0;
+
+	if (!iommu && check((unsigned char *)m->op.va, m->op.size, seed)) {
+		fprintf(stderr, "data of mapping 0x%lx+%lu lost\n", m->op.va, m->op.size);
+		errors++;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iterations = DEFAULT_ITERATIONS, i;
+	unsigned long bytes = 0;
+	unsigned int seed = 1;
+	const char *dev = "/dev/uio0-dma";
+	struct mapping live[LIVE_MAPPINGS];
+	unsigned int mode;
+	unsigned char *area;
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n': iterations = strtoul(optarg, NULL, 0); break;
+		case 's': seed = strtoul(optarg, NULL, 0); break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-s seed] [device]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		dev = argv[optind];
+	srandom(seed);
+
+	if ((dma_fd = open(dev, O_RDWR)) < 0) {
+		perror(dev);
+		return 1;
+	}
+
+	area = mmap(NULL, AREA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (area == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (ioctl(dma_fd, DMA_GET_MODE, &mode)) {
+		perror("DMA_GET_MODE");
+		return 1;
+	}
+	iommu = mode == DMA_MODE_IOMMU;
+
+	if (iommu && (pagemap_fd = open("/proc/self/pagemap", O_RDONLY)) < 0) {
+		perror("/proc/self/pagemap");
+		return 1;
+	}
+
+	printf("%s: %s mode, %lu iterations, seed %u\n", dev, iommu ? "iommu" : "bounce", iterations, seed);
+
+	memset(live, 0, sizeof(live));
+	for (i = 0; i < iterations; i++) {
+		n = random() % LIVE_MAPPINGS;
+		if (live[n].live) {
+			if (unmap(&live[n], area))
+				return 1;
+		} else {
+			if (map(&live[n], area))
+				return 1;
+			bytes += live[n].op.size;
+		}
+	}
+	for (n = 0; n < LIVE_MAPPINGS; n++)
+		if (live[n].live && unmap(&live[n], area))
+			return 1;
+
+	printf("%lu bytes mapped, %lu errors\n", bytes, errors);
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+/**
+ * Measure pgtab lookup cost depending on the number of regions
+ *
+ * For each region count, regions of 1-16 pages are registered at random
+ * virtual and physical addresses, then random addresses inside them are
+ * translated in both directions. The cost of a linear region list (the
+ * former pgtab implementation) is printed for comparison. With -w a
+ * writer thread keeps adding and removing regions during the lookups.
+ *
+ * usage: pgtab_bench [-n lookups] [-w] [regions ...]
+ */
+#define _GNU_SOURCE
+
+#include <ddekit/pgtab.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#define PAGE_SHIFT       12
+#define PAGE_SIZE        (1UL << PAGE_SHIFT)
+#define REGION_PAGES     16
+#define DEFAULT_LOOKUPS  1000000
+
+extern void ddekit_pgtab_init(void);
+
+struct region
+{
+	unsigned long va;
+	unsigned long pa;
+	unsigned long size;
+};
+
+static volatile int writer_stop;
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* random but disjoint regions: slot i is REGION_PAGES pages at a shuffled position */
+static struct region *make_regions(unsigned long nr, unsigned long va_base, unsigned long pa_base)
+{
+	struct region *r = malloc(nr * sizeof(*r));
+	unsigned long *slots = malloc(nr * sizeof(*slots));
+	unsigned long i, j, t;
+
+	for (i = 0; i < nr; i++)
+		slots[i] = i;
+	for (i = nr - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		t = slots[i]; slots[i] = slots[j]; slots[j] = t;
+	}
+
+	for (i = 0; i < nr; i++) {
+		r[i].va   = va_base + i * REGION_PAGES * PAGE_SIZE;
+		r[i].pa   = pa_base + slots[i] * REGION_PAGES * PAGE_SIZE;
+		r[i].size = (1 + random() % REGION_PAGES) * PAGE_SIZE;
+	}
+	free(slots);
+
+	return r;
+}
+
+/* reference: the former linear list lookup */
+static unsigned long list_physaddr(struct region *r, unsigned long nr, unsigned long va)
+{
+	unsigned long i;
+
+	for (i = 0; i < nr; i++)
+		if (va >= r[i].va && va < r[i].va + r[i].size)
+			return r[i].pa + (va - r[i].va);
+	return va;
+}
+
+static void *writer(void *arg)
+{
+	struct region *r = make_regions(64, 0x7000000000UL, 0x70000000000UL);
+	unsigned long i = 0;
+
+	while (!writer_stop) {
+		ddekit_pgtab_set_region((void *)r[i].va, r[i].pa, r[i].size >> PAGE_SHIFT, PTE_TYPE_OTHER);
+		ddekit_pgtab_clear_region((void *)r[i].va, PTE_TYPE_OTHER);
+		i = (i + 1) % 64;
+	}
+	free(r);
+
+	return NULL;
+}
+
+static void bench(unsigned long nr, unsigned long lookups, int with_writer)
+{
+	struct region *r;
+	unsigned long i, k, off, errors = 0;
+	unsigned long *idx;
+	unsigned long long t0, t_virt, t_phys, t_list;
+	volatile unsigned long sink = 0;
+	pthread_t w;
+
+	r = make_regions(nr, 0x100000000UL, 0x1000000000UL);
+	for (i = 0; i < nr; i++)
+		ddekit_pgtab_set_region((void *)r[i].va, r[i].pa, r[i].size >> PAGE_SHIFT, PTE_TYPE_OTHER);
+
+	/* precomputed random targets, so the loops only measure lookups */
+	idx = malloc(lookups * sizeof(*idx));
+	for (i = 0; i < lookups; i++)
+		idx[i] = random() % nr;
+
+	if (with_writer) {
+		writer_stop = 0;
+		pthread_create(&w, NULL, writer, NULL);
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < lookups; i++) {
+		k = idx[i];
+		off = (i * PAGE_SIZE + i) % r[k].size;
+		if (ddekit_pgtab_get_physaddr((void *)(r[k].va + off)) != r[k].pa + off)
+			errors++;
+	}
+	t_virt = now_ns() - t0;
+
+	t0 = now_ns();
+	for (i = 0; i < lookups; i++) {
+		k = idx[i];
+		off = (i * PAGE_SIZE + i) % r[k].size;
+		if (ddekit_pgtab_get_virtaddr(r[k].pa + off) != r[k].va + off)
+			errors++;
+	}
+	t_phys = now_ns() - t0;
+
+	if (with_writer) {
+		writer_stop = 1;
+		pthread_join(w, NULL);
+	}
+
+	/* the list is slow, fewer lookups suffice */
+	t0 = now_ns();
+	for (i = 0; i < lookups / 16; i++) {
+		k = idx[i];
+		sink += list_physaddr(r, nr, r[k].va);
+	}
+	t_list = (now_ns() - t0) * 16;
+
+	printf("%8lu regions: virt->phys %6.1f ns, phys->virt %6.1f ns, list %9.1f ns, %lu errors\n",
+	       nr, (double)t_virt / lookups, (double)t_phys / lookups,
+	       (double)t_list / lookups, errors);
+
+	for (i = 0; i < nr; i++)
+		ddekit_pgtab_clear_region((void *)r[i].va, PTE_TYPE_OTHER);
+	free(idx);
+	free(r);
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned long defaults[] = { 16, 256, 1024, 4096, 16384 };
+	unsigned long lookups = DEFAULT_LOOKUPS;
+	int with_writer = 0, c, i;
+
+	while ((c = getopt(argc, argv, "n:w")) != -1) {
+		switch (c) {
+		case 'n': lookups = strtoul(optarg, NULL, 0); break;
+		case 'w': with_writer = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-n lookups] [-w] [regions ...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	ddekit_pgtab_init();
+	srandom(1);
+
+	if (optind == argc) {
+		for (i = 0; i < (int)(sizeof(defaults) / sizeof(*defaults)); i++)
+			bench(defaults[i], lookups, with_writer);
+	} else {
+		for (i = optind; i < argc; i++)
+			bench(strtoul(argv[i], NULL, 0), lookups, with_writer);
+	}
+
+	return 0;
+}
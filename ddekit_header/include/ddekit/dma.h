@@ -17,6 +17,47 @@
 #define DMA_FREE        _IOWR(DMA_MAGIC, 4, struct dma_op)
 #define DMA_IOMMU_MAP   _IOWR(DMA_MAGIC, 5, struct dma_op)
 #define DMA_IOMMU_UNMAP _IOWR(DMA_MAGIC, 6, struct dma_op)
+#define DMA_REGISTER    _IOWR(DMA_MAGIC, 7, struct dma_op)
+#define DMA_UNREGISTER  _IOWR(DMA_MAGIC, 8, struct dma_op)
+#define DMA_MAP_BATCH   _IOWR(DMA_MAGIC, 9, struct dma_batch)
+#define DMA_UNMAP_BATCH _IOWR(DMA_MAGIC, 10, struct dma_batch)
+
+#define DMA_RING_SETUP  _IOWR(DMA_MAGIC, 11, struct dma_ring_setup)
+#define DMA_RING_ENTER  _IO(DMA_MAGIC, 12)
+
+/* physical address reached at op.iova, returned in op.va (testing only) */
+#define DMA_LOOKUP      _IOWR(DMA_MAGIC, 13, struct dma_op)
+
+/* DMA_MODE_* the device runs in */
+#define DMA_GET_MODE    _IOR(DMA_MAGIC, 14, unsigned int)
+
+#define DMA_MODE_BOUNCE 0   /* bounce buffers, bus address is physical */
+#define DMA_MODE_IOMMU  1   /* IOMMU mappings at iova == va */
+
+/*
+ * Sync op.size bytes at offset op.va of the mapping at op.iova, for the CPU
+ * (DDEKIT_DMA_FROMDEVICE) or for the device (DDEKIT_DMA_TODEVICE)
+ */
+#define DMA_SYNC        _IOWR(DMA_MAGIC, 15, struct dma_op)
+
+/* largest number of operations per DMA_MAP_BATCH/DMA_UNMAP_BATCH */
+#define DMA_BATCH_MAX   256
+
+/* mmap() offset of the submission/completion ring on /dev/uioN-dma */
+#define DMA_RING_PGOFF        0x10000UL
+#define DMA_RING_MAX_ENTRIES  4096
+
+/* dma_ring_setup.flags */
+#define DMA_RING_SETUP_POLL   1   /* consume the ring in a kernel thread */
+
+/* dma_ring.flags */
+#define DMA_RING_NEED_WAKEUP  1   /* consumer sleeps, ring DMA_RING_ENTER */
+
+/* dma_ring_sqe.opcode */
+#define DMA_RING_OP_MAP       1
+#define DMA_RING_OP_UNMAP     2
+
+#define DMA_RING_CACHELINE    64
 
 typedef unsigned int ddekit_dma_dir_t;
 
@@ -32,7 +73,127 @@ struct dma_op {
 	unsigned int  direction;
 };
 
-ddekit_addr_t ddekit_dma_map_single(ddekit_addr_t, unsigned int, ddekit_dma_dir_t);
-void ddekit_dma_unmap_single(ddekit_addr_t, unsigned int, ddekit_dma_dir_t);
-EXTERN_C void * ddekit_dma_alloc_coherent(int, ddekit_addr_t *);
-EXTERN_C void ddekit_dma_free_coherent(void *, int, ddekit_addr_t);
+/**
+ * Batch of map or unmap operations
+ *
+ * ops points to nr struct dma_op, map operations return their iova in
+ * place. Mapping is all or nothing; unmapping processes every operation.
+ * done returns the number of operations processed.
+ */
+struct dma_batch {
+	unsigned long ops;
+	unsigned int  nr;
+	unsigned int  done;
+};
+
+/**
+ * Shared submission/completion ring
+ *
+ * DMA_RING_SETUP allocates the ring, mmap() at DMA_RING_PGOFF maps it.
+ * The header is followed by entries struct dma_ring_sqe and entries
+ * struct dma_ring_cqe. ddekit produces submissions at sq_tail, uio_dma
+ * consumes them at sq_head and produces completions at cq_tail. Map
+ * operations and failed unmap operations complete with the tag of their
+ * submission. Indexes run freely and are masked with entries - 1.
+ *
+ * The consumer runs in a kernel thread (DMA_RING_SETUP_POLL) or on
+ * DMA_RING_ENTER, any other ioctl and poll(). A polling thread that went
+ * idle sets DMA_RING_NEED_WAKEUP and must be woken by DMA_RING_ENTER.
+ */
+struct dma_ring {
+	unsigned int  sq_head;
+	unsigned int  flags;
+	unsigned char pad0[DMA_RING_CACHELINE - 2 * sizeof(unsigned int)];
+	unsigned int  sq_tail;
+	unsigned char pad1[DMA_RING_CACHELINE - sizeof(unsigned int)];
+	unsigned int  cq_head;
+	unsigned char pad2[DMA_RING_CACHELINE - sizeof(unsigned int)];
+	unsigned int  cq_tail;
+	unsigned int  entries;
+	unsigned char pad3[DMA_RING_CACHELINE - 2 * sizeof(unsigned int)];
+};
+
+struct dma_ring_sqe {
+	struct dma_op op;
+	unsigned long tag;     /* 0: complete only on error */
+	unsigned int  opcode;
+};
+
+struct dma_ring_cqe {
+	unsigned long tag;
+	unsigned long iova;
+	long          result;  /* 0 or negative errno */
+};
+
+#define DMA_RING_SQ(r) ((struct dma_ring_sqe *)((char *)(r) + sizeof(struct dma_ring)))
+#define DMA_RING_CQ(r) ((struct dma_ring_cqe *)(DMA_RING_SQ(r) + (r)->entries))
+#define DMA_RING_SIZE(entries) (sizeof(struct dma_ring) + (entries) * \
+                                (sizeof(struct dma_ring_sqe) + sizeof(struct dma_ring_cqe)))
+
+struct dma_ring_setup {
+	unsigned int  entries;   /* power of two, at most DMA_RING_MAX_ENTRIES */
+	unsigned int  flags;     /* DMA_RING_SETUP_* */
+	unsigned int  idle_us;   /* polling time before the thread sleeps */
+	unsigned long size;      /* returns the size to mmap() */
+};
+
+/* latency histograms, bucket i counts calls of less than 2^i ns */
+#define DDEKIT_DMA_HIST_BUCKETS 32
+
+/** Streaming DMA accounting */
+struct ddekit_dma_stats {
+	unsigned long streaming_bytes;  /* bytes under in-flight mappings */
+	unsigned long mappings;         /* in-flight mappings */
+	unsigned long map_calls;        /* mappings since startup */
+	unsigned long unmap_calls;      /* unmappings since startup */
+	unsigned long ioctls;           /* map/unmap system calls since startup */
+	unsigned long lookups;          /* mappings of pre-mapped memory, no system call */
+	unsigned long syncs;            /* ddekit_dma_sync_single() calls since startup */
+	unsigned long map_hist[DDEKIT_DMA_HIST_BUCKETS];    /* mapping system calls */
+	unsigned long unmap_hist[DDEKIT_DMA_HIST_BUCKETS];  /* unmapping system calls */
+};
+
+/** Scatter-gather segment */
+struct ddekit_dma_seg {
+	ddekit_addr_t addr;   /* buffer address as for ddekit_dma_map_single() */
+	unsigned int  size;
+	ddekit_addr_t dma;    /* bus address, returned by ddekit_dma_map_sg() */
+};
+
+struct ddekit_dma_ring;
+
+/**
+ * DMA context of a device, one per /dev/uioN-dma
+ *
+ * Every device maps through its own file descriptor, so it gets its own
+ * IOMMU domain and bounce buffers. The primary context belongs to the first
+ * PCI device; memory mapped once at startup (coherent arena, page pool)
+ * is mapped for this device only. All functions take NULL for the primary
+ * context.
+ */
+struct ddekit_dma_ctx {
+	int                     fd;        /* /dev/uioN-dma */
+	int                     uio_id;
+	unsigned int            mode;      /* DMA_MODE_* */
+	int                     primary;   /* pre-mapped memory is usable */
+	unsigned long long      dma_mask;  /* highest bus address the device reaches */
+	struct ddekit_dma_ring *ring;      /* submission ring, NULL for ioctls */
+	struct ddekit_dma_ctx  *next;
+};
+
+EXTERN_C struct ddekit_dma_ctx *ddekit_dma_ctx_open(int uio_id);
+EXTERN_C struct ddekit_dma_ctx *ddekit_dma_ctx_get(struct ddekit_dma_ctx *);
+EXTERN_C void ddekit_dma_ctx_set_mask(struct ddekit_dma_ctx *, unsigned long long);
+
+ddekit_addr_t ddekit_dma_map_single(struct ddekit_dma_ctx *, ddekit_addr_t, unsigned int, ddekit_dma_dir_t);
+void ddekit_dma_unmap_single(struct ddekit_dma_ctx *, ddekit_addr_t, unsigned int, ddekit_dma_dir_t);
+int ddekit_dma_map_batch(struct ddekit_dma_ctx *, struct dma_op *, unsigned int);
+void ddekit_dma_unmap_batch(struct ddekit_dma_ctx *, struct dma_op *, unsigned int);
+int ddekit_dma_map_sg(struct ddekit_dma_ctx *, struct ddekit_dma_seg *, unsigned int, ddekit_dma_dir_t);
+void ddekit_dma_unmap_sg(struct ddekit_dma_ctx *, struct ddekit_dma_seg *, unsigned int, ddekit_dma_dir_t);
+void ddekit_dma_sync_single(struct ddekit_dma_ctx *, ddekit_addr_t, unsigned long, unsigned int,
+                            ddekit_dma_dir_t);
+EXTERN_C void * ddekit_dma_alloc_coherent(struct ddekit_dma_ctx *, int, ddekit_addr_t *);
+EXTERN_C void ddekit_dma_free_coherent(struct ddekit_dma_ctx *, void *, int, ddekit_addr_t);
+EXTERN_C void ddekit_dma_get_stats(struct ddekit_dma_stats *);
+EXTERN_C int ddekit_dma_add_static(ddekit_addr_t, unsigned long, ddekit_addr_t);
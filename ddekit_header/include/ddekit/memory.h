@@ -18,6 +18,7 @@
 #pragma once
 
 #include <ddekit/compiler.h>
+#include <ddekit/types.h>
 
 EXTERN_C_BEGIN
 
@@ -61,6 +62,46 @@ void *ddekit_slab_alloc(struct ddekit_slab * slab);
  */
 void ddekit_slab_free(struct ddekit_slab * slab, void *objp);
 
+/**
+ * Deallocate several slabs in slab cache
+ *
+ * \param slab  pointer to slab cache
+ * \param nr    number of slabs
+ * \param objs  array of allocated slabs
+ */
+void ddekit_slab_free_bulk(struct ddekit_slab * slab, unsigned nr, void **objs);
+
+/**
+ * Populate slab cache with touched objects
+ *
+ * \param slab  pointer to slab cache
+ * \param nr    number of objects
+ *
+ * The cache keeps at least nr free objects from then on.
+ *
+ * \return number of objects added (less than nr if out of memory)
+ */
+int ddekit_slab_prefault(struct ddekit_slab * slab, unsigned nr);
+
+/** Slab cache accounting */
+struct ddekit_slab_stats
+{
+	unsigned long obj_size;    /**< size of objects */
+	unsigned long active;      /**< objects in use */
+	unsigned long total;       /**< objects in use or cached for reuse */
+	unsigned long high_water;  /**< maximum of active objects */
+	unsigned long allocs;      /**< allocations since creation */
+	unsigned long frees;       /**< deallocations since creation */
+};
+
+/**
+ * Read accounting information of slab cache
+ *
+ * \param slab   pointer to slab cache
+ * \param stats  filled with the current counters
+ */
+void ddekit_slab_get_stats(struct ddekit_slab * slab, struct ddekit_slab_stats *stats);
+
 /**
  * Setup page cache for all slabs
  *
@@ -110,7 +151,7 @@ struct ddekit_slab * ddekit_slab_init(unsigned size, int contiguous);
  * want.
  *
  * Allocated blocks have valid virt->phys mappings and are physically
- * contiguous.
+ * contiguous. Blocks are page-aligned.
  */
 void *ddekit_large_malloc(int size);
 
@@ -121,7 +162,17 @@ void *ddekit_large_malloc(int size);
  */
 void  ddekit_large_free(void *p);
 
-/** FIXME
+/**
+ * Allocate physically contiguous memory block
+ *
+ * \param size       block size
+ * \param low        lowest acceptable physical address
+ * \param high       highest acceptable physical address
+ * \param alignment  physical alignment (power of two, 0 for none)
+ * \param boundary   block must not cross a multiple of boundary (power of
+ *                   two, 0 for none)
+ * \return pointer to new memory block, release with ddekit_large_free()
+ *
  * contig_malloc() is the lowest-level allocator interface one could implement.
  * we should consider to provide vmalloc() too. */
 void *ddekit_contig_malloc(
@@ -131,6 +182,31 @@ void *ddekit_contig_malloc(
 );
 
 
+/******************************
+ ** Streaming DMA page pool  **
+ ******************************/
+
+/**
+ * Allocate a page of the streaming DMA pool
+ *
+ * \param dma_addr  returns the bus address of the page, may be 0
+ * \return page-aligned page or 0 if the pool is empty or disabled
+ *
+ * Pool pages are mapped for DMA once at startup, ddekit_dma_map_single()
+ * and ddekit_dma_unmap_single() of buffers within a pool page only look up
+ * its bus address.
+ */
+void *ddekit_dma_page_alloc(ddekit_addr_t *dma_addr);
+
+/**
+ * Return a page to the streaming DMA pool
+ *
+ * \param page  any address within the page
+ * \return 0 on success, -1 if the page is not from the pool
+ */
+int ddekit_dma_page_free(void *page);
+
+
 /*****************************
  ** Simple memory allocator **
  *****************************/
@@ -153,4 +229,43 @@ void *ddekit_simple_malloc(unsigned size);
  */
 void ddekit_simple_free(void *p);
 
+
+/****************
+ ** Accounting **
+ ****************/
+
+/** Accounting of large blocks and DMA memory, all sizes in bytes */
+struct ddekit_mem_stats
+{
+	unsigned long large_bytes;      /**< large blocks in use */
+	unsigned long large_cached;     /**< large blocks cached for reuse */
+	unsigned long coherent_bytes;   /**< coherent memory in use from the arena */
+	unsigned long coherent_arena;   /**< size of the coherent arena */
+	unsigned long coherent_mapped;  /**< coherent memory mapped per allocation */
+	unsigned long contig_bytes;     /**< contig_malloc() memory in use */
+	unsigned long contig_pool;      /**< size of the contiguous pool */
+	unsigned long pool_bytes;       /**< streaming page pool in use */
+	unsigned long pool_size;        /**< size of the streaming page pool */
+	unsigned long streaming_bytes;  /**< memory under streaming DMA mappings */
+	unsigned long mappings;         /**< in-flight streaming DMA mappings */
+	unsigned long map_calls;        /**< streaming DMA (un)mappings since startup */
+	unsigned long dma_ioctls;       /**< system calls issued for them */
+	unsigned long dma_lookups;      /**< mappings of pre-mapped memory */
+};
+
+/**
+ * Read accounting information of large blocks and DMA memory
+ */
+void ddekit_mem_get_stats(struct ddekit_mem_stats *stats);
+
+/**
+ * Print accounting information of large blocks and DMA memory
+ *
+ * \param buf  destination buffer
+ * \param len  size of buf
+ *
+ * \return number of characters written
+ */
+int ddekit_mem_dump_stats(char *buf, int len);
+
 EXTERN_C_END
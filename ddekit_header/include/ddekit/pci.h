@@ -213,4 +213,12 @@ char const *ddekit_pci_get_slot_name(struct ddekit_pci_dev *dev);
  */
 ddekit_pci_res_t *ddekit_pci_get_resource(struct ddekit_pci_dev *dev, unsigned int idx);
 
+/** Get the DMA context of a device, opened on first use
+ * \ingroup DDEKit_pci
+ *
+ * \return context or NULL if the device is unknown or has no uio_dma device
+ */
+struct ddekit_dma_ctx;
+struct ddekit_dma_ctx *ddekit_pci_get_dma_ctx(int bus, int slot, int func);
+
 EXTERN_C_END
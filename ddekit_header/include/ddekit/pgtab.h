@@ -95,4 +95,29 @@ int ddekit_pgtab_get_type(const void *virt);
  */
 int ddekit_pgtab_get_size(const void *virt);
 
+/**
+ * Translate virt address of unregistered memory via /proc/self/pagemap
+ *
+ * Only available if enabled with DDEKIT_PAGEMAP=1 and the process has
+ * CAP_SYS_ADMIN. Valid for memory that stays resident (pinned). The
+ * result is a physical address, which is the bus address only without
+ * IOMMU. Translations of the buffer are cached until
+ * ddekit_pgtab_pagemap_invalidate() of it.
+ *
+ * \param virt  virt address
+ * \param size  size of the buffer at virt
+ * \param phys  receives the phys address
+ *
+ * \return 0 on success, -1 if not translatable
+ */
+int ddekit_pgtab_pagemap_translate(const void *virt, unsigned long size, ddekit_addr_t *phys);
+
+/**
+ * Drop cached pagemap translations of a VM range, e.g., before unmapping it
+ *
+ * \param virt  virt start address
+ * \param size  size in bytes
+ */
+void ddekit_pgtab_pagemap_invalidate(const void *virt, unsigned long size);
+
 EXTERN_C_END
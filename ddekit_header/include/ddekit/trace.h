@@ -0,0 +1,96 @@
+/*
+ * This file is part of DDEKit.
+ *
+ * This file is part of TUD:OS and distributed under the terms of the
+ * GNU General Public License 2.
+ * Please see the COPYING-GPL-2 file for details.
+ */
+
+/*
+ * \brief   Allocation tracing
+ *
+ * If enabled, every allocation and deallocation of the DDEKit and DDE
+ * allocators is recorded in a ring buffer that is drained to a file.
+ * The file starts with a struct ddekit_trace_header followed by
+ * struct ddekit_trace_record entries in order of their reservation.
+ */
+
+#pragma once
+
+#include <ddekit/compiler.h>
+
+EXTERN_C_BEGIN
+
+#define DDEKIT_TRACE_MAGIC   "DDEKTRC1"
+
+/** Operation of a trace record */
+enum ddekit_trace_op
+{
+	DDEKIT_TRACE_ALLOC = 1,
+	DDEKIT_TRACE_FREE  = 2,
+};
+
+/** Allocator that produced a trace record */
+enum ddekit_trace_class
+{
+	DDEKIT_TRACE_SIMPLE = 0,  /**< ddekit_simple_malloc() */
+	DDEKIT_TRACE_SLAB,        /**< ddekit_slab_alloc(), cache is the slab */
+	DDEKIT_TRACE_LARGE,       /**< ddekit_large_malloc() */
+	DDEKIT_TRACE_CONTIG,      /**< ddekit_contig_malloc() */
+	DDEKIT_TRACE_COHERENT,    /**< ddekit_dma_alloc_coherent() */
+	DDEKIT_TRACE_KMALLOC,     /**< kmalloc() */
+	DDEKIT_TRACE_KMEM_CACHE,  /**< kmem_cache_alloc(), cache is the kmem_cache */
+	DDEKIT_TRACE_PAGE,        /**< __get_free_pages() */
+	DDEKIT_TRACE_NR_CLASSES
+};
+
+struct ddekit_trace_header
+{
+	char               magic[8];     /**< DDEKIT_TRACE_MAGIC */
+	unsigned int       record_size;  /**< sizeof(struct ddekit_trace_record) */
+	unsigned int       reserved;
+};
+
+struct ddekit_trace_record
+{
+	unsigned long long seq;     /**< record number + 1, 0 while being written */
+	unsigned long long ts;      /**< CLOCK_MONOTONIC in ns */
+	unsigned long long cache;   /**< slab/cache identity, 0 for none */
+	unsigned long long size;    /**< requested size, 0 if unknown on free */
+	unsigned long long ptr;     /**< allocated or freed pointer */
+	unsigned int       thread;  /**< kernel thread id */
+	unsigned short     op;      /**< enum ddekit_trace_op */
+	unsigned short     cls;     /**< enum ddekit_trace_class */
+};
+
+/** Non-zero if tracing is active */
+extern int ddekit_trace_enabled;
+
+/**
+ * Record an allocator operation, use the macros below instead
+ */
+void ddekit_trace_record(int op, int cls, unsigned long cache,
+                         unsigned long size, unsigned long ptr);
+
+#define ddekit_trace_alloc(cls, cache, size, ptr)                              \
+	do {                                                                   \
+		if (ddekit_trace_enabled)                                      \
+			ddekit_trace_record(DDEKIT_TRACE_ALLOC, cls,           \
+			                    (unsigned long)(cache), size,      \
+			                    (unsigned long)(ptr));             \
+	} while (0)
+
+#define ddekit_trace_free(cls, cache, size, ptr)                               \
+	do {                                                                   \
+		if (ddekit_trace_enabled)                                      \
+			ddekit_trace_record(DDEKIT_TRACE_FREE, cls,            \
+			                    (unsigned long)(cache), size,      \
+			                    (unsigned long)(ptr));             \
+	} while (0)
+
+/**
+ * Write all completed records to the trace file
+ */
+void ddekit_trace_flush(void);
+
+EXTERN_C_END